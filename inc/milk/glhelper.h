@@ -142,6 +142,9 @@ namespace milk
 	inline void glUniform(GLint location, const CMatrix4f& m)
 	{ glUniformMatrix4fvARB(location, 1, GL_FALSE, reinterpret_cast<const float*>(&m)); }
 
+	inline void glUniform(GLint location, const CMatrix4f *m, GLsizei count)
+	{ glUniformMatrix4fvARB(location, count, GL_FALSE, reinterpret_cast<const float*>(m)); }
+
 	/////////////////////////////////////////////////////////////////
 
 	inline void glVertexAttrib(GLint index, GLshort i)
@@ -305,6 +308,9 @@ namespace milk
 	template<> struct glType<CVector4d>
 	{ enum { type = GL_DOUBLE }; enum { components = 4 }; enum { size = sizeof(GLdouble)*4 }; };
 
+	template<> struct glType<CColor4ub>
+	{ enum { type = GL_UNSIGNED_BYTE }; enum { components = 4 }; enum { size = sizeof(GLubyte)*4 }; };
+
 	template<> struct glType<CMatrix3f>
 	{ enum { type = GL_FLOAT }; enum { components = 9 }; enum { size = sizeof(GLfloat)*9 }; };
 
@@ -68,6 +68,24 @@ namespace milk
 		virtual void update()=0;
 		virtual void render()=0;
 
+		/// Simulate in fixed steps
+		/**
+			With a step above zero run() calls update() as many times as
+			needed to advance the time in steps of exactly step seconds, but at
+			most maxSteps times per loop so a slow frame can't snowball, and
+			render() once per loop. Timer::frametime() returns the step.
+			Scene nodes with ISceneNode::setInterpolated() are rendered between
+			their last two steps, see getInterpolation(). Zero turns it off.
+		*/
+		void setFixedStep(double step, int maxSteps = 8);
+
+		double getFixedStep() const
+		{ return m_fixedStep; }
+
+		/// How far the time has come from the last step towards the next, in [0, 1)
+		double getInterpolation() const
+		{ return m_interpolation; }
+
 		/////////////////////////////////////////////
 
 		static IWindow *getInstance()
@@ -90,6 +108,12 @@ namespace milk
 		// Clamp mode
 		int m_clamp;
 
+		// Fixed step simulation
+		double m_fixedStep;
+		double m_accumulator;
+		double m_interpolation;
+		int m_maxSteps;
+
 		// pointer to the created window. 0 if no window present
 		static IWindow *ms_instance;
 
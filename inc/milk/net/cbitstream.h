@@ -0,0 +1,129 @@
+#ifndef MILK_NET_BITSTREAM_H_
+#define MILK_NET_BITSTREAM_H_
+
+#include "milk/net/cpacket.h"
+#include "milk/math/cvector.h"
+
+namespace milk
+{
+	template<class F> class CQuaternion;
+
+	/// writes values with as few bits as needed to the end of a packet
+	/**	Bits are packed least significant first, across byte borders.
+		Whole bytes are appended to the packet as they fill up, the last
+		byte is padded when flush() is called or the writer is destroyed.
+		Everything written must be read back in the same order with the
+		same arguments by a CBitReader.
+
+		CPacket p;
+		{
+			CBitWriter bits(p);
+			bits.writeBool(alive);
+			bits.writeVarint(health);
+			bits.writeQuantized(position.x, -1024.0f, 1024.0f, 20);
+			bits.writeUnitVector(direction, 12);
+		}
+		*/
+	class CBitWriter
+	{
+	public:
+		explicit CBitWriter(CPacket& packet)
+			: m_packet(packet), m_scratch(0), m_scratchBits(0), m_bitsWritten(0)
+		{ }
+
+		~CBitWriter()
+		{ flush(); }
+
+		/// the lowest bits of value, 0 to 32 bits
+		void writeBits(uint value, int bits);
+
+		void writeBool(bool b)
+		{ writeBits(b ? 1 : 0, 1); }
+
+		/// 7 bits at a time, small values take few bytes
+		void writeVarint(uint value);
+
+		/// zig-zag encoded varint, small negative values take few bytes too
+		void writeSigned(int value)
+		{ writeVarint((static_cast<uint>(value) << 1) ^ static_cast<uint>(value >> 31)); }
+
+		/// all 32 bits of a float
+		void writeFloat(float value);
+
+		/// a float in [min, max] with bits of precision, values outside are clamped
+		void writeQuantized(float value, float min, float max, int bits);
+
+		/// a normalized vector in 2*bits bits, octahedron encoded
+		void writeUnitVector(const CVector3f& v, int bits);
+
+		/// a normalized quaternion in 2+3*bits bits, the largest component is left out
+		void writeQuaternion(const CQuaternion<float>& q, int bits);
+
+		/// pad the last byte and append it to the packet
+		void flush();
+
+		/// number of bits written, excluding padding
+		size_t bitsWritten() const
+		{ return m_bitsWritten; }
+
+	private:
+		CBitWriter(const CBitWriter&);
+		const CBitWriter& operator=(const CBitWriter&);
+
+		CPacket& m_packet;
+		uint m_scratch;
+		int m_scratchBits;
+		size_t m_bitsWritten;
+	};
+
+	/// reads values written by a CBitWriter from the read position of a packet
+	/**	Reading past the end of the packet throws error::net_corrupt_packet,
+		like reading the packet directly. When done the read position of the
+		packet is after the last byte read from. */
+	class CBitReader
+	{
+	public:
+		explicit CBitReader(const CPacket& packet)
+			: m_packet(packet), m_scratch(0), m_scratchBits(0)
+		{ }
+
+		uint readBits(int bits);
+
+		bool readBool()
+		{ return readBits(1) != 0; }
+
+		uint readVarint();
+
+		int readSigned()
+		{
+			uint value = readVarint();
+			return static_cast<int>(value >> 1) ^ -static_cast<int>(value & 1);
+		}
+
+		float readFloat();
+
+		float readQuantized(float min, float max, int bits);
+
+		CVector3f readUnitVector(int bits);
+
+		CQuaternion<float> readQuaternion(int bits);
+
+		/// number of bits that are left to read
+		size_t bitsLeft() const
+		{ return (m_packet.size()-m_packet.getReadPos())*8 + m_scratchBits; }
+
+		/// skip the padding of the current byte
+		void align()
+		{ m_scratch = 0; m_scratchBits = 0; }
+
+	private:
+		CBitReader(const CBitReader&);
+		const CBitReader& operator=(const CBitReader&);
+
+		const CPacket& m_packet;
+		uint m_scratch;
+		int m_scratchBits;
+	};
+}
+
+#endif
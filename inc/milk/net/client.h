@@ -12,21 +12,58 @@ namespace milk
 	public:
 		virtual ~IClient() { }
 
+		/// what status is the connection?
+		virtual ConnectionStatus status() = 0;
+
 		/// disconnect
 		virtual void disconnect() = 0;
 
 		/// send a packet to host
+		/** the packet is queued, see ISocket::send() */
 		virtual void send(const CPacket& packet);
 
+		/// non-blocking send of the queued packets, see ISocket::flush()
+		void flush()
+		{ getSocket().flush(); }
+
+		/// see ISocket::setAutoFlush()
+		void setAutoFlush(bool autoFlush)
+		{ getSocket().setAutoFlush(autoFlush); }
+
+		/// see ISocket::setFraming()
+		void setFraming(CPacket::Framing framing)
+		{ getSocket().setFraming(framing); }
+
+		CPacket::Framing getFraming() const
+		{ return getSocket().getFraming(); }
+
+		/// number of bytes queued for sending
+		uint queuedBytes() const
+		{ return getSocket().queuedBytes(); }
+
+		/// see ISocket::congested()
+		bool congested() const
+		{ return getSocket().congested(); }
+
 		/// receive a packet
 		/** This is a non-blocking call that
 		returns true if a packet was indeed received. */
 		virtual bool recv(CPacket& packet);
 
+		/// receive a packet without copying, see ISocket::recvView()
+		virtual bool recvView(CPacket& packet);
+
+		/// block until there may be something to receive
+		/** at most timeout milliseconds, for a network thread */
+		virtual void wait(int timeout);
+
 		/// get the ip of the host we are connected to
 		std::string getRemoteIP() const;
 
 	protected:
+		// receive, copied or viewed
+		bool recv(CPacket& packet, bool view);
+
 		CSocketSet m_socketSet;
 
 		virtual ISocket& getSocket() =0;
@@ -60,30 +97,56 @@ namespace milk
 		bool m_isConnecting;
 	};
 
-	/*
+	/// UDP client, see CHostUDP
+	/**	the connection is PENDING until the host has answered.
+		flush() should be called every frame, since the acks,
+		resends and keep-alives are sent by it. */
 	class CClientUDP : public IClient
 	{
 	public:
 		CClientUDP();
 		~CClientUDP();
 
-		void connect(const CIP& ip, Uint16 listenPort);
-		bool connected() const;
+		/// start connecting to a CHostUDP, from any local port by default
+		/** throws a error::net if the socket can't be opened */
+		void connect(const CIP& ip, int localPort = 0);
+
+		/// what status is the connection?
+		/** while PENDING the connection request is repeated,
+			a host that doesn't answer in time gives DISCONNECTED */
+		ConnectionStatus status();
+
+		/// tell the host and close the socket
 		void disconnect();
 
+		/// receive a packet
+		/** throws a error::net_disconnect if the host
+			has disconnected or timed out */
 		bool recv(CPacket& packet);
+		bool recvView(CPacket& packet);
+
+		/// send a packet that may be lost, see CConnectionUDP::sendUnreliable()
+		void sendUnreliable(const CPacket& packet);
+
+		void wait(int timeout);
+
+		/// the socket, for CSocketUDP::setSimulation() for instance
+		CSocketUDP& getUDPSocket()
+		{ return m_socket; }
 
 	protected:
 		ISocket& getSocket()
-		{ return m_socket; }
+		{ return m_connection; }
 		const ISocket& getSocket() const
-		{ return m_socket; }
+		{ return m_connection; }
 
 	private:
+		// receive every waiting datagram from the host
+		void pump();
+
 		CSocketUDP m_socket;
-		bool m_connected;
+		CConnectionUDP m_connection;
 	};
-	*/
 }
 
 #endif
@@ -0,0 +1,153 @@
+#ifndef MILK_NET_CNETTHREAD_H_
+#define MILK_NET_CNETTHREAD_H_
+
+#include "milk/net/net.h"
+#include "milk/net/cpacket.h"
+#include "milk/spscqueue.h"
+#include <deque>
+
+namespace milk
+{
+	class IHost;
+	class IClient;
+
+	/// a packet or event passed between the game thread and a CNetThread
+	class CNetMessage
+	{
+	public:
+		enum Type
+		{
+			/// a packet from or to a client, or the host for a client thread
+			PACKET,
+			/// a packet to all clients
+			PACKET_ALL,
+			/// a client has connected, or a client thread to its host
+			CONNECTED,
+			/// a client has disconnected or failed and is removed
+			DISCONNECTED,
+			/// the game removes a client
+			REMOVE
+		};
+
+		CNetMessage() : m_type(PACKET), m_id(0) { }
+
+		void swap(CNetMessage& message)
+		{
+			std::swap(m_type, message.m_type);
+			std::swap(m_id, message.m_id);
+			m_packet.swap(message.m_packet);
+		}
+
+		friend void swap(CNetMessage& x, CNetMessage& y)
+		{ x.swap(y); }
+
+		Type m_type;
+		/// the client, 0 for a client thread
+		int m_id;
+		CPacket m_packet;
+	};
+
+	/// runs a host or a client on its own network thread
+	/**
+		While the thread runs it owns the host or client: it accepts the
+		clients, waits for the sockets, receives, frames and flushes. The
+		game thread exchanges CNetMessages with it through two CSPSCQueues
+		only, so it never makes a socket call, and packets are sent and
+		received as soon as the network allows, not once per frame.
+
+		The host or client must not be used by anyone else between start()
+		and stop(), and only one game thread may call send and recv.
+
+		New clients of a host get increasing ids and are announced by a
+		CONNECTED message, clients that disconnect or fail are removed by
+		the thread and announced by a DISCONNECTED message. A client
+		thread announces the connection to its host the same way, with id 0.
+	*/
+	class CNetThread
+	{
+	public:
+		/// run a host that is already open, new clients are numbered from firstId
+		explicit CNetThread(IHost& host, int firstId = 1, size_t queueSize = 4096);
+
+		/// run a client that is connected or connecting
+		explicit CNetThread(IClient& client, size_t queueSize = 4096);
+
+		~CNetThread();
+
+		/// start the thread, auto flush is turned off as the thread flushes itself
+		void start();
+
+		/// stop the thread and wait for it, what's queued stays queued
+		void stop();
+
+		bool running() const;
+
+		/// queue a packet for a client, or the host for a client thread
+		/** returns false if the queue is full */
+		bool send(int id, const CPacket& packet);
+
+		/// queue a packet for all clients of a host
+		bool sendAll(const CPacket& packet);
+
+		/// disconnect a client of a host, no DISCONNECTED message follows
+		bool removeClient(int id);
+
+		/// the next message from the thread, false if there is none
+		/**	the message is swapped out of the queue, and what was in
+			message goes back into it to be reused. */
+		bool recv(CNetMessage& message);
+
+		/// milliseconds the thread waits for the sockets at most, default is 1
+		/**	it's also how long it may take before a packet queued by send
+			is sent, since the thread can't be woken by the queue. */
+		void setWaitTime(int milliseconds)
+		{ m_waitTime = milliseconds; }
+
+	private:
+		CNetThread(const CNetThread&);
+		CNetThread& operator=(const CNetThread&);
+
+		// runs in the network thread
+		void run();
+
+		// one round of sending, accepting and receiving, id is the client being served
+		void update(int& id);
+
+		// the messages from the game thread
+		void sendQueued(int& id);
+
+		// received packets until the queue to the game thread is full
+		void receive(int& id);
+
+		// a message for the game thread, kept back while its queue is full
+		void post(CNetMessage::Type type, int id);
+
+		// a client failed
+		void disconnected(int id);
+
+		// queue a message from the game thread
+		bool push(CNetMessage::Type type, int id, const CPacket *pPacket);
+
+		IHost *m_pHost;
+		IClient *m_pClient;
+		int m_nextId;
+		int m_waitTime;
+		bool m_connected;
+		bool m_done;
+
+		// from the network thread to the game thread
+		CSPSCQueue<CNetMessage> m_in;
+		// from the game thread to the network thread
+		CSPSCQueue<CNetMessage> m_out;
+		// messages for the game thread that didn't fit in m_in
+		std::deque<CNetMessage> m_backlog;
+		// reused by each thread for its side of the queues
+		CNetMessage m_threadMessage;
+		CNetMessage m_gameMessage;
+
+		volatile size_t m_stop;
+		CThread m_thread;
+	};
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "milk/types.h"
 #include "milk/math/cvector.h"
 #include "milk/vectorpod.h"
+#include "milk/net/cpacketpool.h"
 #include <string>
 #include <vector>
 
@@ -14,25 +15,68 @@ namespace milk
 		and when reading from it, operator>>> is used.
 		This still means everything is stored binary,
 		in spite of obvious similarity with std::stream's.
+
+		The data is allocated from CPacketPool. Use swap() to move
+		the contents of a packet instead of copying it.
+
+		A packet can also be a view of memory owned by someone else,
+		see view(). Reading a view doesn't copy anything, changing it
+		copies the viewed data into the packet first.
+
+		When sent over a stream the size of a packet is put before it,
+		either as a 16 bit SizeHeader_t or as a variable length integer
+		for packets of any size, see Framing.
 		*/
 	class CPacket
 	{
 	public:
 		typedef unsigned short SizeHeader_t;
+		typedef vectorPOD<uchar, CPacketAllocator<uchar> > dataVector;
+
+		/// how the size is put before a packet, both ends must use the same
+		enum Framing
+		{
+			/// a SizeHeader_t, packets are at most 65535 bytes
+			FRAMING_SHORT,
+			/// 7 bits per byte with the high bit set if more bytes follow, least significant first
+			FRAMING_VARINT
+		};
+
+		enum
+		{
+			/// largest size header of any framing
+			MAX_HEADER_SIZE = 5
+		};
 
-		CPacket() : m_data(sizeof(SizeHeader_t)), m_readpos(0) {}
+		CPacket() : m_data(MAX_HEADER_SIZE), m_readpos(0), m_pView(0), m_viewSize(0) {}
 
 		/// get the current size of the packet
 		size_t size() const
-		{ return m_data.size()-sizeof(SizeHeader_t); }
+		{ return m_pView ? m_viewSize : m_data.size()-MAX_HEADER_SIZE; }
 
 		/// change the size of the packet
 		void resize(size_t size)
-		{ m_data.resize(size+sizeof(SizeHeader_t)); }
+		{ detach(); m_data.resize(size+MAX_HEADER_SIZE); }
 
 		/// clear all contents
 		void clear();
 
+		/// exchange contents with another packet, without copying
+		void swap(CPacket& packet);
+
+		/// make this packet a view of size bytes at data
+		/** the memory must stay valid and unchanged as long as it's viewed.
+			the read position is reset. */
+		void view(const uchar *data, size_t size);
+
+		/// is this a view of someone else's memory?
+		bool isView() const
+		{ return m_pView != 0; }
+
+		/// copy the viewed memory into the packet, so it's no longer a view
+		void detach() const
+		{ if (m_pView) detach_private(); }
+
 		/// puts the size of the packet before the data
 		/** This may seem for a stupid function,
 			but it useful for sending the whole
@@ -53,13 +97,27 @@ namespace milk
 			*/
 		void putSizeFront() const;
 
-		/// returns a pointer to the contents of the packet
+		/// puts the size of the packet before the data with a framing
+		/** returns the size of the header, which starts at
+			getDataPtr()-headerSize.
+			throws error::net_corrupt_packet if the packet is too large for the framing. */
+		size_t putSizeFront(Framing framing) const;
+
+		/// size of the header for a packet of size bytes
+		static size_t headerSize(Framing framing, size_t size);
+
+		/// read a size header from received data
+		/** returns the size of the header, or 0 if not all of it is available.
+			throws error::net_corrupt_packet on a malformed header. */
+		static size_t readSizeHeader(Framing framing, const uchar *data, size_t available, size_t& size);
+
+		/// returns a pointer to the contents of the packet, a view is detached
 		uchar *getDataPtr()
-		{ return &m_data[0]+sizeof(SizeHeader_t); }
+		{ detach(); return &m_data[0]+MAX_HEADER_SIZE; }
 
 		/// returns a constant pointer to the contents of the packet
 		const uchar *getDataPtr() const
-		{ return &m_data[0]+sizeof(SizeHeader_t); }
+		{ return m_pView ? m_pView : &m_data[0]+MAX_HEADER_SIZE; }
 
 		/// append the data starting at [begin, begin+size)
 		template<class It>
@@ -168,9 +226,17 @@ namespace milk
 		{ return *this >> p.first >> p.second; }
 
 	private:
-		mutable vectorPOD<uchar> m_data;
+		void detach_private() const;
+
+		mutable dataVector m_data;
 		mutable size_t m_readpos;
+		// viewed memory, 0 if the packet owns its data
+		mutable const uchar *m_pView;
+		mutable size_t m_viewSize;
 	};
+
+	inline void swap(CPacket& x, CPacket& y)
+	{ x.swap(y); }
 }
 
 #endif
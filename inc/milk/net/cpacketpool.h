@@ -0,0 +1,108 @@
+#ifndef MILK_NET_PACKETPOOL_H_
+#define MILK_NET_PACKETPOOL_H_
+
+#include "milk/types.h"
+#include "milk/obsolete/milk_cthread.h"
+#include <cstddef>
+#include <limits>
+
+namespace milk
+{
+	/// thread-safe pool of packet buffers
+	/**	Buffers are rounded up to a power of two size class, from
+		MIN_SIZE up to MAX_SIZE, and returned buffers are kept on a free
+		list of their class for the next packet instead of being freed.
+		Larger buffers are allocated and freed directly.
+		Every size class has a lock of its own. */
+	class CPacketPool
+	{
+	public:
+		enum
+		{
+			MIN_SIZE = 64,
+			NUM_CLASSES = 12,
+			MAX_SIZE = MIN_SIZE << (NUM_CLASSES-1)
+		};
+
+		/// get a buffer of at least nbytes
+		static void* allocate(size_t nbytes);
+
+		/// return a buffer, nbytes must be the size it was allocated with
+		static void deallocate(void *p, size_t nbytes);
+
+		/// maximum number of free buffers kept per size class, default is 256
+		static void setMaxFree(size_t maxFree);
+
+		/// number of free buffers kept in all size classes
+		static size_t numFree();
+
+		/// free all kept buffers
+		static void clear();
+
+	private:
+		CPacketPool();
+
+		// free buffers are linked through their first bytes
+		struct CFreeBuffer
+		{
+			CFreeBuffer *m_pNext;
+		};
+
+		class CSizeClass
+		{
+		public:
+			CSizeClass() : m_pFree(0), m_numFree(0) { }
+
+			CMutex m_mutex;
+			CFreeBuffer *m_pFree;
+			size_t m_numFree;
+		};
+
+		// size class of nbytes, NUM_CLASSES if too large
+		static int sizeClass(size_t nbytes);
+
+		static CSizeClass ms_classes[NUM_CLASSES];
+		static size_t ms_maxFree;
+	};
+
+	/// allocator that takes its memory from CPacketPool
+	template<class T>
+	class CPacketAllocator
+	{
+	public:
+		typedef size_t		size_type;
+		typedef ptrdiff_t	difference_type;
+		typedef T*			pointer;
+		typedef const T*	const_pointer;
+		typedef T&			reference;
+		typedef const T&	const_reference;
+		typedef T			value_type;
+
+		template<class U>
+		struct rebind
+		{ typedef CPacketAllocator<U> other; };
+
+		CPacketAllocator() { }
+
+		template<class U>
+		CPacketAllocator(const CPacketAllocator<U>&) { }
+
+		pointer allocate(size_type n, const void* = 0)
+		{ return static_cast<pointer>(CPacketPool::allocate(n*sizeof(T))); }
+
+		void deallocate(pointer p, size_type n)
+		{ CPacketPool::deallocate(p, n*sizeof(T)); }
+
+		size_type max_size() const
+		{ return std::numeric_limits<size_type>::max() / sizeof(T); }
+
+		// all allocators share the pool
+		bool operator==(const CPacketAllocator&) const
+		{ return true; }
+
+		bool operator!=(const CPacketAllocator&) const
+		{ return false; }
+	};
+}
+
+#endif
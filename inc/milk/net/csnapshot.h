@@ -0,0 +1,139 @@
+#ifndef MILK_NET_SNAPSHOT_H_
+#define MILK_NET_SNAPSHOT_H_
+
+#include "milk/net/cpacket.h"
+#include "milk/vectorpod.h"
+#include <map>
+#include <deque>
+
+namespace milk
+{
+	/// the state of the world at one tick
+	/**	The state of every entity is an opaque block of bytes, as
+		serialised by the game, stored by an entity id. */
+	class CSnapshot
+	{
+	public:
+		typedef vectorPOD<uchar> state;
+		typedef std::map<uint, state> entityMap;
+
+		CSnapshot() : m_sequence(0) { }
+
+		/// sequence number given by CSnapshotServer::add(), 0 for none
+		uint getSequence() const
+		{ return m_sequence; }
+
+		/// set the state of an entity
+		void set(uint id, const void *data, size_t size);
+
+		/// set the state of an entity to the contents of a packet
+		void set(uint id, const CPacket& packet)
+		{ set(id, packet.getDataPtr(), packet.size()); }
+
+		/// the state of an entity, 0 if there is no such entity
+		const state* get(uint id) const;
+
+		void remove(uint id)
+		{ m_entities.erase(id); }
+
+		void clear()
+		{ m_entities.clear(); }
+
+		const entityMap& getEntities() const
+		{ return m_entities; }
+
+		/// exchange contents, without copying
+		void swap(CSnapshot& snapshot);
+
+	private:
+		friend class CSnapshotServer;
+		friend class CSnapshotClient;
+
+		uint m_sequence;
+		entityMap m_entities;
+	};
+
+	/// sends snapshots as deltas against what every client has acknowledged
+	/**	Keeps a ring of the latest snapshots. The update for a client is
+		encoded against the last snapshot it acknowledged, or as a full
+		snapshot if it hasn't acknowledged one still in the ring. Entities
+		that didn't change cost nothing, changed ones only the changed
+		bytes. Clients with the same acknowledged snapshot share one
+		encoding per tick.
+
+		server.add(snapshot);
+		for every client:
+			CPacket p;
+			server.encode(id, p);
+			host.send(id, p);
+		on a packet from a client:
+			server.readAck(id, p);
+		*/
+	class CSnapshotServer
+	{
+	public:
+		/// keep historySize snapshots to encode deltas against
+		explicit CSnapshotServer(size_t historySize = 32);
+
+		/// add the snapshot of this tick, the snapshot is emptied
+		/** returns the sequence number given to the snapshot */
+		uint add(CSnapshot& snapshot);
+
+		/// the latest snapshot
+		const CSnapshot& getLatest() const;
+
+		/// append the update for a client to a packet
+		void encode(int client, CPacket& packet) const;
+
+		/// a client has received a snapshot
+		/** acknowledgements of snapshots newer than getLatest() are ignored */
+		void ack(int client, uint sequence);
+
+		/// read an acknowledgement written by CSnapshotClient::writeAck()
+		void readAck(int client, const CPacket& packet);
+
+		/// the last snapshot a client acknowledged, 0 for none
+		uint getAck(int client) const;
+
+		/// forget a client
+		void removeClient(int client);
+
+	private:
+		// the snapshot with a sequence number if it's still kept, or 0
+		const CSnapshot* find(uint sequence) const;
+
+		size_t m_historySize;
+		std::deque<CSnapshot> m_history;
+		std::map<int, uint> m_acks;
+		// encodings of the latest snapshot by baseline
+		mutable std::map<uint, CPacket> m_encoded;
+	};
+
+	/// decodes snapshots sent by CSnapshotServer
+	class CSnapshotClient
+	{
+	public:
+		/// keep historySize snapshots to decode deltas against, at least the size of the server's
+		explicit CSnapshotClient(size_t historySize = 32);
+
+		/// decode an update from the read position of a packet
+		/** returns false if the update is older than the latest snapshot or
+			its baseline isn't known, the rest of the packet is then not read.
+			throws error::net_corrupt_packet on malformed updates. */
+		bool decode(const CPacket& packet);
+
+		/// the latest decoded snapshot
+		const CSnapshot& getLatest() const;
+
+		/// append an acknowledgement of the latest snapshot, for CSnapshotServer::readAck()
+		void writeAck(CPacket& packet) const;
+
+	private:
+		const CSnapshot* find(uint sequence) const;
+
+		size_t m_historySize;
+		std::deque<CSnapshot> m_history;
+	};
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "milk/net/net.h"
 #include "milk/net/socket.h"
 #include <set>
+#include <vector>
 
 namespace milk
 {
@@ -15,19 +16,64 @@ namespace milk
 	class IHost : public ICounted
 	{
 	public:
+		IHost() : m_readyPos(0), m_autoFlush(true), m_framing(CPacket::FRAMING_SHORT) { }
 		virtual ~IHost() { }
 
 		/// sends a packet to a particular client
+		/** the packet is queued, see ISocket::send().
+			throws std::invalid_argument if there's no such client. */
 		virtual void send(int id, const CPacket& packet);
 
-		/// sends a packet to all clients
-		//virtual void sendAll(const CPacket& packet);
+		/// non-blocking send of the queued packets of all clients
+		/**	only clients with queued data are visited.
+			if a client fails the exception is thrown,
+			and if id isn't 0 the client is put in *id.
+			what doesn't fit in a socket is sent by recv as soon
+			as the socket has room, wait wakes up for it as well. */
+		virtual void flush(int *id = 0);
+
+		/// should send flush right away? see ISocket::setAutoFlush()
+		void setAutoFlush(bool autoFlush);
+
+		bool getAutoFlush() const
+		{ return m_autoFlush; }
+
+		/// framing of the packets of all clients, see ISocket::setFraming()
+		void setFraming(CPacket::Framing framing);
+
+		CPacket::Framing getFraming() const
+		{ return m_framing; }
+
+		/// sends a packet to all clients, except the ones in exclude
+		/** the packet is framed once and the same buffer
+			is queued on every client, see ISocket::send(const ISocket::sharedBuffer&).
+			a client that fails doesn't stop the others,
+			the error is thrown by the next recv with its id. */
+		virtual void sendAll(const CPacket& packet, const std::vector<int>& exclude = std::vector<int>());
+
+		/// sends a packet to the clients in ids, sharing one buffer like sendAll
+		/** throws std::invalid_argument before sending anything
+			if one of the ids isn't a client. */
+		virtual void send(const std::vector<int>& ids, const CPacket& packet);
 
 		/// non-blocking receive
 		/**	returns true if there was something to receive.
 			if id isn't 0, the sender of the packet received is put in *id */			
 		virtual bool recv(CPacket& packet, int *id = 0);
 
+		/// non-blocking receive without copying, see ISocket::recvView()
+		virtual bool recvView(CPacket& packet, int *id = 0);
+
+		/// listen for new clients
+		/** if a new client has connected, it is given
+			the id specified by the argument and the call returns true. */
+		virtual bool listen(int id) = 0;
+
+		/// block until a client may have something to receive
+		/** or a full client socket has room to send, which recv sends.
+			at most timeout milliseconds, for a network thread */
+		virtual void wait(int timeout);
+
 		/// disconnects a client
 		virtual void removeClient(int id) = 0;
 
@@ -48,11 +94,39 @@ namespace milk
 		typedef std::map<int, ISocket*> clientMap;
 		typedef clientMap::iterator clientIterator;
 		typedef clientMap::const_iterator constClientIterator;
+		typedef std::map<const ISocket*, int> socketIdMap;
 
 		constClientIterator getClientPriv(int id) const;
 		clientIterator getClientPriv(int id);
 
+		// queue a buffer on a client
+		void send(clientIterator client, const ISocket::sharedBuffer& pData);
+
+		// keep track of a client with queued data after a send or flush
+		void queued(int id, ISocket *pSocket);
+
+		// send the queued data of the clients whose sockets have room again
+		void flushWritable(int *id);
+
+		// receive from a client, copied or viewed
+		bool recv(ISocket *pSocket, CPacket& packet, bool view);
+
+		// receive from any client
+		bool recv(CPacket& packet, int *id, bool view);
+
 		clientMap m_clients;
+		// client id by socket, for the sockets returned by the socket set
+		socketIdMap m_ids;
+		// the next socket of the last check to receive from
+		size_t m_readyPos;
+		// clients that may have more packets buffered
+		std::set<int> m_buffered;
+		// clients with queued packets
+		std::set<int> m_sending;
+		// clients that failed in sendAll, thrown by recv
+		std::set<int> m_failed;
+		bool m_autoFlush;
+		CPacket::Framing m_framing;
 		CSocketSet m_socketSet;
 	};
 
@@ -74,6 +148,9 @@ namespace milk
 			*/
 		bool listen(int id);
 
+		/// with no clients yet it waits for a new one instead
+		void wait(int timeout);
+
 		void removeClient(int id);
 
 		const CSocketTCP& getClient(int id) const;
@@ -82,22 +159,85 @@ namespace milk
 		void addClient(CSocketTCP*, int id);
 
 		CSocketTCP m_listenSocket;
+		CSocketSet m_acceptSet;
 	};
 
-	/*
+	/// UDP-host class
+	/**
+		All clients share one CSocketUDP, each client is a CConnectionUDP,
+		see it for what is reliable and what isn't.
+
+		A client is accepted by listen() after its first datagram has
+		arrived, if it asks to connect, see
+		CConnectionUDP::isConnectRequest(). Other datagrams from unknown
+		addresses are dropped. flush() should be called every frame, since the acks,
+		resends and keep-alives are sent by it. A client that has sent a
+		disconnect or timed out makes recv throw a error::net_disconnect
+		with its id, until it is removed.
+	*/
 	class CHostUDP : public IHost
 	{
 	public:
 		CHostUDP();
 		~CHostUDP();
 
-		void addClient(const CIP& ip, Uint16 localPort, int id);
+		void open(int port);
+		bool open() const;
+		void close();
+
+		/// listen for new clients
+		/** if a connection request has arrived from a new address,
+			the client is given the id specified by the argument
+			and the call returns true. */
+		bool listen(int id);
+
+		/// disconnects a client, it's told so but not waited for
 		void removeClient(int id);
-		void removeAllClients();
 
-		const CSocketUDP& getClient(int id) const;
+		const CConnectionUDP& getClient(int id) const;
+
+		bool recv(CPacket& packet, int *id = 0);
+		bool recvView(CPacket& packet, int *id = 0);
+
+		/// flush all clients, not only the ones with queued packets
+		void flush(int *id = 0);
+
+		void wait(int timeout);
+
+		/// send a packet that may be lost, see CConnectionUDP::sendUnreliable()
+		void sendUnreliable(int id, const CPacket& packet);
+
+		/// the shared socket, for CSocketUDP::setSimulation() for instance
+		CSocketUDP& getSocket()
+		{ return m_socket; }
+
+	private:
+		typedef std::pair<Uint32, Uint16> address;
+
+		// the latest datagram of an address that isn't a client yet
+		class CPending
+		{
+		public:
+			CIP m_ip;
+			std::vector<uchar> m_datagram;
+		};
+
+		// new addresses kept for listen at most
+		enum { MAX_PENDING = 64 };
+
+		static address getKey(const CIP& ip)
+		{ return address(ip.getIP(), ip.getPort()); }
+
+		// receive every waiting datagram and hand it to its client
+		void pump(int *id);
+
+		// throw for a client that has disconnected or timed out
+		void checkDisconnected(int *id);
+
+		CSocketUDP m_socket;
+		std::map<address, int> m_addresses;
+		std::map<address, CPending> m_pending;
 	};
-	*/
 
 }
 
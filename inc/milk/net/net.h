@@ -2,6 +2,7 @@
 #define MILK_NET_H_
 
 #include "milk/includes.h"
+#include "milk/platform.h"
 #include "milk/obsolete/milk_cthread.h"
 #include "milk/helper.h"
 #include "milk/math/cvector.h"
@@ -14,7 +15,11 @@
 #include <string>
 #include <queue>
 #include <set>
+#include <vector>
 #include "milk/boost.h"
+#ifdef MILK_EPOLL
+#	include <sys/epoll.h>
+#endif
 
 namespace milk
 {
@@ -36,6 +41,7 @@ namespace milk
 		}
 
 		friend class CSocketTCP;
+		friend class CSocketUDP;
 		friend class CIP;
 		friend class CSocketSet;
 
@@ -86,7 +92,7 @@ namespace milk
 		sockaddr_in m_ip;
 
 		friend class CSocketTCP;
-		//friend class CSocketUDP;
+		friend class CSocketUDP;
 	};
 
 	class ISocket;
@@ -95,20 +101,52 @@ namespace milk
 	/**	this is NOT a container for sockets.
 		it is a class for determining wheter
 		its members has something to receive,
-		someone to accept or has been disconnected.	*/
+		someone to accept or has been disconnected.
+
+		With the EPOLL backend the sockets are registered with the kernel
+		once and check() only returns the ready ones, so the cost doesn't
+		grow with the number of idle sockets. Where epoll isn't available
+		select() is used, which is limited to FD_SETSIZE sockets.
+
+		Sockets whose send queue is waiting for room can also be checked
+		for being writable, see watchWrite(). */
 	class CSocketSet
 	{
 	public:
-		CSocketSet();
+		enum Backend
+		{
+			SELECT,
+			EPOLL
+		};
+
+		/// EPOLL falls back to SELECT where it isn't available
+		explicit CSocketSet(Backend backend = EPOLL);
 		~CSocketSet();
 
+		/// the backend actually used
+		Backend getBackend() const;
+
 		/**	this checks if the members are ready to receive,
 			ready to accept or has been disconnected.
-			use isSet after calling this to see if a certain socket is ready.
-			timeout is in milliseconds. */
+			use isSet or getReady after calling this to see which sockets are ready.
+			timeout is in milliseconds, an empty set just waits it out. */
 		void check(int timeout=0);
 
+		/// the sockets that were ready at the last check, in no particular order
+		const std::vector<const ISocket*>& getReady() const
+		{ return m_ready; }
+
+		/// the watched sockets that could send at the last check, see watchWrite()
+		const std::vector<const ISocket*>& getWritable() const
+		{ return m_writable; }
+
+		/// should check() also see if a socket of the set can send?
+		/**	only for sockets with queued data, a socket with room in its
+			send buffer is writable at every check. */
+		void watchWrite(const ISocket&, bool watch);
+
 		/// add a socket to the set
+		/** throws a error::net if the socket can't be watched */
 		void add(const ISocket&);
 
 		/// remove a socket from the set
@@ -124,8 +162,20 @@ namespace milk
 		bool isSet(const ISocket&);	
 
 	private:
-		std::set<int> m_set;	//this is all the sockets we are watching
-		fd_set m_in;			//this is the sockets with activity pending
+		CSocketSet(const CSocketSet&);
+		const CSocketSet& operator=(const CSocketSet&);
+
+		typedef std::map<int, const ISocket*> socketMap;
+
+		socketMap m_set;					//this is all the sockets we are watching
+		std::vector<const ISocket*> m_ready;	//this is the sockets with activity pending
+		std::vector<int> m_readySockets;	//and their handles, sorted for isSet
+		std::set<int> m_writers;			//the sockets watched for sending
+		std::vector<const ISocket*> m_writable;	//and the ones that can send
+#ifdef MILK_EPOLL
+		int m_epoll;
+		std::vector<epoll_event> m_events;
+#endif
 	};
 
 	/// base for IClient and IHost, used for counting sent/received
@@ -3,6 +3,7 @@
 
 #include "milk/net/net.h"
 #include "milk/net/cpacket.h"
+#include <deque>
 
 namespace milk
 {
@@ -10,24 +11,106 @@ namespace milk
 	class ISocket
 	{
 	public:
-		ISocket() { }
+		/// bytes that are sent unchanged by several sockets, see send(const sharedBuffer&)
+		typedef boost::shared_ptr<vectorPOD<uchar> > sharedBuffer;
+
+		ISocket() : m_bufferBegin(0), m_bufferEnd(0), m_autoFlush(true), m_highWaterMark(64*1024),
+			m_maxQueuedBytes(32*1024*1024), m_framing(CPacket::FRAMING_SHORT), m_maxPacketSize(16*1024*1024) { }
 		virtual ~ISocket() { }
 
 		/// get the connected address
 		virtual CIP getAddress() const=0;
 
 		/// send some data
-		/** if been disconnected, a error::net_disconnect is thrown.
+		/** the data is queued and, with auto flush, sent as far as
+			possible without blocking, see flush().
+			if been disconnected, a error::net_disconnect is thrown.
 			on other errors, a error::net_send is thrown.
 		 */
 		virtual void send(const void *data, uint nbytes)=0;
 
 		/// send a packet
-		/** if been disconnected, a error::net_disconnect is thrown.
+		/** queued like send(const void*, uint).
+			if been disconnected, a error::net_disconnect is thrown.
 			on other errors, a error::net_send is thrown.
 		*/
 		virtual void send(const CPacket& packet)=0;
 
+		/// send a buffer without copying it
+		/** the buffer is queued by reference and must not be changed
+			afterwards, so one buffer can be queued on many sockets.
+			see framePacket() for sending a packet this way.
+			if been disconnected, a error::net_disconnect is thrown.
+			on other errors, a error::net_send is thrown.
+		*/
+		virtual void send(const sharedBuffer& pData)=0;
+
+		/// a packet with its size header, for send(const sharedBuffer&)
+		static sharedBuffer framePacket(const CPacket& packet, CPacket::Framing framing = CPacket::FRAMING_SHORT);
+
+		/// how packet sizes are sent and received
+		/** FRAMING_SHORT by default, which is what older versions use.
+			both ends must use the same framing. */
+		void setFraming(CPacket::Framing framing)
+		{ m_framing = framing; }
+
+		CPacket::Framing getFraming() const
+		{ return m_framing; }
+
+		/// largest packet accepted by recv
+		/**	larger sizes are treated as corrupt packets, so a broken or
+			hostile peer can't make the socket allocate any amount of
+			memory. default is 16 mb. */
+		void setMaxPacketSize(uint size)
+		{ m_maxPacketSize = size; }
+
+		uint getMaxPacketSize() const
+		{ return m_maxPacketSize; }
+
+		/// non-blocking send of the queued data
+		/** sends as much as the socket takes right now,
+			the rest stays queued until the next flush.
+			if been disconnected, a error::net_disconnect is thrown.
+			on other errors, a error::net_send is thrown.
+		*/
+		virtual void flush()=0;
+
+		/// number of bytes queued for sending
+		virtual uint queuedBytes() const=0;
+
+		/// should send flush right away?
+		/** turn off to collect everything sent during a frame
+			and send it with one flush. on by default. */
+		void setAutoFlush(bool autoFlush)
+		{ m_autoFlush = autoFlush; }
+
+		bool getAutoFlush() const
+		{ return m_autoFlush; }
+
+		/// queued bytes where the socket is considered congested
+		/** game code can check congested() and drop or merge less
+			important updates. default is 64 kb. */
+		void setHighWaterMark(uint bytes)
+		{ m_highWaterMark = bytes; }
+
+		uint getHighWaterMark() const
+		{ return m_highWaterMark; }
+
+		/// has the send queue reached the high-water mark?
+		bool congested() const
+		{ return queuedBytes() >= m_highWaterMark; }
+
+		/// queued bytes where the peer is given up on
+		/**	a send that would queue more drops the queue, disconnects
+			and throws a error::net_disconnect, so a peer that stops
+			reading can't make the queue grow without bound.
+			0 turns it off, default is 32 mb. */
+		void setMaxQueuedBytes(uint bytes)
+		{ m_maxQueuedBytes = bytes; }
+
+		uint getMaxQueuedBytes() const
+		{ return m_maxQueuedBytes; }
+
 		/// blocking receive. returns the nr of bytes read.
 		/** if been disconnected, a error::net_disconnect is thrown.
 		on other errors, a error::net_send is thrown.
@@ -43,10 +126,31 @@ namespace milk
 			*/
 		virtual bool recv(CPacket& packet)=0;
 
+		/// receive of a packet without copying
+		/**	like recv(CPacket&), but the packet is a view of the receive
+			buffer of the socket, see CPacket::view(). It is only valid
+			until the next receive on the socket. */
+		virtual bool recvView(CPacket& packet)=0;
+
+		/// is a whole packet already received?
+		/**	if so recv(CPacket&) returns it without touching the socket,
+			so it should be called even if the socket isn't ready. */
+		virtual bool hasPacket() const=0;
+
 	protected:
 		int m_socket;
 
+		/*	received bytes are kept in [m_bufferBegin, m_bufferEnd),
+			the capacity of m_buffer is fixed except for larger packets */
 		vectorPOD<uchar> m_buffer;
+		uint m_bufferBegin, m_bufferEnd;
+
+		bool m_autoFlush;
+		uint m_highWaterMark;
+		uint m_maxQueuedBytes;
+
+		CPacket::Framing m_framing;
+		uint m_maxPacketSize;
 
 	private:
 		friend class CSocketSet;
@@ -118,9 +222,23 @@ namespace milk
 
 		void send(const void *data, uint nbytes);
 		void send(const CPacket& packet);
+		void send(const sharedBuffer& pData);
 
 		uint recv(void *data, uint maxlen);
 		bool recv(CPacket& packet);
+		bool recvView(CPacket& packet);
+		bool hasPacket() const;
+
+		void flush();
+
+		uint queuedBytes() const
+		{ return m_queuedBytes; }
+
+		/// size of the receive buffer
+		/**	as much as fits is received at once. It grows to the size
+			of a larger packet as soon as its header has arrived, and
+			shrinks back afterwards. Default is 16 kb. */
+		void setRecvBufferSize(uint size);
 
 		/// Turn Nagle algorithm on/off
 		/**
@@ -136,8 +254,34 @@ namespace milk
 		{ return m_nagle; }
 
 	private:
+		// a range of a buffer waiting to be sent
+		class CSendChunk
+		{
+		public:
+			CSendChunk(const sharedBuffer& pData, uint begin, uint end)
+				: m_pData(pData), m_begin(begin), m_end(end)
+			{ }
+
+			sharedBuffer m_pData;
+			uint m_begin, m_end;
+		};
+
+		typedef std::deque<CSendChunk> sendQueue;
+
+		// append to the send queue and flush if auto flush is on
+		void queue(const void *data, uint nbytes);
+
+		// disconnect if nbytes more would exceed the max queued bytes
+		void checkQueueLimit(uint nbytes);
+
+		// remove nbytes sent from the front of the queue
+		void sent(uint nbytes);
+
+		sendQueue			m_sendQueue;
+		uint				m_queuedBytes;
 		bool				m_open;
 		bool				m_nagle;
+		uint				m_recvBufferSize;
 		ConnectionStatus	m_status;
 		CIP					m_remoteIP;
 		CThread				m_connectThread;
@@ -150,59 +294,295 @@ namespace milk
 
 		ConnectionStatus status_private() const;
 
-		// buffers up a maximum of nbytes
-		void recv_private(uint nbytes);
+		// receives as much as fits in the buffer, at least one byte
+		void recv_private();
+
+		// receive a packet, copied or viewed
+		bool recv_private(CPacket& packet, bool view);
+
+		// size of the buffered packet including the header, 0 if the header isn't received
+		uint bufferedPacketSize(uint *pHeaderSize = 0) const;
 
 		CSocketTCP(const CSocketTCP&);
 		const CSocketTCP& operator=(const CSocketTCP&);
 	};
 
-	/*
-	class CSocketUDP : public ISocket
+	/// UDP-socket class
+	/**	sends and receives single datagrams to and from any address.
+		it never blocks, a receive with nothing waiting returns 0.
+		see CConnectionUDP for reliable messages on top of it. */
+	class CSocketUDP
 	{
 	public:
 		CSocketUDP();
-		CSocketUDP(Uint16 port);	//for receiving
 		~CSocketUDP();
 
-		CIP getAddress() const;
-
-		/*this is the local port on which to send from and receive to.
-		0 will use any open port (recommended for clients,
-		hosts can get the port when receiving anyway) *//*
-		void open(Uint16 port);
+		/// open the socket on a local port
+		/**	0 will use any open port (recommended for clients).
+			throws a error::net on failure. */
+		void open(int port);
 		bool open() const;
 		void close();
 
-		/* the ip (and port) to which you are planning
-		on sending messages to, and receiving from *//*
-		void bind(const CIP& ip);
-		void unbind();
+		/// send a datagram
+		/** throws a error::net_send on failure. */
+		void sendTo(const CIP& ip, const void *data, uint nbytes);
 
-		/* you must have both opened a port and
-		bound a ip before sending or receiving *//*
-		void send(const void *data, int nbytes);
-		void send(const CPacket& packet);
-
-		//both of thees are non-blocking, the first one will just return 0. none uses ready()
-		uint recv(void *data, int maxlen);
-		bool recv(CPacket& packet);
+		/// receive a datagram, returns its size or 0 if none is waiting
+		/**	a datagram larger than maxlen is cut off.
+			throws a error::net_recv on failure. */
+		uint recvFrom(CIP& ip, void *data, uint maxlen);
 
-		/* don't really know why one would want to use this...
-		recv is non-blocking anyway *//*
-		bool ready();
+		/// wait until a datagram has arrived, at most timeout milliseconds
+		/** returns true if one has. throws a error::net on failure. */
+		bool wait(int timeout);
 
-		/* copying is forbidden, moving isn't *//*
-		friend void swap(CSocketUDP& x, CSocketUDP& y)
-		{ std::swap(x.m_socket, y.m_socket); }
+		/// simulate a bad network on the outgoing datagrams
+		/**	each datagram is dropped with the probability loss, and
+			the others are delayed by latency plus up to jitter seconds,
+			which also reorders them. delayed datagrams are sent by
+			the following calls to sendTo and recvFrom.
+			for testing protocols on a loopback address, all 0 turns it off. */
+		void setSimulation(float loss, double latency, double jitter);
 
 	private:
-		friend class CSocketSet;
+		// a datagram held back by the simulation
+		class CDelayed
+		{
+		public:
+			double m_time;
+			CIP m_ip;
+			std::vector<uchar> m_data;
+		};
+
+		void sendNow(const CIP& ip, const void *data, uint nbytes);
+
+		// send the delayed datagrams that are due
+		void sendDelayed();
+
+		// uniform in [0,1)
+		double random();
+
+		int m_socket;
+		bool m_open;
+
+		float m_loss;
+		double m_latency, m_jitter;
+		uint m_seed;
+		std::vector<CDelayed> m_delayed;
 
 		CSocketUDP(const CSocketUDP&);
 		const CSocketUDP& operator=(const CSocketUDP&);
 	};
+
+	/// reliable and unreliable messages to one peer over a CSocketUDP
+	/**
+		Every datagram has a sequence number and acknowledges the latest
+		datagram received from the other end, plus the 32 before it in a
+		bitfield, so each ack is repeated in many datagrams and a lost one
+		rarely matters.
+
+		Packets sent with send() are reliable and ordered. A packet is sent
+		again only when the datagram it went in isn't acknowledged within
+		about two round trips, not everything after a loss as TCP does, and
+		the other end holds back the packets after a gap until it is filled.
+
+		Packets sent with sendUnreliable() are sequenced: they may be lost,
+		and ones arriving after a newer datagram are dropped, which suits
+		state that is sent again every frame anyway.
+
+		Both arrive through recv() in the order they are accepted. A packet
+		must fit in one datagram, see MAX_PACKET_SIZE.
+
+		The host and client feed the datagrams of the peer to deliver(),
+		flush() must be called regularly since it also sends the acks,
+		the resends and the keep-alives.
 	*/
+	class CConnectionUDP : public ISocket
+	{
+	public:
+		enum
+		{
+			/// largest datagram sent, below the common internet MTU
+			MAX_DATAGRAM_SIZE = 1200,
+			/// sequence numbers, ack and ack bits
+			DATAGRAM_HEADER_SIZE = 11,
+			/// channel, message id and size
+			MESSAGE_HEADER_SIZE = 5,
+			/// largest packet that can be sent
+			MAX_PACKET_SIZE = MAX_DATAGRAM_SIZE - DATAGRAM_HEADER_SIZE - MESSAGE_HEADER_SIZE
+		};
+
+		CConnectionUDP(CSocketUDP& socket, const CIP& ip);
+
+		/// start over with a new peer, anything queued or received is dropped
+		void reset(const CIP& ip);
+
+		/// the address of the peer
+		CIP getAddress() const
+		{ return m_ip; }
+
+		/// send a reliable packet
+		/**	the data must fit in one datagram,
+			otherwise a error::net_send is thrown. */
+		void send(const void *data, uint nbytes);
+		void send(const CPacket& packet);
+
+		/// send a reliable packet framed by framePacket()
+		/** the framing of the connection is skipped,
+			the rest is shared by reference. */
+		void send(const sharedBuffer& pData);
+
+		/// send a packet that may be lost, but never arrives after a newer one
+		void sendUnreliable(const CPacket& packet);
+
+		/// receive the next packet, cut off at maxlen
+		uint recv(void *data, uint maxlen);
+		bool recv(CPacket& packet);
+		bool recvView(CPacket& packet);
+		bool hasPacket() const;
+
+		/// send the queued packets, resends, acks and keep-alives
+		void flush();
+
+		/// bytes not yet acknowledged by the peer
+		uint queuedBytes() const
+		{ return m_queuedBytes; }
+
+		/// handle a datagram from the peer
+		/** throws a error::net_corrupt_packet if it isn't a valid datagram */
+		void deliver(const uchar *data, uint nbytes);
+
+		/// has anything been received from the peer?
+		bool connected() const
+		{ return m_connected; }
+
+		/// has the peer disconnected or not been heard from in time?
+		bool disconnected() const;
+
+		/// tell the peer we are leaving, it's not resent
+		void disconnect();
+
+		/// seconds of silence before the peer is considered gone, default is 10
+		void setTimeout(double timeout)
+		{ m_timeout = timeout; }
+
+		double getTimeout() const
+		{ return m_timeout; }
+
+		/// smoothed round trip time in seconds
+		double getRoundTripTime() const
+		{ return m_rtt; }
+
+		/// is a datagram from this peer?
+		/** the magic number is checked, so stray datagrams are ignored */
+		static bool isDatagram(const uchar *data, uint nbytes);
+
+		/// is a datagram from a peer that wants to connect?
+		/**	only data sent before anything has been received from the
+			other end is, so late datagrams of a peer that has been
+			removed, or its disconnect, don't look like a new peer. */
+		static bool isConnectRequest(const uchar *data, uint nbytes);
+
+	private:
+		enum DatagramType
+		{
+			DATAGRAM_DATA,
+			DATAGRAM_DISCONNECT,
+			// set in the type of data until the peer has been heard from
+			DATAGRAM_CONNECT = 0x40,
+			// set in the type when the ack fields are valid
+			DATAGRAM_ACK = 0x80
+		};
+
+		enum Channel
+		{
+			CHANNEL_RELIABLE,
+			CHANNEL_UNRELIABLE
+		};
+
+		enum
+		{
+			// reliable messages that may be unacknowledged at once
+			SEND_WINDOW = 256,
+			// sent datagrams remembered for their acks
+			SENT_HISTORY = 1024
+		};
+
+		// a reliable message waiting for its ack
+		class CReliable
+		{
+		public:
+			CReliable(Uint16 id, const sharedBuffer& pData, uint begin, uint end)
+				: m_pData(pData), m_begin(begin), m_end(end), m_sentTime(-1.0), m_id(id), m_acked(false)
+			{ }
+
+			sharedBuffer m_pData;
+			uint m_begin, m_end;
+			double m_sentTime;
+			Uint16 m_id;
+			bool m_acked;
+		};
+
+		// what a sent datagram carried
+		class CSent
+		{
+		public:
+			CSent() : m_time(0.0), m_sequence(0), m_valid(false) { }
+
+			double m_time;
+			std::vector<Uint16> m_messages;
+			Uint16 m_sequence;
+			bool m_valid;
+		};
+
+		typedef std::deque<CReliable> reliableQueue;
+		typedef std::deque<vectorPOD<uchar> > messageQueue;
+
+		// queue a reliable message
+		void queue(const sharedBuffer& pData, uint begin, uint end);
+
+		// the datagram the peer acknowledged
+		void acked(Uint16 sequence, double now);
+
+		// a received reliable message, delivered once everything before it is
+		void received(Uint16 id, const uchar *data, uint nbytes);
+
+		void sendDatagram(const vectorPOD<uchar>& datagram, double now);
+
+		// start a datagram with its header
+		void beginDatagram(vectorPOD<uchar>& datagram, DatagramType type);
+
+		CSocketUDP& m_udpSocket;
+		CIP m_ip;
+
+		// sending
+		reliableQueue m_reliable;
+		messageQueue m_unreliable;
+		std::vector<CSent> m_sent;
+		uint m_queuedBytes;
+		Uint16 m_localSequence;
+		Uint16 m_nextMessageId;
+		double m_lastSendTime;
+
+		// receiving
+		Uint16 m_remoteSequence;
+		Uint32 m_receivedBits;
+		bool m_receivedAny;
+		bool m_ackPending;
+		// absolute id of the next reliable message to deliver
+		uint m_nextReceiveId;
+		std::map<uint, vectorPOD<uchar> > m_outOfOrder;
+		messageQueue m_received;
+		// the packet of the last recvView
+		vectorPOD<uchar> m_view;
+
+		double m_rtt;
+		double m_lastReceiveTime;
+		double m_timeout;
+		bool m_connected;
+		bool m_disconnected;
+	};
 
 }
 
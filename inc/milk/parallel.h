@@ -0,0 +1,233 @@
+#ifndef MILK_PARALLEL_H_
+#define MILK_PARALLEL_H_
+
+#include <vector>
+#include <algorithm>
+#include "milk/boost.h"
+#include "milk/error.h"
+#include "milk/types.h"
+#include "milk/obsolete/milk_cthread.h"
+
+namespace milk
+{
+	/// Number of processors available for worker threads
+	uint numProcessors();
+
+	namespace detail
+	{
+		// One chunk of a parallelFor
+		template<class Body>
+		class CParallelRange
+		{
+		public:
+			CParallelRange(Body& body, size_t begin, size_t end)
+				: m_body(body), m_begin(begin), m_end(end)
+			{ }
+
+			void run()
+			{ m_body(m_begin, m_end); }
+
+		private:
+			Body& m_body;
+			size_t m_begin, m_end;
+		};
+
+		// Wait for and delete the worker threads of a parallelFor
+		template<class Range>
+		void joinRanges(std::vector<CThread*>& threads, std::vector<Range*>& ranges)
+		{
+			for(size_t i = 0; i < threads.size(); ++i)
+			{
+				threads[i]->wait();
+				delete threads[i];
+				delete ranges[i];
+			}
+			threads.clear();
+			ranges.clear();
+		}
+	}
+
+	/// Call body(begin, end) for chunks of [0, count) on worker threads
+	/**
+		The range is split into at most numProcessors() chunks of at least
+		minChunk items, the first chunk runs on the calling thread. Returns
+		when all chunks are done. Threads are started for every call, so this
+		is meant for coarse work (like loading), not for tiny loops, use
+		CWorkerPool::parallelFor() for work done every frame.
+	*/
+	template<class Body>
+	void parallelFor(size_t count, Body& body, size_t minChunk = 1)
+	{
+		size_t chunks = std::min<size_t>(numProcessors(), count / std::max<size_t>(minChunk, 1));
+		if(chunks <= 1)
+		{
+			if(count)
+				body(size_t(0), count);
+			return;
+		}
+
+		typedef detail::CParallelRange<Body> range_type;
+		std::vector<range_type*> ranges;
+		std::vector<CThread*> threads;
+		size_t chunkSize = (count + chunks - 1) / chunks;
+		for(size_t begin = chunkSize; begin < count; begin += chunkSize)
+		{
+			ranges.push_back(new range_type(body, begin, std::min(begin + chunkSize, count)));
+			threads.push_back(new CThread(function_member(*ranges.back(), &range_type::run)));
+			threads.back()->start();
+		}
+
+		try
+		{
+			body(size_t(0), chunkSize);
+		}
+		catch(...)
+		{
+			detail::joinRanges(threads, ranges);
+			throw;
+		}
+		detail::joinRanges(threads, ranges);
+	}
+
+	/// Work done by a CWorkerPool
+	class CWorkerTask
+	{
+	public:
+		CWorkerTask()
+			: m_state(IDLE), m_failed(false)
+		{ }
+
+		virtual ~CWorkerTask()
+		{ BOOST_ASSERT(m_state == IDLE); }
+
+		virtual void run() = 0;
+
+		/// True from submit() until wait() has returned
+		bool busy() const
+		{ return m_state != IDLE; }
+
+	private:
+		friend class CWorkerPool;
+
+		enum State { IDLE, QUEUED, RUNNING, DONE };
+
+		// Guarded by the lock of the pool
+		State m_state;
+		bool m_failed;
+	};
+
+	/// Worker threads that stay alive between tasks
+	/**
+		Starting threads costs more than much of the work done per frame, so
+		per frame work is given to the threads of a pool instead, usually the
+		one shared by the engine, see instance(). Tasks are started in the
+		order they're submitted.
+	*/
+	class CWorkerPool
+	{
+	public:
+		/// Start numThreads workers, zero for one less than numProcessors()
+		explicit CWorkerPool(uint numThreads = 0);
+		~CWorkerPool();
+
+		uint numThreads() const
+		{ return uint(m_threads.size()); }
+
+		/// Queue a task for the workers, it must not be busy
+		/** The task must stay alive until wait() has returned for it. */
+		void submit(CWorkerTask& task);
+
+		/// Wait until a submitted task is done
+		/**
+			A task that no worker has started yet is run on this thread.
+			Throws error::milk if the task threw on a worker thread.
+		*/
+		void wait(CWorkerTask& task);
+
+		/// Call body(begin, end) for chunks of [0, count), like milk::parallelFor()
+		template<class Body>
+		void parallelFor(size_t count, Body& body, size_t minChunk = 1);
+
+		/// The pool used by the engine for per frame work
+		static CWorkerPool& instance();
+
+	private:
+		CWorkerPool(const CWorkerPool&);
+		CWorkerPool& operator=(const CWorkerPool&);
+
+		// Runs in the worker threads
+		void work();
+
+		class CState;
+		CState *m_pState;
+		std::vector<CThread*> m_threads;
+	};
+
+	namespace detail
+	{
+		// One chunk of a CWorkerPool::parallelFor
+		template<class Body>
+		class CParallelTask : public CWorkerTask
+		{
+		public:
+			CParallelTask(Body& body, size_t begin, size_t end)
+				: m_pBody(&body), m_begin(begin), m_end(end)
+			{ }
+
+			void run()
+			{ (*m_pBody)(m_begin, m_end); }
+
+		private:
+			Body *m_pBody;
+			size_t m_begin, m_end;
+		};
+	}
+
+	template<class Body>
+	void CWorkerPool::parallelFor(size_t count, Body& body, size_t minChunk)
+	{
+		size_t chunks = std::min<size_t>(numThreads() + 1, count / std::max<size_t>(minChunk, 1));
+		if(chunks <= 1)
+		{
+			if(count)
+				body(size_t(0), count);
+			return;
+		}
+
+		// Reserved up front, submitted tasks must not move
+		typedef detail::CParallelTask<Body> task_type;
+		std::vector<task_type> tasks;
+		tasks.reserve(chunks);
+		size_t chunkSize = (count + chunks - 1) / chunks;
+		for(size_t begin = chunkSize; begin < count; begin += chunkSize)
+		{
+			tasks.push_back(task_type(body, begin, std::min(begin + chunkSize, count)));
+			submit(tasks.back());
+		}
+
+		// The tasks live on this stack, so wait for all of them before throwing
+		bool failed = false;
+		try
+		{
+			body(size_t(0), chunkSize);
+		}
+		catch(...)
+		{
+			for(size_t i = 0; i < tasks.size(); ++i)
+			{
+				try { wait(tasks[i]); }
+				catch(error::milk&) { }
+			}
+			throw;
+		}
+		for(size_t i = 0; i < tasks.size(); ++i)
+		{
+			try { wait(tasks[i]); }
+			catch(error::milk&) { failed = true; }
+		}
+		if(failed)
+			throw error::milk("CWorkerPool::parallelFor - Error, a chunk failed");
+	}
+}
+
+#endif
@@ -6,4 +6,14 @@
 #	define stricmp strcasecmp
 #endif
 
+// SSE is available when the compiler targets it
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) || defined(__SSE__)
+#	define MILK_SSE
+#endif
+
+// epoll is used for socket readiness on linux, see CSocketSet
+#if defined(__linux__) && !defined(MILK_NO_EPOLL)
+#	define MILK_EPOLL
+#endif
+
 #endif
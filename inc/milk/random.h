@@ -46,6 +46,64 @@ namespace milk
 		generator m_generator;
 		boost::uniform_01<generator> m_distributor;
 	};
+
+	/// Small and fast random number generator (xorshift128)
+	/**
+		Holds no shared state, give every user (like every particle system)
+		its own generator. The same seed always gives the same sequence.
+	*/
+	class CFastRandom
+	{
+	public:
+		CFastRandom(uint s = 1)
+		{
+			seed(s);
+		}
+
+		/// seeds the randomness
+		void seed(uint s)
+		{
+			// Spread the seed over the state, which must not be all zero
+			m_x = s ^ 0x12345678u;
+			m_y = s * 1812433253u + 1u;
+			m_z = m_y * 1812433253u + 2u;
+			m_w = m_z * 1812433253u + 3u;
+			if(!(m_x | m_y | m_z | m_w))
+				m_x = 1;
+			for(int i = 0; i < 8; ++i)
+				next();
+		}
+
+		/// returns 32 random bits
+		uint next()
+		{
+			uint t = m_x ^ (m_x << 11);
+			m_x = m_y; m_y = m_z; m_z = m_w;
+			m_w = m_w ^ (m_w >> 19) ^ (t ^ (t >> 8));
+			return m_w;
+		}
+
+		/// returns a number in the interval [0, 1)
+		float frand()
+		{
+			return float(next() >> 8) * (1.0f / 16777216.0f);
+		}
+
+		/// [min..max)
+		float frand(float min, float max)
+		{
+			return (max-min)*frand() + min;
+		}
+
+		/// [min..max]
+		int irand(int min, int max)
+		{
+			return min + int(next() % uint(max-min+1));
+		}
+
+	private:
+		uint m_x, m_y, m_z, m_w;
+	};
 }
 
 #endif
@@ -5,6 +5,7 @@
 #include "milk/renderer/iindexbuffer.h"
 #include "milk/renderer/ivertexbuffer.h"
 #include "milk/renderer/cappearance.h"
+#include "milk/renderer/cskinpalette.h"
 
 namespace milk
 {
@@ -13,7 +14,7 @@ namespace milk
 		CGeometry()
 			: pVertexBuffer(0), pIndexBuffer(0),
 			renderMode(GL_NONE), start(0), num(0),
-			pAppearance(0)
+			pAppearance(0), pPalette(0)
 		{ }
 
 		/*
@@ -28,13 +29,13 @@ namespace milk
 		CGeometry(IVertexBuffer *pVB, GLenum rm)
 			: pVertexBuffer(pVB), pIndexBuffer(0),
 			renderMode(rm), start(0), num(pVertexBuffer->numVertices()),
-			pAppearance(0)
+			pAppearance(0), pPalette(0)
 		{ }
 
 		CGeometry(IVertexBuffer *pVB, IIndexBuffer *pIB, GLenum rm)
 			: pVertexBuffer(pVB), pIndexBuffer(pIB),
 			renderMode(rm), start(0), num(pIndexBuffer->numIndices()),
-			pAppearance(0)
+			pAppearance(0), pPalette(0)
 		{ }
 
 		void render()
@@ -58,6 +59,10 @@ namespace milk
 		CMatrix4f mat;
 		handle<CAppearance> pAppearance;
 
+		// Skin matrices, uploaded to paletteUniform when the pass is bound
+		const CSkinPalette *pPalette;
+		CUniformHandle paletteUniform;
+
 		// TODO: Bounding volumes, culling
 	};
 }
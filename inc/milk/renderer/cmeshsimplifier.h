@@ -0,0 +1,93 @@
+#ifndef MILK_CMESHSIMPLIFIER_H_
+#define MILK_CMESHSIMPLIFIER_H_
+
+#include <vector>
+#include <queue>
+#include "milk/types.h"
+#include "milk/math/cvector.h"
+
+namespace milk
+{
+	/// Quadric error mesh simplifier
+	/**
+		Reduces an indexed triangle list by collapsing edges into one of their
+		end points, choosing the collapse with the smallest quadric error first.
+		Vertices are never moved or created, so all levels of detail can share
+		the original vertex buffer and only need their own index list.
+
+		Vertices on open borders and vertices sharing their position with
+		another vertex (ie. normal or texture coordinate seams) are never
+		removed, so seams stay closed and texture mapping intact.
+
+		This doesn't depend on OpenGL, so it may be used by offline tools.
+	*/
+	class CMeshSimplifier
+	{
+	public:
+		/// Setup from vertex positions and a triangle list
+		CMeshSimplifier(const std::vector<CVector3f>& positions, const std::vector<uint>& indices);
+
+		/// Collapse edges until at most numTriangles triangles remain
+		/**
+			Continues from the previous call, so calls with decreasing counts
+			produce a chain of levels. Stops early when no valid collapse is left.
+		*/
+		void simplify(size_t numTriangles);
+
+		/// Get the remaining triangles as a triangle list
+		void getIndices(std::vector<uint>& indices) const;
+
+		size_t numTriangles() const
+		{ return m_numTriangles; }
+
+	private:
+		// Symmetric 4x4 matrix, upper triangle
+		class CQuadric
+		{
+		public:
+			CQuadric();
+			void addPlane(const CVector3f& n, float d, float weight);
+			CQuadric& operator+=(const CQuadric& rhs);
+			double error(const CVector3f& p) const;
+
+			double a[10];
+		};
+
+		class CCollapse
+		{
+		public:
+			CCollapse(float cost, uint from, uint to, uint fromVersion, uint toVersion)
+				: m_cost(cost), m_from(from), m_to(to), m_fromVersion(fromVersion), m_toVersion(toVersion)
+			{ }
+
+			// Inverted, the queue should return the cheapest collapse
+			bool operator<(const CCollapse& rhs) const
+			{ return m_cost > rhs.m_cost; }
+
+			float m_cost;
+			uint m_from, m_to;
+			uint m_fromVersion, m_toVersion;
+		};
+
+		void addCollapse(uint from, uint to);
+		void addCollapses(uint vertex);
+		bool canCollapse(uint from, uint to) const;
+		void collapse(uint from, uint to);
+		void neighbours(uint vertex, std::vector<uint>& result) const;
+
+		std::vector<CVector3f> m_positions;
+		std::vector<uint> m_indices;
+		std::vector<bool> m_triangleRemoved;
+		size_t m_numTriangles;
+
+		std::vector<std::vector<uint> > m_vertexTriangles;
+		std::vector<CQuadric> m_quadrics;
+		std::vector<bool> m_locked;
+		std::vector<bool> m_removed;
+		std::vector<uint> m_version;
+
+		std::priority_queue<CCollapse> m_queue;
+	};
+}
+
+#endif
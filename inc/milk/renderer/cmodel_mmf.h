@@ -39,6 +39,22 @@ namespace milk
 			CComponent m_components[6];
 		};
 
+		// Statistics from loading a model
+		class CLoadStats
+		{
+		public:
+			CLoadStats()
+				: verticesRead(0), verticesWelded(0), loadTime(0.0)
+			{ }
+
+			/// Vertices stored in the file
+			size_t verticesRead;
+			/// Vertices left after welding
+			size_t verticesWelded;
+			/// Seconds spent in load()
+			double loadTime;
+		};
+
 		// Model
 		class CModel : public IModel
 		{
@@ -52,8 +68,13 @@ namespace milk
 
 			bool load(std::string filename);
 
+			const CLoadStats& getLoadStats() const
+			{ return m_loadStats; }
+
 		private:
 			void postLoad();
+
+			CLoadStats m_loadStats;
 		};
 
 		// Importer class
@@ -0,0 +1,178 @@
+#ifndef MILK_CSKELETON_H_
+#define MILK_CSKELETON_H_
+
+#include <string>
+#include <vector>
+#include "milk/math/cmatrix.h"
+#include "milk/renderer/imodel.h"
+#include "milk/renderer/cskinpalette.h"
+#include "milk/scenegraph/iscenenode.h"
+
+namespace milk
+{
+	/// Animated pose of one model instance
+	/**
+		All per-bone state is kept in flat arrays indexed like the bone
+		sources of the IModel, where a parent always comes before its
+		children. No scene nodes are created, see CModelNode::getBone()
+		for attaching nodes to a bone.
+
+		The skin matrices are stored directly in the skin palette.
+	*/
+	class CSkeleton
+	{
+	public:
+		CSkeleton();
+
+		/// Reset to the bind pose of a bone hierarchy
+		void create(const std::vector<IBoneSource*>& boneSources);
+
+		/// Remove all bones
+		void clear();
+
+		size_t size() const
+		{ return m_states.size(); }
+
+		bool empty() const
+		{ return m_states.empty(); }
+
+		/// Bone index by name, -1 if not found
+		int find(const std::string& name) const;
+
+		const std::string& getName(size_t bone) const;
+
+		/// Parent bone index, -1 for root bones
+		int getParent(size_t bone) const;
+
+		IBoneSource* getBoneSource(size_t bone) const
+		{ return (*m_pBoneSources)[bone]; }
+
+		/// True if the bone has no child bones and nothing is attached to it
+		bool isLeaf(size_t bone) const
+		{ return m_states[bone].m_children == 0 && !m_states[bone].m_attached; }
+
+		void setAttached(size_t bone, bool attached)
+		{ m_states[bone].m_attached = attached; }
+
+		/// Set animation for all bones
+		void setAnimation(const CAnimation& animation, float blendTime = -1.0f);
+
+		/// Set animation for a bone, and optionally all bones below it
+		void setAnimation(size_t bone, const CAnimation& animation, float blendTime = -1.0f, bool children = true);
+
+		const CAnimation& getAnimation(size_t bone) const
+		{ return m_animations[m_states[bone].m_animation]; }
+
+		float getFrame(size_t bone) const
+		{ return m_states[bone].m_frame; }
+
+		bool atEnd(size_t bone) const;
+
+		/// Advance the bone animation
+		/**
+			When evaluate is false only the animation time is advanced and the
+			local matrix is left as it is, the model-space transforms are still
+			recalculated so the bone follows its parent. Bones must be updated
+			in index order.
+		*/
+		void update(size_t bone, float dt, bool evaluate = true);
+
+		/// Bone matrix relative to its parent
+		const CMatrix4f& getLocal(size_t bone) const
+		{ return m_local[bone]; }
+
+		/// Bone matrix relative to the model
+		const CMatrix4f& getModelRelative(size_t bone) const
+		{ return m_modelRelative[bone]; }
+
+		/// Skin matrices, one per bone
+		CSkinPalette& getPalette()
+		{ return m_palette; }
+
+		const CSkinPalette& getPalette() const
+		{ return m_palette; }
+
+		/// Approximate heap memory used by this instance in bytes
+		size_t memoryUsage() const;
+
+	private:
+		class CBoneState
+		{
+		public:
+			CBoneState()
+				: m_frame(-1.0f), m_blendTime(-1.0f), m_totalBlendTime(1.0f),
+				m_animation(0), m_parent(-1), m_children(0), m_attached(false)
+			{ }
+
+			float m_frame;
+			float m_blendTime;
+			float m_totalBlendTime;
+			unsigned short m_animation;
+			short m_parent;
+			unsigned short m_children;
+			bool m_attached;
+		};
+
+		unsigned short findAnimation(const CAnimation& animation);
+		void setBoneAnimation(size_t bone, unsigned short animation, float blendTime);
+
+		const std::vector<IBoneSource*> *m_pBoneSources;
+		std::vector<CBoneState> m_states;
+		// Animations in use, shared by the bones
+		std::vector<CAnimation> m_animations;
+		std::vector<CMatrix4f> m_local;
+		std::vector<CMatrix4f> m_modelRelative;
+		// Only allocated once a bone blends between animations
+		std::vector<CMatrix4f> m_blendFrom, m_blendTo;
+		CSkinPalette m_palette;
+	};
+
+	/// Scene node following a skeleton bone
+	/**
+		Created by CModelNode::getBone() for bones that other nodes are
+		attached to. The matrix is the model space bone matrix and is updated
+		with the animation.
+
+		The skeleton belongs to the model node. Once the node changes its
+		model or is destroyed the bone is detached: it keeps its last matrix,
+		and the accessors return neutral values.
+	*/
+	class CBone : public ISceneNode
+	{
+		friend class CModelNode;
+	public:
+		CBone(CSkeleton *pSkeleton, size_t index)
+			: m_pSkeleton(pSkeleton), m_index(index)
+		{ }
+
+		const std::string& getName() const
+		{
+			static const std::string detached;
+			return m_pSkeleton ? m_pSkeleton->getName(m_index) : detached;
+		}
+
+		size_t getIndex() const
+		{ return m_index; }
+
+		/// Is the bone still part of the skeleton of a model node?
+		bool attached() const
+		{ return m_pSkeleton != 0; }
+
+		void setAnimation(const CAnimation& animation, float blendTime=-1.0f, bool children = true)
+		{ if(m_pSkeleton) m_pSkeleton->setAnimation(m_index, animation, blendTime, children); }
+
+		bool atEnd() const
+		{ return !m_pSkeleton || m_pSkeleton->atEnd(m_index); }
+
+		IBoneSource* getBoneSource() const
+		{ return m_pSkeleton ? m_pSkeleton->getBoneSource(m_index) : 0; }
+
+	protected:
+		CSkeleton *m_pSkeleton;
+		size_t m_index;
+	};
+
+	typedef std::vector<CBone*> boneList;
+}
+
+#endif
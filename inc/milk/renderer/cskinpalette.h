@@ -0,0 +1,68 @@
+#ifndef MILK_CSKINPALETTE_H_
+#define MILK_CSKINPALETTE_H_
+
+#include <vector>
+#include "milk/math/cmatrix4.h"
+#include "milk/renderer/ishader.h"
+
+namespace milk
+{
+	/// Skin matrices for one animated model instance
+	/**
+		The whole palette is sent to the skinning shader as one uniform array.
+		The last upload is remembered, so meshes sharing program and palette
+		only upload it once. Call touch() after changing the matrices.
+	*/
+	class CSkinPalette
+	{
+	public:
+		CSkinPalette()
+			: m_version(0)
+		{ }
+
+		void resize(size_t size)
+		{ m_matrices.resize(size); touch(); }
+
+		size_t size() const
+		{ return m_matrices.size(); }
+
+		CMatrix4f& operator[](size_t i)
+		{ return m_matrices[i]; }
+
+		const CMatrix4f& operator[](size_t i) const
+		{ return m_matrices[i]; }
+
+		/// Mark the matrices as changed
+		void touch()
+		{ ++m_version; }
+
+		/// Upload palette to a uniform array of the bound program object
+		void upload(const CProgramObject *pProgramObject, const CUniformHandle& uniform) const;
+
+		/// Forget the last upload, call when the uniform state may have changed
+		static void reset();
+
+		/// Number of palette uploads since resetStats()
+		static size_t getUploadCount()
+		{ return ms_uploadCount; }
+
+		/// Number of uploads skipped because the palette was already in place
+		static size_t getSkipCount()
+		{ return ms_skipCount; }
+
+		static void resetStats()
+		{ ms_uploadCount = ms_skipCount = 0; }
+
+	private:
+		std::vector<CMatrix4f> m_matrices;
+		unsigned int m_version;
+
+		static const CSkinPalette *ms_pLastPalette;
+		static const CProgramObject *ms_pLastProgramObject;
+		static unsigned int ms_lastVersion;
+		static size_t ms_uploadCount;
+		static size_t ms_skipCount;
+	};
+}
+
+#endif
@@ -3,15 +3,18 @@
 
 #include <string>
 #include <vector>
+#include <iostream>
 #include "milk/renderer/ivertexbuffer.h"
 #include "milk/renderer/iindexbuffer.h"
 #include "milk/renderer/ctexture.h"
 #include "milk/renderer/cappearance.h"
+#include "milk/renderer/cskinpalette.h"
 #include "milk/math/cvector.h"
 #include "milk/math/cmatrix.h"
 #include "milk/timer.h"
 #include "milk/ccolor.h"
 #include "milk/vectorpod.h"
+#include "milk/helper.h"
 #include "milk/boost.h"
 #include "milk/scenegraph/iscenenode.h"
 #include "milk/iresource.h"
@@ -54,6 +57,8 @@ namespace milk
 				delete m_pIndexBuffer;
 				m_pIndexBuffer = 0;
 			}
+			delete_range(m_lodIndexBuffers.begin(), m_lodIndexBuffers.end());
+			m_lodIndexBuffers.clear();
 		}
 
 		bool m_hwSkinning;
@@ -63,6 +68,10 @@ namespace milk
 		std::vector<CSkinnedVertex> m_skinnedVertices;
 		milk::IVertexBuffer *m_pVertexBuffer;
 		milk::IIndexBuffer *m_pIndexBuffer;
+		CUniformHandle m_paletteUniform;
+
+		/// Simplified triangle lists, sharing m_pVertexBuffer
+		std::vector<milk::IIndexBuffer*> m_lodIndexBuffers;
 	};
 
 	// Animation
@@ -91,7 +100,7 @@ namespace milk
 	/// Feeds the bones with matrices
 	class IBoneSource
 	{
-		friend class CBone;
+		friend class CSkeleton;
 		friend class IModel;
 		friend class CModelNode;
 	public:
@@ -106,60 +115,15 @@ namespace milk
 		virtual CMatrix4f getBoneMatrixPose() = 0;
 		virtual CMatrix4f getWorldInv() = 0;
 
-		void setSkinMatrix(const CMatrix4f& mat)
-		{ m_skinMatrixUniform.set(mat); }
-
-		void setSkinMatrixUniform(CUniformHandle smu)
-		{ m_skinMatrixUniform = smu; }
-
 	protected:
 		std::string m_name;
 		int m_parent;
 		float m_skinFrame;
-		CUniformHandle m_skinMatrixUniform;
-	};
-
-	/// Skeleton bone
-	class CBone : public ISceneNode
-	{
-		friend class CModelNode;
-		friend class IModel;
-	public:
-		CBone(IBoneSource *pBoneSource)
-			: m_pBoneSource(pBoneSource), m_frame(-1.0f), m_blendTime(-1.0f), m_totalBlendTime(1.0f)
-		{ }
-
-		const std::string& getName() const
-		{ return m_pBoneSource->m_name; }
-
-		void setAnimation(const CAnimation& animation, float blendTime=-1.0f, bool children = true);
-
-		bool atEnd() const;
-
-		void updateBone(float dt);
-
-		CBone* getParentBone() const
-		{ return dynamic_cast<CBone*>(m_pParent); }
-
-		IBoneSource* getBoneSource() const
-		{ return m_pBoneSource; }
-
-	protected:
-		IBoneSource *m_pBoneSource;
-
-		CAnimation m_animation;
-		float m_frame;
-		float m_blendTime;
-		float m_totalBlendTime;
-
-		CMatrix4f m_modelRelative;
-		CMatrix4f m_transform;
-		CMatrix4f m_blendFrom, m_blendTo;
 	};
 
-	typedef std::vector<CBone*> boneList;
-
+	class CSkeleton;
 	class IModelImporter;
+	class CModelNode;
 
 	/// Modelclass for loading and rendering models
 	/**
@@ -176,10 +140,15 @@ namespace milk
 		static void free();
 		static IModel* create(std::string filename);
 
+		/// Number of levels of detail create() generates for loaded models, 0 for none
+		static void setLoadLods(size_t levels)
+		{ ms_loadLods = levels; }
+
 		////////////////////////////////////
 
 		/// Create empty model
 		IModel()
+			: m_boundingRadius(-1.0f)
 		{ }
 
 		virtual ~IModel()
@@ -224,7 +193,7 @@ namespace milk
 		CAnimation& getAnimation(std::string name);
 
 		/// Creates the skeleton (ie bone hierarchy)
-		void createSkeleton(boneList& bones);
+		void createSkeleton(CSkeleton& skeleton);
 
 		////////////////////////////////////
 
@@ -237,10 +206,58 @@ namespace milk
 		size_t numMaterials() const;
 		size_t numBones() const;
 
+		/// Radius of a sphere around the model origin enclosing all vertices in bind pose
+		float getBoundingRadius() const;
+
+		////////////////////////////////////
+
+		/// Generate simplified levels of detail for all meshes
+		/**
+			Every level keeps reduction times the triangles of the previous one, see
+			CMeshSimplifier. The first level is used when the projected size of the
+			model (times the render pass lod factor) is below screenSize, the limit
+			is halved for each following level. Levels share the vertex buffer of the
+			mesh, only index buffers are added.
+		*/
+		void generateLods(size_t levels, float reduction = 0.5f, float screenSize = 0.5f);
+
+		/// Remove all levels of detail
+		void clearLods();
+
+		/// Write levels of detail, to generate them offline
+		void writeLods(std::ostream& os);
+
+		/// Read levels of detail written by writeLods()
+		void readLods(std::istream& is);
+
+		/// Number of levels of detail, not counting the full model
+		size_t numLods() const
+		{ return m_lodScreenSizes.size(); }
+
+		/// Set the projected size below which level (1..numLods()) is used
+		void setLodScreenSize(size_t level, float screenSize)
+		{ m_lodScreenSizes.at(level-1) = screenSize; }
+
+		float getLodScreenSize(size_t level) const
+		{ return m_lodScreenSizes.at(level-1); }
+
+		/// Select level of detail for a projected size, 0 is the full model
+		size_t selectLod(float screenSize) const;
+
+		/// Number of triangles in a level of detail
+		size_t numTriangles(size_t lod) const;
+
+		/// Triangles submitted by all models since resetStats()
+		static size_t getTrianglesDrawn()
+		{ return ms_trianglesDrawn; }
+
+		static void resetStats()
+		{ ms_trianglesDrawn = 0; }
+
 	protected:
 
-		void skinVertices(CMesh& mesh, boneList& bones);
-		void draw(CModelNode *pModelNode, boneList& bones);
+		void skinVertices(CMesh& mesh, const CSkinPalette& palette);
+		void draw(CModelNode *pModelNode, size_t lod = 0);
 
 		typedef std::vector<CMesh> meshList;
 		typedef std::vector<handle<CAppearance> > materialList;
@@ -252,11 +269,15 @@ namespace milk
 		materialList m_materials;
 		animationList m_animations;
 		boneSourceList m_boneSources;
+		std::vector<float> m_lodScreenSizes;
 
 		static importerList ms_importers;
+		static size_t ms_trianglesDrawn;
+		static size_t ms_loadLods;
 
 	private:
 		bool m_boundMaterial;
+		mutable float m_boundingRadius;
 	};
 
 	/// TODO
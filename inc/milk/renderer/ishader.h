@@ -97,6 +97,18 @@ namespace milk
 			CHECK_FOR_OPENGL_ERRORS("glUniform");
 		}
 
+		/// Set uniform array
+		template<class T>
+		void set(const T *values, GLsizei count) const
+		{
+			CHECK_FOR_OPENGL_ERRORS("PRIOR");
+			BOOST_ASSERT(m_components == glType<T>::components);
+			BOOST_ASSERT(m_type == glType<T>::type);
+			BOOST_ASSERT(m_size == glType<T>::size);
+			glUniform(m_location, values, count);
+			CHECK_FOR_OPENGL_ERRORS("glUniform");
+		}
+
 		GLint location() const
 		{ return m_location; }
 
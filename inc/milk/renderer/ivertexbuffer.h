@@ -143,6 +143,8 @@ namespace milk
 		{ return getComponent<CVector3f>(SHADERATTRIBUTE, index); }
 		CDataContainer<CVector4f> getAttrib4f(size_t index)
 		{ return getComponent<CVector4f>(SHADERATTRIBUTE, index); }
+		CDataContainer<CColor4ub> getAttrib4ub(size_t index)
+		{ return getComponent<CColor4ub>(SHADERATTRIBUTE, index); }
 		CDataContainer<CMatrix3f> getAttrib9f(size_t index)
 		{ return getComponent<CMatrix3f>(SHADERATTRIBUTE, index); }
 		CDataContainer<CMatrix4f> getAttrib16f(size_t index)
@@ -98,6 +98,14 @@ namespace milk
 		CVector2f objectToDevice(const CVector3f& obj, const CMatrix4f& ltm) const;
 		CVector2f deviceToViewport(const CVector2f& dev) const;
 
+		/// Projected size of a world-space sphere
+		/**
+			Returns the diameter of the sphere as a fraction of the viewport
+			height, ie. 1.0 fills the screen vertically. Meant for level of
+			detail selection, so it ignores the distortion near the screen edges.
+		*/
+		float projectedSize(const CVector3f& center, float radius) const;
+
 		/// Mark this frame dirty
 		virtual void onBecomeChild()
 		{ markDirty(); }
@@ -10,11 +10,51 @@
 #include "milk/boost.h"
 #include "milk/scenegraph/irenderable.h"
 #include "milk/renderer/imodel.h"
+#include "milk/renderer/cskeleton.h"
 
 namespace milk
 {
 	class CSceneManager;
 
+	/// Animation level of detail tier
+	/**
+	A tier is used when the projected screen size of the model (see
+	CCamera::projectedSize) is at least minScreenSize. The skeleton is
+	then updated updateRate times per second.
+	*/
+	class CAnimationLod
+	{
+	public:
+		CAnimationLod(float minScreenSize = 0.0f, float updateRate = 100.0f)
+			: m_minScreenSize(minScreenSize), m_updateRate(updateRate)
+		{ }
+
+		float m_minScreenSize;
+		float m_updateRate;
+	};
+
+	/// Animation level of detail counters
+	/**
+	Summed over all CModelNode's since the last call to reset().
+	*/
+	class CAnimationLodStats
+	{
+	public:
+		enum { MAX_TIERS = 8 };
+
+		CAnimationLodStats()
+		{ reset(); }
+
+		void reset();
+
+		/// Bones evaluated from keyframes, per tier
+		size_t bonesEvaluated[MAX_TIERS];
+		/// Leaf bones that only followed their parent
+		size_t bonesSkipped;
+		/// Bones with an interpolated skin matrix
+		size_t bonesInterpolated;
+	};
+
 	/// A model node renders and animates a IModel.
 	/**
 	This uses a loaded IModel to render and animates it's vertices.
@@ -80,13 +120,24 @@ namespace milk
 
 		/// Get animation bone/joint
 		/**
-		Find joint and return it's current matrix (ie. position and rotation)
+		Find joint and return a scene node following it, other nodes can be
+		attached to it. The node is created on the first call, bones that are
+		never asked for don't have a node. Returns 0 if there is no such bone.
 		*/
-		CBone* getBone(std::string name) const;
+		CBone* getBone(std::string name);
 
+		/// Bones that have a scene node, see getBone()
 		const boneList& getBoneList() const
 		{ return m_bones; }
 
+		/// Animated pose of all bones
+		const CSkeleton& getSkeleton() const
+		{ return m_skeleton; }
+
+		/// Skin matrices of all bones, shared by all meshes of the model
+		const CSkinPalette& getSkinPalette() const
+		{ return m_skeleton.getPalette(); }
+
 		void setBindMaterial(bool bind)
 		{ m_bindMaterial = bind; }
 
@@ -111,19 +162,90 @@ namespace milk
 		bool getDrawMesh() const
 		{ return m_drawMesh; }
 
+		/// Add animation level of detail tier
+		/**
+		Without any tiers the animation is updated at 100 Hz.
+		At most CAnimationLodStats::MAX_TIERS tiers are allowed.
+		*/
+		void addAnimationLod(const CAnimationLod& lod);
+
+		/// Remove all animation level of detail tiers
+		void clearAnimationLods()
+		{ m_lods.clear(); }
+
+		const std::vector<CAnimationLod>& getAnimationLods() const
+		{ return m_lods; }
+
+		/// Tier used by the last animation update
+		size_t getAnimationLodTier() const
+		{ return m_lodTier; }
+
+		/// Projected screen size used by the last animation update, 0 if the model wasn't rendered
+		float getScreenSize() const
+		{ return m_lodScreenSize; }
+
+		/// Don't evaluate leaf bones when the screen size is below this
+		/**
+		Only bones without any children (including attached nodes) are skipped,
+		they keep their local matrix and follow their parent. 0 disables.
+		*/
+		void setSkipLeafBonesBelow(float screenSize)
+		{ m_skipLeafBonesBelow = screenSize; }
+
+		float getSkipLeafBonesBelow() const
+		{ return m_skipLeafBonesBelow; }
+
+		/// Interpolate the skin matrices between animation updates
+		/**
+		Hides the stepping of low update rates, at the cost of showing the
+		pose one update interval late.
+		*/
+		void setInterpolatePalette(bool interpolate)
+		{ m_interpolatePalette = interpolate; }
+
+		bool getInterpolatePalette() const
+		{ return m_interpolatePalette; }
+
+		/// Mesh level of detail used by the last render, see IModel::generateLods
+		size_t getMeshLod() const
+		{ return m_meshLod; }
+
+		static CAnimationLodStats& getAnimationLodStats()
+		{ return ms_lodStats; }
+
 	private:
 		void drawSkeleton();
+		void updateLodScreenSize();
+		size_t selectAnimationLod();
+		void updateBones();
 
 		// IModel pointer
 		IModel *m_pModel;
+		size_t m_meshLod;
 
-		// Vector with joint info
+		// Joint info, and scene nodes for the attached joints
+		CSkeleton m_skeleton;
 		boneList m_bones;
 
+		// Skin matrices to interpolate between (see setInterpolatePalette)
+		std::vector<CMatrix4f> m_paletteFrom, m_paletteTo;
+
 		// Animation info
 		float m_animationSpeed;
 		float m_lastUpdate;
 
+		// Animation level of detail
+		std::vector<CAnimationLod> m_lods;
+		size_t m_lodTier;
+		float m_screenSize;
+		unsigned int m_screenSizeFrame;
+		float m_lodScreenSize;
+		float m_skipLeafBonesBelow;
+		bool m_interpolatePalette;
+		bool m_interpolating;
+
+		static CAnimationLodStats ms_lodStats;
+
 		// Drawing flags
 		bool m_drawMesh;
 		bool m_bindMaterial;
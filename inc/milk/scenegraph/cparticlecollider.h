@@ -0,0 +1,78 @@
+#ifndef MILK_CPARTICLECOLLIDER_H_
+#define MILK_CPARTICLECOLLIDER_H_
+
+#include <vector>
+#include "milk/math/cvector.h"
+#include "milk/math/geometry.h"
+
+namespace milk
+{
+	/// Plane or height field that particles bounce off
+	/**
+		Particles that end up behind the surface are moved back onto it and
+		the part of the velocity into the surface is reflected and scaled by
+		the restitution, the part along the surface is scaled by
+		1 - friction. Particles are treated as points.
+
+		Add to a particle system with CParticleSystemBase::addCollider(), the
+		collision is done in the update loop, see CParticleStreams::collide().
+	*/
+	class CParticleCollider
+	{
+	public:
+		enum Type { PLANE, HEIGHT_FIELD };
+
+		/// Particles are kept on the side the plane normal points to
+		CParticleCollider(const CPlane<float>& plane, float restitution = 0.5f, float friction = 0.0f);
+
+		/// Height field over the xz plane
+		/**
+			heights holds width * depth samples, row by row along x, the
+			first sample is at origin and they are cellSize apart. Outside
+			the field nothing collides.
+		*/
+		CParticleCollider(const std::vector<float>& heights, size_t width, size_t depth,
+			const CVector3f& origin, float cellSize, float restitution = 0.5f, float friction = 0.0f);
+
+		Type getType() const
+		{ return m_type; }
+
+		const CPlane<float>& getPlane() const
+		{ return m_plane; }
+
+		void setRestitution(float restitution)
+		{ m_restitution = restitution; }
+
+		float getRestitution() const
+		{ return m_restitution; }
+
+		void setFriction(float friction)
+		{ m_friction = friction; }
+
+		float getFriction() const
+		{ return m_friction; }
+
+		/// Height field height at x, z, false if outside the field
+		bool height(float x, float z, float& h) const;
+
+		/// Height field normal at x, z
+		CVector3f normal(float x, float z) const;
+
+		/// Move the point out of the surface and reflect the velocity, returns true on contact
+		bool collide(CVector3f& position, CVector3f& velocity) const;
+
+	private:
+		float sample(int x, int z) const;
+
+		Type m_type;
+		CPlane<float> m_plane;
+		std::vector<float> m_heights;
+		size_t m_width, m_depth;
+		CVector3f m_origin;
+		float m_cellSize;
+		float m_restitution;
+		float m_friction;
+	};
+}
+
+#endif
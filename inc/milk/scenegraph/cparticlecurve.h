@@ -0,0 +1,66 @@
+#ifndef MILK_CPARTICLECURVE_H_
+#define MILK_CPARTICLECURVE_H_
+
+#include <map>
+#include "milk/math/math.h"
+#include "milk/ccolor.h"
+
+namespace milk
+{
+	/// Curve over the particle life baked into a lookup table
+	/**
+		The curve is sampled at SIZE evenly spaced points over [0,1] and
+		evaluated with linear interpolation between them, so no map lookup is
+		needed per particle.
+	*/
+	class CParticleCurve
+	{
+	public:
+		enum { SIZE = 256 };
+
+		CParticleCurve()
+		{ set(0.0f); }
+
+		/// Constant curve
+		void set(float value)
+		{
+			for(int i = 0; i < SIZE; ++i)
+				m_table[i] = value;
+		}
+
+		/// Sample a curve given as (time, value) keys, see math::map_lerp
+		void bake(const std::map<float, float>& curve)
+		{
+			for(int i = 0; i < SIZE; ++i)
+				m_table[i] = math::map_lerp(float(i) / (SIZE-1), curve);
+		}
+
+		/// Sample one channel of a color curve
+		void bake(const std::map<float, CColor4f>& curve, int channel)
+		{
+			for(int i = 0; i < SIZE; ++i)
+			{
+				CColor4f c = math::map_lerp(float(i) / (SIZE-1), curve);
+				m_table[i] = static_cast<const float*>(c)[channel];
+			}
+		}
+
+		/// Value at t, t is clamped to [0,1]
+		float evaluate(float t) const
+		{
+			float f = math::clamp(t, 0.0f, 1.0f) * (SIZE-1);
+			int i = int(f);
+			if(i > SIZE-2)
+				i = SIZE-2;
+			return m_table[i] + (m_table[i+1] - m_table[i]) * (f - float(i));
+		}
+
+		const float* table() const
+		{ return m_table; }
+
+	private:
+		float m_table[SIZE];
+	};
+}
+
+#endif
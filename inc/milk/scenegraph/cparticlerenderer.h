@@ -0,0 +1,110 @@
+#ifndef MILK_CPARTICLERENDERER_H_
+#define MILK_CPARTICLERENDERER_H_
+
+#include <map>
+#include <vector>
+#include "milk/scenegraph/cparticlesystem.h"
+
+namespace milk
+{
+	/// Draws particle systems that share texture and blending with one draw
+	/**
+		Systems with the renderer set (CParticleSystemBase::setRenderer())
+		don't queue geometry of their own, they are gathered per
+		CParticleBatchKey for the active camera instead. When the renderer
+		is rendered it writes the quads of every group into one streaming
+		vertex buffer and queues a single draw for it.
+
+		It must be rendered after the systems, so add it as the last child
+		of the scene manager. Systems rendered after it for the same camera
+		draw alone.
+
+		Effects with different textures can share a group by using one
+		texture atlas and CParticleSystemBase::setTextureRect().
+	*/
+	class CParticleRenderer : public ISceneNode
+	{
+	public:
+		CParticleRenderer();
+		virtual ~CParticleRenderer();
+
+		/// Queue a system for the active camera, false if it has to draw itself
+		bool add(CParticleSystemBase *pSystem, size_t numParticles);
+
+		/// Queue one draw per group for the active camera
+		virtual void render();
+
+		/// Number of draws queued this frame
+		size_t numDraws() const
+		{ return m_numDraws; }
+
+		/// Number of systems drawn through the renderer this frame
+		size_t numSystems() const
+		{ return m_numSystems; }
+
+	private:
+		class CGroup;
+
+		// Unmaps the buffers of the group before the pass draws them
+		class CGroupAppearance : public CAppearance
+		{
+		public:
+			CGroupAppearance(CGroup *pGroup)
+				: m_pGroup(pGroup)
+			{ }
+
+			virtual void setupRenderPass(CSceneManager *pSceneManager, IRenderPass *pRenderPass);
+
+			CGroup *m_pGroup;
+		};
+
+		// Vertex buffer of a group for one camera
+		class CGroupBuffer
+		{
+		public:
+			CGroupBuffer()
+				: m_pVertexBuffer(0), m_locked(false)
+			{ }
+
+			~CGroupBuffer()
+			{ delete m_pVertexBuffer; }
+
+			IVertexBuffer *m_pVertexBuffer;
+			// Systems writing into the buffer, referenced until they're done
+			std::vector<CParticleSystemBase*> m_systems;
+			bool m_locked;
+		};
+
+		class CGroup
+		{
+		public:
+			CGroup();
+			~CGroup();
+
+			/// Buffer for the active camera
+			CGroupBuffer& activeBuffer(unsigned int frame);
+
+			/// Wait for the systems and unmap the buffers
+			void finish();
+
+			handle<CGroupAppearance> m_pAppearance;
+			bool m_useColor;
+			std::vector<std::pair<CParticleSystemBase*, size_t> > m_queued;
+			std::vector<CGroupBuffer*> m_buffers;
+			size_t m_numBuffers;
+			unsigned int m_frame;
+		};
+
+		void beginFrame();
+
+		typedef std::map<CParticleBatchKey, CGroup*> groupMap;
+		groupMap m_groups;
+		// Cameras already drawn this frame
+		std::vector<CCamera*> m_done;
+		unsigned int m_frame;
+		size_t m_numDraws;
+		size_t m_numSystems;
+	};
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef MILK_CPARTICLESCHEDULER_H_
+#define MILK_CPARTICLESCHEDULER_H_
+
+#include <vector>
+#include "milk/types.h"
+
+namespace milk
+{
+	class ISceneNode;
+	class CParticleSystemBase;
+
+	/// Updates all particle systems of a scene in parallel
+	/**
+		Systems that are off-screen or skipped by their LOD this time aren't
+		advanced, see CParticleSystemBase::schedule(). The live particles of
+		every other system are split into chunks that are
+		simulated on worker threads, so one big system is spread over all
+		processors as well as many small ones. Emitting is done per system
+		afterwards, each system with its own random numbers, so the result
+		only depends on the seeds and not on the number of threads.
+
+		Use instead of calling update() on each system.
+	*/
+	class CParticleScheduler
+	{
+	public:
+		CParticleScheduler(size_t chunkSize = 4096);
+
+		/// Maximum number of particles simulated as one task, rounded up to a multiple of four
+		void setChunkSize(size_t chunkSize);
+
+		size_t getChunkSize() const
+		{ return m_chunkSize; }
+
+		/// Update every particle system in the tree below pRoot, pRoot included
+		void update(ISceneNode *pRoot, float dt);
+
+		/// Number of systems found by the last update()
+		size_t numSystems() const
+		{ return m_numSystems; }
+
+		/// Number of systems advanced by the last update(), the rest were culled or skipped by the LOD
+		size_t numUpdated() const
+		{ return m_numUpdated; }
+
+		/// Particles [m_begin, m_end) of a system, simulated as one task
+		class CChunk
+		{
+		public:
+			CChunk(CParticleSystemBase *pSystem, size_t begin, size_t end, float dt)
+				: m_pSystem(pSystem), m_begin(begin), m_end(end), m_dt(dt)
+			{ }
+
+			CParticleSystemBase *m_pSystem;
+			size_t m_begin, m_end;
+			float m_dt;
+		};
+
+		typedef std::vector<CChunk> chunkList;
+		typedef std::vector<CParticleSystemBase*> systemList;
+
+	private:
+		void collect(ISceneNode *pNode);
+
+		systemList m_systems;
+		// Systems to advance this time and their step
+		systemList m_active;
+		std::vector<float> m_steps;
+		chunkList m_chunks;
+		size_t m_chunkSize;
+		size_t m_numSystems;
+		size_t m_numUpdated;
+	};
+}
+
+#endif
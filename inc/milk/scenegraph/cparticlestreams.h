@@ -0,0 +1,191 @@
+#ifndef MILK_CPARTICLESTREAMS_H_
+#define MILK_CPARTICLESTREAMS_H_
+
+#include "milk/math/cvector.h"
+#include "milk/ccolor.h"
+#include "milk/boost.h"
+
+namespace milk
+{
+	class CParticleCollider;
+
+	/// Structure-of-arrays particle storage
+	/**
+		Every particle attribute is kept in a float array of its own, aligned
+		to 16 bytes and padded to a multiple of four, so the update kernels
+		can process four particles at a time with SSE. Live particles are
+		kept packed at the front, see emit() and kill().
+
+		Can be used as CONTAINER of CParticleSystem, iterating gives
+		reference proxies instead of particle objects.
+	*/
+	class CParticleStreams
+	{
+	public:
+		enum Stream
+		{
+			POSITION_X, POSITION_Y, POSITION_Z,
+			VELOCITY_X, VELOCITY_Y, VELOCITY_Z,
+			LIFE, INV_MAX_LIFE, PROGRESS,
+			SIZE, START_SIZE, END_SIZE,
+			COLOR_R, COLOR_G, COLOR_B, COLOR_A,
+			XAXIS_X, XAXIS_Y, XAXIS_Z,
+			YAXIS_X, YAXIS_Y, YAXIS_Z,
+			NUM_STREAMS
+		};
+
+		/// One particle, read from the streams
+		class reference
+		{
+		public:
+			reference()
+				: m_pStreams(0), m_index(0)
+			{ }
+
+			reference(const CParticleStreams *pStreams, size_t index)
+				: m_pStreams(pStreams), m_index(index)
+			{ }
+
+			float size() const
+			{ return get(SIZE); }
+			CVector3f position() const
+			{ return m_pStreams->getVector(POSITION_X, m_index); }
+			CColor4f color() const
+			{ return CColor4f(get(COLOR_R), get(COLOR_G), get(COLOR_B), get(COLOR_A)); }
+			CVector3f xAxis() const
+			{ return m_pStreams->getVector(XAXIS_X, m_index); }
+			CVector3f yAxis() const
+			{ return m_pStreams->getVector(YAXIS_X, m_index); }
+
+		private:
+			float get(Stream s) const
+			{ return m_pStreams->stream(s)[m_index]; }
+
+			const CParticleStreams *m_pStreams;
+			size_t m_index;
+		};
+
+		class iterator
+		{
+		public:
+			iterator(const CParticleStreams *pStreams, size_t index)
+				: m_pStreams(pStreams), m_index(index)
+			{ }
+
+			reference operator*() const
+			{ return reference(m_pStreams, m_index); }
+
+			iterator& operator++()
+			{ ++m_index; return *this; }
+
+			bool operator==(const iterator& it) const
+			{ return m_index == it.m_index; }
+
+			bool operator!=(const iterator& it) const
+			{ return m_index != it.m_index; }
+
+		private:
+			const CParticleStreams *m_pStreams;
+			size_t m_index;
+		};
+
+		typedef iterator const_iterator;
+		typedef reference value_type;
+
+		/// Create with room for capacity particles, the value is ignored
+		CParticleStreams(size_t capacity, const reference& value = reference());
+		~CParticleStreams();
+
+		/// Number of live particles
+		size_t size() const
+		{ return m_size; }
+
+		size_t capacity() const
+		{ return m_capacity; }
+
+		bool full() const
+		{ return m_size == m_capacity; }
+
+		/// Remove all particles
+		void clear()
+		{ m_size = 0; }
+
+		/// Add a particle at the end and return its index, the streams are not initialized
+		size_t emit()
+		{ BOOST_ASSERT(m_size < m_capacity); return m_size++; }
+
+		/// Remove a particle by moving the last particle into its place
+		void kill(size_t i);
+
+		iterator begin() const
+		{ return iterator(this, 0); }
+
+		iterator end() const
+		{ return iterator(this, m_size); }
+
+		reference operator[](size_t i) const
+		{ return reference(this, i); }
+
+		float* stream(Stream s)
+		{ return m_streams[s]; }
+
+		const float* stream(Stream s) const
+		{ return m_streams[s]; }
+
+		/// Read three consecutive streams as a vector
+		CVector3f getVector(Stream x, size_t i) const
+		{ return CVector3f(m_streams[x][i], m_streams[x+1][i], m_streams[x+2][i]); }
+
+		/// Write three consecutive streams from a vector
+		void setVector(Stream x, size_t i, const CVector3f& v)
+		{ m_streams[x][i] = v.x; m_streams[x+1][i] = v.y; m_streams[x+2][i] = v.z; }
+
+		void setColor(size_t i, const CColor4f& c)
+		{ m_streams[COLOR_R][i] = c.r; m_streams[COLOR_G][i] = c.g; m_streams[COLOR_B][i] = c.b; m_streams[COLOR_A][i] = c.a; }
+
+		/// Kernels
+		/**
+			Each kernel processes the particles [begin, end), begin must be a
+			multiple of four. Particles in different ranges don't affect each
+			other, so the ranges can be updated on different threads.
+		*/
+		/// PROGRESS = 1 - LIFE * INV_MAX_LIFE, ie 0 when born and 1 when dying
+		void progress(size_t begin, size_t end);
+
+		/// out = from + (to - from) * PROGRESS
+		void lerp(Stream out, Stream from, Stream to, size_t begin, size_t end);
+
+		/// out = from + (to - from) * PROGRESS
+		void lerp(Stream out, float from, float to, size_t begin, size_t end);
+
+		/// Add force to velocity and velocity to position
+		void integrate(const CVector3f& force, float dt, size_t begin, size_t end);
+
+		/// Decrease life
+		void age(float dt, size_t begin, size_t end);
+
+		/// Push particles out of the collider and reflect their velocity
+		void collide(const CParticleCollider& collider, size_t begin, size_t end);
+
+		/// Box around the live particle positions and the largest SIZE, there must be live particles
+		void bounds(CVector3f& min, CVector3f& max, float& maxSize) const;
+
+	private:
+		CParticleStreams(const CParticleStreams&);
+		CParticleStreams& operator=(const CParticleStreams&);
+
+		// End of the floats processed by the kernels, a multiple of four
+		size_t padded(size_t begin, size_t end) const
+		{
+			BOOST_ASSERT((begin & 3) == 0 && begin <= end && end <= m_size);
+			return (end + 3) & ~size_t(3);
+		}
+
+		float *m_streams[NUM_STREAMS];
+		char *m_pBlock;
+		size_t m_size;
+		size_t m_capacity;
+	};
+}
+
+#endif
@@ -6,24 +6,336 @@
 //#include "milk/cxmlparser.h"
 #include "milk/vectorpod.h"
 #include "milk/scenegraph/irenderable.h"
+#include "milk/scenegraph/cparticlestreams.h"
+#include "milk/scenegraph/cparticlecurve.h"
+#include "milk/scenegraph/cparticlecollider.h"
 #include "milk/includes.h"
 #include "milk/glhelper.h"
 #include "milk/scenegraph/cscenemanager.h"
 #include "milk/scenegraph/ccamera.h"
 #include "milk/iresource.h"
+#include "milk/renderer/ivertexbuffer.h"
+#include "milk/renderer/cappearance.h"
+#include "milk/parallel.h"
+#include "milk/random.h"
+#include "milk/math/crect.h"
 #include <vector>
 #include <map>
 
 namespace milk
 {
-	class CParticleSystemBase : public ISceneNode
+	class CParticleSystemBase;
+	class CParticleRenderer;
+	class ITexture;
+
+	/// What particle systems must have in common to be drawn together, see CParticleRenderer
+	class CParticleBatchKey
 	{
 	public:
-		CParticleSystemBase()
+		CParticleBatchKey()
+			: m_pTexture(0), m_blendSrc(GL_ONE), m_blendDst(GL_ZERO), m_blend(false), m_useColor(false)
+		{ }
+
+		bool operator<(const CParticleBatchKey& rhs) const
 		{
-			//m_type = TYPE_3D;
+			if(m_pTexture != rhs.m_pTexture)
+				return m_pTexture < rhs.m_pTexture;
+			if(m_blend != rhs.m_blend)
+				return m_blend < rhs.m_blend;
+			if(m_blendSrc != rhs.m_blendSrc)
+				return m_blendSrc < rhs.m_blendSrc;
+			if(m_blendDst != rhs.m_blendDst)
+				return m_blendDst < rhs.m_blendDst;
+			return m_useColor < rhs.m_useColor;
 		}
-		virtual ~CParticleSystemBase() {}
+
+		ITexture *m_pTexture;
+		GLenum m_blendSrc, m_blendDst;
+		bool m_blend;
+		bool m_useColor;
+	};
+
+	/// Billboard quads of a particle system as seen from one camera
+	class CBillboardBatch : public CWorkerTask
+	{
+	public:
+		CBillboardBatch(CParticleSystemBase *pSystem)
+			: m_pSystem(pSystem), m_pVertexBuffer(0), m_pTarget(0), m_first(0), m_numVertices(0), m_locked(false)
+		{ }
+
+		~CBillboardBatch();
+
+		/// Generate the quads, runs on a worker thread
+		void run();
+
+		/// Make m_order a permutation of [0, count), keeping the previous order where possible
+		void updateOrder(size_t count);
+
+		/// Sort m_order back to front by m_depths
+		/**
+			m_depths holds the depth of the particles in m_order. The order of
+			the last frame is mostly still right, if so it's fixed with an
+			insertion sort, otherwise the depths are quantised to 16 bits and
+			radix sorted.
+		*/
+		void sortByDepth();
+
+		CParticleSystemBase *m_pSystem;
+		// Vertex buffer of the system for this camera, not used when drawn by a CParticleRenderer
+		IVertexBuffer *m_pVertexBuffer;
+		// Mapped buffer the quads are written to, from vertex m_first
+		IVertexBuffer *m_pTarget;
+		CVector3f m_right, m_up;
+		// View space z axis, larger is closer to the camera
+		CVector3f m_depthAxis;
+		size_t m_first;
+		size_t m_numVertices;
+		bool m_locked;
+
+		std::vector<uint> m_order;
+		std::vector<float> m_depths;
+
+	private:
+		bool insertionSort(size_t maxMoves);
+		void radixSort();
+
+		std::vector<uint> m_keys, m_tempKeys, m_tempOrder;
+	};
+
+	/// Appearance of a particle system
+	/**
+		Finishes the billboard vertex buffers of the system before the render
+		pass draws them.
+	*/
+	class CParticleAppearance : public CAppearance
+	{
+		friend class CParticleSystemBase;
+	public:
+		CParticleAppearance(CParticleSystemBase *pSystem)
+			: m_pSystem(pSystem)
+		{ }
+
+		virtual void setupRenderPass(CSceneManager *pSceneManager, IRenderPass *pRenderPass);
+
+	private:
+		CParticleSystemBase *m_pSystem;
+	};
+
+	/// Renders particles as billboards through the render queue
+	/**
+		render() maps a DYNAMIC vertex buffer and fills it with one quad per
+		particle, facing the active camera. Large systems do this on the
+		threads of CWorkerPool::instance() while the rest of the scene is
+		collected. The buffer is unmapped when the render pass sets up the
+		appearance.
+	*/
+	class CParticleSystemBase : public ISceneNode
+	{
+		friend class CBillboardBatch;
+		friend class CParticleAppearance;
+		friend class CParticleRenderer;
+	public:
+		CParticleSystemBase();
+		virtual ~CParticleSystemBase();
+
+		/// Generate billboards on a worker thread for at least this many particles
+		static void setThreadedBillboards(size_t minParticles)
+		{ ms_threadedBillboards = minParticles; }
+
+		static size_t getThreadedBillboards()
+		{ return ms_threadedBillboards; }
+
+		/// Draw the particles back to front
+		/**
+			Needed for blending that isn't order independent, like
+			GL_ONE_MINUS_SRC_ALPHA. The particles are sorted per camera along
+			with the billboard generation, on the worker thread for large
+			systems.
+		*/
+		void setSorted(bool sorted)
+		{ m_sorted = sorted; }
+
+		bool getSorted() const
+		{ return m_sorted; }
+
+		/// Draw together with other systems through a renderer, 0 to draw alone
+		void setRenderer(CParticleRenderer *pRenderer)
+		{ m_pRenderer = pRenderer; }
+
+		CParticleRenderer* getRenderer() const
+		{ return m_pRenderer; }
+
+		/// Part of the texture to use, for texture atlases shared by systems
+		void setTextureRect(const CRect<float>& rect)
+		{ m_textureRect = rect; }
+
+		const CRect<float>& getTextureRect() const
+		{ return m_textureRect; }
+
+		/// Texture and blending, systems with the same key can be drawn together
+		virtual CParticleBatchKey getBatchKey() const = 0;
+
+		/// Seed the random numbers of the emitter
+		/**
+			Every system has a generator of its own, seeded in creation order
+			unless seeded here. Systems with the same seed and the same
+			updates give the same particles, no matter how the updates are
+			spread over threads, see CParticleScheduler.
+		*/
+		void seed(uint s)
+		{ m_random.seed(s); }
+
+		CFastRandom& getRandom()
+		{ return m_random; }
+
+		/// Reduce the detail with the screen size
+		/**
+			At fullSize (a fraction of the viewport height, see
+			CCamera::projectedSize()) and above the system is updated every
+			frame at the full emission rate. Towards minSize the emission rate
+			drops to minRate of the full rate and the updates are spread out to
+			at most maxInterval seconds apart. A fullSize of zero turns it off.
+		*/
+		void setLod(float fullSize, float minSize, float minRate = 0.25f, float maxInterval = 0.1f);
+
+		/// Detail in [0, 1], 1 is full detail
+		float getLodFactor() const
+		{ return m_lodFactor; }
+
+		/// Largest projected size of the bounds over the cameras of the last frame
+		float getScreenSize() const
+		{ return m_screenSize; }
+
+		/// World space box around the live particles as of the last update
+		const CBox<float>& getBounds() const
+		{ return m_bounds; }
+
+		/// Time simulated when an off-screen system comes back into view
+		/**
+			Systems outside every camera frustum aren't updated, the time is
+			caught up in steps of at most step seconds once they're visible
+			again, but no more than maxTime seconds of it.
+		*/
+		void setFastForward(float maxTime, float step)
+		{ m_fastForwardTime = maxTime; m_fastForwardStep = step; }
+
+		/// Bounce the particles off a plane or height field
+		void addCollider(const CParticleCollider& collider)
+		{ m_colliders.push_back(collider); }
+
+		void clearColliders()
+		{ m_colliders.clear(); }
+
+		const std::vector<CParticleCollider>& getColliders() const
+		{ return m_colliders; }
+
+		/// Number of live particles
+		virtual size_t numParticles() const = 0;
+
+		/// Advance the system, same as schedule() and step()
+		virtual void update(float dt);
+
+		/// Decide how to advance the system dt seconds
+		/**
+			Returns the number of steps of step seconds to do, zero if the
+			system is off-screen or skipped by the LOD this time.
+		*/
+		size_t schedule(float dt, float& step);
+
+		/// Same as simulate() for all particles, emit() and updateBounds()
+		void step(float dt);
+
+		/// Main thread part of the update, before simulate() and emit()
+		virtual void prepareUpdate();
+
+		/// Advance the live particles [begin, end)
+		/**
+			Doesn't add, remove or reorder particles and doesn't use the
+			random numbers, so different ranges can be simulated on different
+			threads. begin must be a multiple of four.
+		*/
+		virtual void simulate(size_t begin, size_t end, float dt) = 0;
+
+		/// Remove dead particles and emit new ones
+		virtual void emit(float dt) = 0;
+
+		/// True when the system is done and should be released
+		virtual bool finished() const
+		{ return false; }
+
+		/// Give up the reference of a finished system, done once by the update
+		/**
+			Systems that release themselves hold one reference for that, it's
+			released the first time the system is finished after an update.
+			Whoever else holds a reference keeps the system alive, later
+			updates don't release it again.
+		*/
+		void releaseFinished();
+
+		/// Recalculate the bounds from the live particles
+		virtual void updateBounds() = 0;
+
+	protected:
+		/// Set the bounds, if there are no particles they are at the emitter
+		void setBounds(const CVector3f& min, const CVector3f& max);
+
+		/// Fraction of the full emission rate to use
+		float emitRate() const
+		{ return m_lodMinRate + (1.0f - m_lodMinRate) * m_lodFactor; }
+
+		/// Start generating the quads for the active camera and queue the geometry
+		void renderBillboards(size_t numParticles, size_t maxParticles, bool useColor);
+
+		/// Wait for the worker threads and unmap the vertex buffers
+		void finishBillboards();
+
+		/// Batch for the active camera
+		CBillboardBatch& activeBatch();
+
+		/// Write the quads into pTarget from vertex first, on a worker thread for large systems
+		void startBillboards(CBillboardBatch& batch, IVertexBuffer *pTarget, size_t first, size_t numParticles);
+
+		/// DYNAMIC buffer for billboards, with colors if useColor is set
+		static IVertexBuffer* createBillboardBuffer(size_t numVertices, bool useColor);
+
+		static bool hasColor(IVertexBuffer *pVertexBuffer);
+
+		/// Write four vertices per particle into the mapped vertex buffer of the batch
+		virtual void generateBillboards(CBillboardBatch& batch) = 0;
+
+		/// Set texture and states of the particles
+		virtual void setupAppearance(CPass& pass) = 0;
+
+	private:
+		handle<CParticleAppearance> m_pAppearance;
+		std::vector<CBillboardBatch*> m_batches;
+		size_t m_numBatches;
+		unsigned int m_batchFrame;
+
+		CBox<float> m_bounds;
+		CVector3f m_boundsOrigin;
+		bool m_hasBounds;
+		unsigned int m_visibleFrame;
+		float m_screenSize;
+		float m_pendingTime;
+
+		float m_lodFullSize, m_lodMinSize;
+		float m_lodMinRate, m_lodMaxInterval;
+		float m_lodFactor;
+		float m_fastForwardTime, m_fastForwardStep;
+
+	protected:
+		CFastRandom m_random;
+		std::vector<CParticleCollider> m_colliders;
+		CParticleRenderer *m_pRenderer;
+		CRect<float> m_textureRect;
+		bool m_sorted;
+
+	private:
+		bool m_releasedFinished;
+
+		static size_t ms_threadedBillboards;
+		static uint ms_nextSeed;
 	};
 
 
@@ -34,20 +346,35 @@ namespace milk
 		typedef CONTAINER containerType;
 		typedef PARTICLE particleType;
 
+		/// Create with room for numParticles particles
+		/**
+			The live particles are kept packed at the front of the container,
+			update() appends new particles and moves the last particle into
+			the place of a dead one, so only live particles are visited.
+		*/
 		CParticleSystem(size_t numParticles)
-			: m_particles(numParticles, PARTICLE()), m_relative(false), m_useColor(false), m_billboarded(true)
-		{ }
+			: m_particles(numParticles, PARTICLE()), m_maxParticles(numParticles), m_relative(false), m_useColor(false), m_billboarded(true)
+		{ m_particles.clear(); }
 
 		virtual ~CParticleSystem() {}
 
-		virtual void beginRender() = 0;
-		virtual void endRender() = 0;
+		virtual void render()
+		{ renderBillboards(m_particles.size(), m_maxParticles, m_useColor); }
 
-		virtual void update(float dt) = 0;
-		virtual void render();
+		virtual void updateBounds();
+
+		/// Number of live particles
+		virtual size_t numParticles() const
+		{ return m_particles.size(); }
+
+		size_t maxParticles() const
+		{ return m_maxParticles; }
 
 	protected:
+		virtual void generateBillboards(CBillboardBatch& batch);
+
 		CONTAINER m_particles;
+		size_t m_maxParticles;
 		bool m_relative;
 		bool m_useColor;
 		bool m_billboarded;
@@ -55,18 +382,13 @@ namespace milk
 
 	//////////////////////////////////////////////////////////////////////////
 
-	class ITexture; // FIXME: remove this when done with it...
-
 	class CBasicParticle
 	{
 		friend class CBasicParticleSystem;
 	public:
 		CBasicParticle()
-			: m_active(false)
 		{ }
 
-		inline bool active() const
-		{ return m_active; }
 		inline float size() const
 		{ return m_size; }
 		inline const CVector3f& position() const
@@ -79,7 +401,6 @@ namespace milk
 		{ return CVector3f::YAXIS; }
 
 	private:
-		bool m_active;
 		float m_size;
 		CVector3f m_position;
 		CVector3f m_velocity;
@@ -92,65 +413,46 @@ namespace milk
 		CBasicParticleSystem(size_t numParticles);
 		virtual ~CBasicParticleSystem();
 
-		virtual void update(float dt);
-		virtual void beginRender();
-		virtual void endRender();
+		virtual void simulate(size_t begin, size_t end, float dt);
+		virtual void emit(float dt);
+
+		virtual CParticleBatchKey getBatchKey() const;
 
 	protected:
+		virtual void setupAppearance(CPass& pass);
+
 		CColor4f m_color;
 		handle<ITexture> m_texture;
 	};
 
 	//////////////////////////////////////////////////////////////////////////
 
-	class CAdvancedParticle
-	{
-		friend class CAdvancedParticleSystem;
-	public:
-		CAdvancedParticle()
-			: m_active(false)
-		{ }
-
-		inline bool active() const
-		{ return m_active; }
-		inline float size() const
-		{ return m_size; }
-		inline const CVector3f& position() const
-		{ return m_position; }
-		inline const CColor4f& color() const
-		{ return m_color; }
-		inline const CVector3f& xAxis() const
-		{ return m_xAxis; }
-		inline const CVector3f& yAxis() const
-		{ return m_yAxis; }
-
-	private:
-		bool m_active;
-		CColor4f m_color;
-		float m_startSize;
-		float m_endSize;
-		float m_size;
-		CVector3f m_position;
-		CVector3f m_velocity;
-		float m_life;
-		float m_maxLife;
-		CVector3f m_xAxis;
-		CVector3f m_yAxis;
-	};
-	
-	class CAdvancedParticleSystem : public CParticleSystem<CAdvancedParticle>
+	/// Particle system with linear size and color over the particle life
+	/**
+		Particles are stored as CParticleStreams and updated by its kernels.
+	*/
+	class CAdvancedParticleSystem : public CParticleSystem<CParticleStreams::reference, CParticleStreams>
 	{
 	public:
 		CAdvancedParticleSystem(size_t numParticles, std::string filename);
 		virtual ~CAdvancedParticleSystem();
 
-		virtual void update(float dt);
-		virtual void beginRender();
-		virtual void endRender();
+		virtual void simulate(size_t begin, size_t end, float dt);
+		virtual void emit(float dt);
+
+		virtual bool finished() const
+		{ return m_numToEmit == 0 && m_autoRelease; }
 
 		void setBillboarding(bool bb)
 		{ m_billboarded = bb; }
 
+		virtual CParticleBatchKey getBatchKey() const;
+
+	protected:
+		virtual void setupAppearance(CPass& pass);
+
+	public:
+
 	//protected:
 		CVector3f m_emitterSize;
 		int m_emitCount;
@@ -192,11 +494,8 @@ namespace milk
 		friend class CAdvancedParticleSystem2;
 	public:
 		CAdvancedParticle2()
-			: m_active(false)
 		{ }
 
-		inline bool active() const
-		{ return m_active; }
 		inline float size() const
 		{ return m_size; }
 		inline const CVector3f& position() const
@@ -209,7 +508,6 @@ namespace milk
 		{ return m_yAxis; }
 
 	private:
-		bool m_active;
 		CColor4f m_color;
 		float m_size;
 		CVector3f m_position;
@@ -226,13 +524,34 @@ namespace milk
 		CAdvancedParticleSystem2(size_t numParticles, std::string filename);
 		virtual ~CAdvancedParticleSystem2();
 
-		virtual void update(float dt);
-		virtual void beginRender();
-		virtual void endRender();
+		virtual void prepareUpdate();
+		virtual void simulate(size_t begin, size_t end, float dt);
+		virtual void emit(float dt);
+
+		virtual bool finished() const
+		{ return m_numToEmit == 0 && m_autoRelease; }
 
 		void setBillboarding(bool bb)
 		{ m_billboarded = bb; }
 
+		virtual CParticleBatchKey getBatchKey() const;
+
+		/// Bake m_velocity, m_color and m_size into lookup tables
+		/**
+			Done by the first prepareUpdate(), call it again after changing the curves.
+		*/
+		void bakeCurves();
+
+	protected:
+		virtual void setupAppearance(CPass& pass);
+
+		CParticleCurve m_velocityCurve;
+		CParticleCurve m_colorCurve[4];
+		CParticleCurve m_sizeCurve;
+		bool m_curvesBaked;
+
+	public:
+
 		//protected:
 		CVector3f m_emitterSize;
 		int m_emitCount;
@@ -269,73 +588,111 @@ namespace milk
 
 	//////////////////////////////////////////////////////////////////////////
 
-	template<class P, class C>
-	void CParticleSystem<P, C>::render()
+	namespace detail
 	{
-		beginRender();
+		// Box around the particle centers and the largest particle size
+		template<class C>
+		void particleBounds(const C& particles, CVector3f& min, CVector3f& max, float& maxSize)
+		{
+			typename C::const_iterator it = particles.begin();
+			min = max = (*it).position();
+			maxSize = (*it).size();
+			for(++it; it != particles.end(); ++it)
+			{
+				CVector3f p = (*it).position();
+				min = math::vectorMin(min, p);
+				max = math::vectorMax(max, p);
+				maxSize = std::max(maxSize, (*it).size());
+			}
+		}
+
+		inline void particleBounds(const CParticleStreams& particles, CVector3f& min, CVector3f& max, float& maxSize)
+		{ particles.bounds(min, max, maxSize); }
+	}
 
-		if(m_relative)
+	template<class P, class C>
+	void CParticleSystem<P, C>::updateBounds()
+	{
+		if(m_particles.size() == 0)
 		{
-			glPushMatrix();
-			//doTransform();
+			setBounds(ltm().position(), ltm().position());
+			return;
 		}
 
-		//setWinding(m_relative?getTransformNode():0);
+		CVector3f min, max;
+		float size;
+		detail::particleBounds(m_particles, min, max, size);
+
+		// Billboard corners are up to size * sqrt(2) from the center
+		CVector3f pad(size * 1.415f, size * 1.415f, size * 1.415f);
+		setBounds(min - pad, max + pad);
+	}
 
-		// TODO: FIX WINDING!
-		CMatrix4f mat = glGetMatrixf(GL_MODELVIEW_MATRIX);
-		CVector3f right = mat.row3(0);
-		CVector3f up = mat.row3(1);
+	template<class P, class C>
+	void CParticleSystem<P, C>::generateBillboards(CBillboardBatch& batch)
+	{
+		CDataContainer<CVector3f>::iterator vit = batch.m_pTarget->getVertices3f().begin() + batch.m_first;
+		CDataContainer<CVector2f>::iterator tit = batch.m_pTarget->getTexCoords2f(0).begin() + batch.m_first;
+		const CRect<float>& uv = m_textureRect;
 
-		glBegin(GL_QUADS);
-		for(C::iterator it = m_particles.begin(); it != m_particles.end(); ++it)
+		size_t count = m_particles.size();
+		if(m_sorted)
 		{
-			P& p = *it;
-			if(p.active())
+			batch.updateOrder(count);
+			batch.m_depths.resize(count);
+			for(size_t i = 0; i < count; ++i)
+				batch.m_depths[i] = dot(batch.m_depthAxis, m_particles[batch.m_order[i]].position());
+			batch.sortByDepth();
+		}
+
+		CVector3f right = batch.m_right;
+		CVector3f up = batch.m_up;
+		for(size_t i = 0; i < count; ++i)
+		{
+			typename C::reference p = m_particles[m_sorted ? batch.m_order[i] : i];
+			if(!m_billboarded)
 			{
-				if(!m_billboarded)
-				{
-					right = p.xAxis();
-					up = p.yAxis();
-				}
-
-				CVector3f vPoint0 = p.position() + ((-right - up) * p.size());
-				CVector3f vPoint1 = p.position() + (( right - up) * p.size());
-				CVector3f vPoint2 = p.position() + ((-right + up) * p.size());
-				CVector3f vPoint3 = p.position() + (( right + up) * p.size());
-
-				/*
-					0 ~ 1
-					|   |
-					|   |
-					2---3
-				*/
-
-				if(m_useColor)
-					glColor4(p.color());
-
-				//if(1/*getWinding()*/)
-				{
-					glTexCoord2f(1,1); glVertex3(vPoint0);
-					glTexCoord2f(0,1); glVertex3(vPoint1);
-					glTexCoord2f(0,0); glVertex3(vPoint3);
-					glTexCoord2f(1,0); glVertex3(vPoint2);
-				}
-				/*else
-				{
-					glTexCoord2f(1,1); glVertex3(vPoint0);
-					glTexCoord2f(1,0); glVertex3(vPoint2);
-					glTexCoord2f(0,0); glVertex3(vPoint3);
-					glTexCoord2f(0,1); glVertex3(vPoint1);
-				}*/
+				right = p.xAxis();
+				up = p.yAxis();
 			}
+
+			CVector3f position = p.position();
+			float size = p.size();
+
+			/*
+				0 ~ 1
+				|   |
+				|   |
+				2---3
+			*/
+			*vit = position + ((-right - up) * size); ++vit;
+			*vit = position + (( right - up) * size); ++vit;
+			*vit = position + (( right + up) * size); ++vit;
+			*vit = position + ((-right + up) * size); ++vit;
+
+			*tit = CVector2f(uv.x2, uv.y2); ++tit;
+			*tit = CVector2f(uv.x1, uv.y2); ++tit;
+			*tit = CVector2f(uv.x1, uv.y1); ++tit;
+			*tit = CVector2f(uv.x2, uv.y1); ++tit;
 		}
-		glEnd();
-		
-		if(m_relative)
-			glPopMatrix();
 
-		endRender();
+		if(m_useColor)
+		{
+			CDataContainer<CColor4ub>::iterator cit = batch.m_pTarget->getColors4ub().begin() + batch.m_first;
+			for(size_t i = 0; i < count; ++i)
+			{
+				CColor4f c = m_particles[m_sorted ? batch.m_order[i] : i].color();
+				CColor4ub cub(
+					(unsigned char)(math::clamp(c.r, 0.0f, 1.0f) * 255.0f),
+					(unsigned char)(math::clamp(c.g, 0.0f, 1.0f) * 255.0f),
+					(unsigned char)(math::clamp(c.b, 0.0f, 1.0f) * 255.0f),
+					(unsigned char)(math::clamp(c.a, 0.0f, 1.0f) * 255.0f));
+				*cit = cub; ++cit;
+				*cit = cub; ++cit;
+				*cit = cub; ++cit;
+				*cit = cub; ++cit;
+			}
+		}
 	}
 
 	//template class CParticleSystem<CParticleTest>;
@@ -64,6 +64,10 @@ namespace milk
 		CCamera *getActiveCamera()
 		{ return m_pActiveCamera; }
 
+		/// Number of times render() has been called
+		unsigned int getFrame() const
+		{ return m_frame; }
+
 		std::vector<CLight*>& getLights()
 		{ return m_lights; }
 		std::vector<CClipPlane*>& getClipPlanes()
@@ -125,6 +129,8 @@ namespace milk
 		CColor4f m_fogColor;
 		GLfloat m_fogArg1, m_fogArg2;
 
+		unsigned int m_frame;
+
 		// ...
 		std::vector<CLight*> m_lights;
 		std::vector<CClipPlane*> m_clipPlanes;
@@ -7,6 +7,7 @@
 #include "milk/scenegraph/ctransform.h"
 #include <list>
 #include <set>
+#include <vector>
 
 namespace milk
 {
@@ -31,11 +32,11 @@ namespace milk
 		enum LinkMode { DISABLED, INCLUDE, EXCLUDE };
 
 		ISceneNode()
-			: m_pParent(0), m_pSceneManager(0), m_scope(SCOPE_DEFAULT), m_visible(true), m_dirty(true), m_linkMode(DISABLED)
+			: m_pParent(0), m_pSceneManager(0), m_scope(SCOPE_DEFAULT), m_visible(true), m_dirty(true), m_interpolated(false), m_linkMode(DISABLED)
 		{ ++ms_nodeCount; }
 
 		virtual ~ISceneNode()
-		{ --ms_nodeCount; }
+		{ setInterpolated(false); --ms_nodeCount; }
 
 		/// Total number of allocated scene-nodes.
 		static size_t numNodes()
@@ -166,6 +167,26 @@ namespace milk
 			}
 		}
 
+		/// Render the transform between the last two fixed simulation steps
+		/**
+			For nodes that are moved by the simulation, see
+			IWindow::setFixedStep(). Only the matrix of the node itself is
+			interpolated, children follow it.
+		*/
+		void setInterpolated(bool interpolated);
+
+		bool getInterpolated() const
+		{ return m_interpolated; }
+
+		/// Remember the matrices of the interpolated nodes, before each step
+		static void storeTransforms();
+
+		/// Set the interpolated nodes t of the way from the stored to the current matrices
+		static void beginInterpolation(float t);
+
+		/// Restore the current matrices after beginInterpolation()
+		static void endInterpolation();
+
 		/// Adjusts the MATRIX to conform to the (hopefully changed) current LTM.
 		/**
 		The new MATRIX is calculated like this:
@@ -271,12 +292,27 @@ namespace milk
 
 		CMatrix4f m_ltm;
 		bool m_dirty; // does the ltm need to be updated?
+		bool m_interpolated;
 
 		LinkMode m_linkMode;
 		std::set<ISceneNode*> m_linkNodes;
 
 	private:
+		class CInterpolation
+		{
+		public:
+			CInterpolation(ISceneNode *pNode, const CMatrix4f& matrix)
+				: m_pNode(pNode), m_previous(matrix), m_current(matrix)
+			{ }
+
+			ISceneNode *m_pNode;
+			CMatrix4f m_previous;
+			CMatrix4f m_current;
+		};
+
 		static size_t ms_nodeCount;
+		static std::vector<CInterpolation> ms_interpolated;
+		static bool ms_interpolating;
 	};
 }
 
@@ -0,0 +1,117 @@
+#ifndef MILK_SPSCQUEUE_H_
+#define MILK_SPSCQUEUE_H_
+
+#include <vector>
+#include <algorithm>
+#include "milk/boost.h"
+
+#ifdef _MSC_VER
+extern "C" void _ReadWriteBarrier();
+#pragma intrinsic(_ReadWriteBarrier)
+#endif
+
+namespace milk
+{
+	namespace detail
+	{
+		// Read an index written by the other thread, before reading what it guards
+		inline size_t loadAcquire(const volatile size_t& index)
+		{
+			size_t value = index;
+#ifdef _MSC_VER
+			// x86 doesn't reorder loads, only the compiler must not
+			_ReadWriteBarrier();
+#else
+			__sync_synchronize();
+#endif
+			return value;
+		}
+
+		// Write an index read by the other thread, after writing what it guards
+		inline void storeRelease(volatile size_t& index, size_t value)
+		{
+#ifdef _MSC_VER
+			_ReadWriteBarrier();
+#else
+			__sync_synchronize();
+#endif
+			index = value;
+		}
+	}
+
+	/// Bounded queue for one producer thread and one consumer thread, without locks
+	/**
+		The producer only writes the write index and the consumer only the
+		read index, so push() and pop() can run at the same time without a
+		mutex. The capacity is rounded up to a power of two.
+
+		Elements are exchanged with swap(), not copied, so an element that
+		has been popped is given back on a later push and buffers inside
+		it, like the data of a CPacket, are reused instead of allocated.
+	*/
+	template<class T>
+	class CSPSCQueue
+	{
+	public:
+		explicit CSPSCQueue(size_t capacity)
+			: m_read(0), m_write(0)
+		{
+			size_t size = 1;
+			while(size < capacity)
+				size <<= 1;
+			m_elements.resize(size);
+			m_mask = size - 1;
+		}
+
+		/// Producer only, swap value into the queue, false if it's full
+		/** value is left with an element popped earlier */
+		bool push(T& value)
+		{
+			size_t write = m_write;
+			if(write - detail::loadAcquire(m_read) == m_elements.size())
+				return false;
+
+			using std::swap;
+			swap(m_elements[write & m_mask], value);
+			detail::storeRelease(m_write, write + 1);
+			return true;
+		}
+
+		/// Consumer only, swap the oldest element into value, false if it's empty
+		bool pop(T& value)
+		{
+			size_t read = m_read;
+			if(read == detail::loadAcquire(m_write))
+				return false;
+
+			using std::swap;
+			swap(m_elements[read & m_mask], value);
+			detail::storeRelease(m_read, read + 1);
+			return true;
+		}
+
+		/// Producer only, no room for another push
+		bool full() const
+		{ return m_write - detail::loadAcquire(m_read) == m_elements.size(); }
+
+		/// Consumer only, nothing to pop
+		bool empty() const
+		{ return m_read == detail::loadAcquire(m_write); }
+
+		size_t capacity() const
+		{ return m_elements.size(); }
+
+	private:
+		CSPSCQueue(const CSPSCQueue&);
+		CSPSCQueue& operator=(const CSPSCQueue&);
+
+		std::vector<T> m_elements;
+		size_t m_mask;
+		volatile size_t m_read;
+		// Keep the indices on different cache lines, each is written by one thread
+		char m_padding[64];
+		volatile size_t m_write;
+	};
+}
+
+#endif
@@ -8,6 +8,9 @@
 
 namespace milk
 {
+	/// Seconds from a monotonic high resolution clock, the start is unspecified
+	double highResolutionTime();
+
 	/// class for timing stuff
 	class CTimer
 	{
@@ -56,7 +59,7 @@ namespace milk
 
 	private:
 		double getTime() const
-		{ return (double)SDL_GetTicks() / 1000.0; }
+		{ return highResolutionTime(); }
 
 		double	m_sum;
 		double	m_start;
@@ -77,11 +80,20 @@ namespace milk
 		{ return m_fps; }
 
 		static double fps()
-		{ return 1.0/frametime(); }
+		{ return 1.0/loopTime(); }
 
+		/// Time to advance the simulation, the fixed step if there is one
 		static double frametime()
+		{ return m_fixedStep > 0.0 ? m_fixedStep : loopTime(); }
+
+		/// Real time of the last main loop
+		static double loopTime()
 		{ return m_avgTime[m_avgPos % m_steps]; }
 
+		/// Fixed simulation step in seconds, see IWindow::setFixedStep()
+		static double fixedStep()
+		{ return m_fixedStep; }
+
 		static void update()
 		{
 			++m_avgPos;
@@ -95,6 +107,7 @@ namespace milk
 		static double	m_fps;
 		static CTimer*	m_pTimer;
 		static int		m_steps;
+		static double	m_fixedStep;
 
 		// Prevent construction
 		Timer() { }
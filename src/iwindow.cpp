@@ -7,6 +7,7 @@
 #include "milk/timer.h"
 #include "milk/error.h"
 #include "milk/helper.h"
+#include "milk/scenegraph/iscenenode.h"
 #include <algorithm>
 
 using namespace milk;
@@ -21,7 +22,8 @@ IWindow::IWindow(IApplication& owner, const string& title, int width, int height
 	: IRenderTarget(width, height),
 	m_owner(owner), m_depth(depth), m_zDepth(zDepth),
 	m_sDepth(sDepth), m_fullscreen(flags & FULLSCREEN),
-	m_isRendering(0), m_frame(0)
+	m_isRendering(0), m_frame(0),
+	m_fixedStep(0.0), m_accumulator(0.0), m_interpolation(0.0), m_maxSteps(8)
 {
 	BOOST_ASSERT(ms_instance == 0);
 	ms_instance = this;
@@ -188,7 +190,8 @@ void IWindow::update()
 	if(m_owner.m_parts & IApplication::RENDERER)
 		Renderer::checkForErrors();
 
-	if(m_owner.m_parts & IApplication::TIMER)
+	// With a fixed step run() updates the timer once per loop instead
+	if((m_owner.m_parts & IApplication::TIMER) && m_fixedStep <= 0.0)
 		Timer::update();
 	if(m_owner.m_parts & IApplication::INPUT)
 		Input::update();
@@ -198,16 +201,52 @@ void IWindow::update()
 		Renderer::update();
 }
 
+void IWindow::setFixedStep(double step, int maxSteps)
+{
+	if(step > 0.0 && !(m_owner.m_parts & IApplication::TIMER))
+		throw error::milk("IWindow::setFixedStep - Error, the timer is needed for fixed steps");
+
+	m_fixedStep = max(step, 0.0);
+	m_maxSteps = max(maxSteps, 1);
+	m_accumulator = 0.0;
+	m_interpolation = 0.0;
+	Timer::m_fixedStep = m_fixedStep;
+}
+
 void IWindow::run()
 {
 	// Main loop
 	while(!m_owner.quitState())
 	{
-		update();
+		if(m_fixedStep > 0.0)
+		{
+			Timer::update();
+			m_accumulator += min(Timer::loopTime(), m_fixedStep * m_maxSteps);
+			while(m_accumulator >= m_fixedStep && !m_owner.quitState())
+			{
+				ISceneNode::storeTransforms();
+				update();
+				m_accumulator -= m_fixedStep;
+			}
+			m_interpolation = m_accumulator / m_fixedStep;
+		}
+		else
+			update();
 
 		if(beginRender())
 		{
-			render();
+			if(m_fixedStep > 0.0)
+				ISceneNode::beginInterpolation(float(m_interpolation));
+			try
+			{
+				render();
+			}
+			catch(...)
+			{
+				ISceneNode::endInterpolation();
+				throw;
+			}
+			ISceneNode::endInterpolation();
 			endRender();
 		}
 
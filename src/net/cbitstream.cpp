@@ -0,0 +1,194 @@
+#include "milk/net/cbitstream.h"
+#include "milk/math/cquaternion.h"
+#include "milk/math/math.h"
+#include <cstring>
+#include <algorithm>
+using namespace milk;
+
+namespace
+{
+	// largest value of the other components of a normalized quaternion
+	const float QUATERNION_RANGE = 0.70710678f;
+
+	uint quantize(float value, float min, float max, int bits)
+	{
+		BOOST_ASSERT(bits > 0 && bits <= 32 && min < max);
+		double steps = double(0xffffffffu >> (32-bits));
+		double t = (double(math::clamp(value, min, max)) - min) / (double(max) - min);
+		return static_cast<uint>(t * steps + 0.5);
+	}
+
+	float dequantize(uint value, float min, float max, int bits)
+	{
+		double steps = double(0xffffffffu >> (32-bits));
+		return static_cast<float>(min + (double(max) - min) * (value / steps));
+	}
+}
+
+void CBitWriter::writeBits(uint value, int bits)
+{
+	BOOST_ASSERT(bits >= 0 && bits <= 32);
+
+	// at most 16 bits at a time, so the scratch can't overflow
+	if (bits > 16)
+	{
+		writeBits(value & 0xffff, 16);
+		value >>= 16;
+		bits -= 16;
+	}
+
+	value &= (1u << bits) - 1;
+	m_scratch |= value << m_scratchBits;
+	m_scratchBits += bits;
+	m_bitsWritten += bits;
+
+	while (m_scratchBits >= 8)
+	{
+		m_packet << static_cast<uchar>(m_scratch & 0xff);
+		m_scratch >>= 8;
+		m_scratchBits -= 8;
+	}
+}
+
+void CBitWriter::writeVarint(uint value)
+{
+	for (; value >= 0x80; value >>= 7)
+		writeBits((value & 0x7f) | 0x80, 8);
+	writeBits(value, 8);
+}
+
+void CBitWriter::writeFloat(float value)
+{
+	uint bits;
+	memcpy(&bits, &value, sizeof(bits));
+	writeBits(bits, 32);
+}
+
+void CBitWriter::writeQuantized(float value, float min, float max, int bits)
+{
+	writeBits(quantize(value, min, max, bits), bits);
+}
+
+void CBitWriter::writeUnitVector(const CVector3f& v, int bits)
+{
+	// project onto the octahedron |x|+|y|+|z| = 1 and fold the lower half over the upper
+	float l1 = math::abs(v.x) + math::abs(v.y) + math::abs(v.z);
+	float x = l1 > 0.0f ? v.x / l1 : 0.0f;
+	float y = l1 > 0.0f ? v.y / l1 : 0.0f;
+	if (v.z < 0.0f)
+	{
+		float fx = (1.0f - math::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float fy = (1.0f - math::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	writeQuantized(x, -1.0f, 1.0f, bits);
+	writeQuantized(y, -1.0f, 1.0f, bits);
+}
+
+void CBitWriter::writeQuaternion(const CQuaternion<float>& q, int bits)
+{
+	int largest = 0;
+	for (int i = 1; i < 4; ++i)
+		if (math::abs(q[i]) > math::abs(q[largest]))
+			largest = i;
+
+	// q and -q are the same rotation, so the largest is made positive and left out
+	float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+	writeBits(largest, 2);
+	for (int i = 0; i < 4; ++i)
+		if (i != largest)
+			writeQuantized(q[i] * sign, -QUATERNION_RANGE, QUATERNION_RANGE, bits);
+}
+
+void CBitWriter::flush()
+{
+	if (m_scratchBits > 0)
+	{
+		m_packet << static_cast<uchar>(m_scratch & 0xff);
+		m_scratch = 0;
+		m_scratchBits = 0;
+	}
+}
+
+/////////////////////////////////////////////
+
+uint CBitReader::readBits(int bits)
+{
+	BOOST_ASSERT(bits >= 0 && bits <= 32);
+
+	if (bits > 16)
+	{
+		uint low = readBits(16);
+		return low | (readBits(bits-16) << 16);
+	}
+
+	while (m_scratchBits < bits)
+	{
+		uchar byte;
+		m_packet >> byte;
+		m_scratch |= uint(byte) << m_scratchBits;
+		m_scratchBits += 8;
+	}
+
+	uint value = m_scratch & ((1u << bits) - 1);
+	m_scratch >>= bits;
+	m_scratchBits -= bits;
+	return value;
+}
+
+uint CBitReader::readVarint()
+{
+	uint value = 0;
+	for (int shift = 0; shift < 35; shift += 7)
+	{
+		uint byte = readBits(8);
+		value |= (byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	throw error::net_corrupt_packet("Malformed varint");
+}
+
+float CBitReader::readFloat()
+{
+	uint bits = readBits(32);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+float CBitReader::readQuantized(float min, float max, int bits)
+{
+	return dequantize(readBits(bits), min, max, bits);
+}
+
+CVector3f CBitReader::readUnitVector(int bits)
+{
+	float x = readQuantized(-1.0f, 1.0f, bits);
+	float y = readQuantized(-1.0f, 1.0f, bits);
+
+	// unfold the lower half of the octahedron
+	CVector3f v(x, y, 1.0f - math::abs(x) - math::abs(y));
+	float t = std::max(-v.z, 0.0f);
+	v.x += v.x >= 0.0f ? -t : t;
+	v.y += v.y >= 0.0f ? -t : t;
+	return v.normalize();
+}
+
+CQuaternion<float> CBitReader::readQuaternion(int bits)
+{
+	int largest = static_cast<int>(readBits(2));
+
+	CQuaternion<float> q;
+	float sum = 0.0f;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (i == largest)
+			continue;
+		q[i] = readQuantized(-QUATERNION_RANGE, QUATERNION_RANGE, bits);
+		sum += q[i] * q[i];
+	}
+	q[largest] = math::sqrt(std::max(1.0f - sum, 0.0f));
+	return q;
+}
@@ -5,20 +5,39 @@ using namespace std;
 void IClient::send(const CPacket& packet)
 {
 	getSocket().send(packet);
-	addOut(packet.size()+sizeof(CPacket::SizeHeader_t));
+	addOut(packet.size()+CPacket::headerSize(getFraming(), packet.size()));
 }
 
 bool IClient::recv(CPacket& packet)
 {
-	m_socketSet.check();
-	if (m_socketSet.isSet(getSocket()) && getSocket().recv(packet))
+	return recv(packet, false);
+}
+
+bool IClient::recvView(CPacket& packet)
+{
+	return recv(packet, true);
+}
+
+bool IClient::recv(CPacket& packet, bool view)
+{
+	// packets received along with earlier ones don't make the socket ready
+	if (!getSocket().hasPacket())
+		m_socketSet.check();
+	if ((getSocket().hasPacket() || m_socketSet.isSet(getSocket())) &&
+		(view ? getSocket().recvView(packet) : getSocket().recv(packet)))
 	{
-		addIn(packet.size()+sizeof(CPacket::SizeHeader_t));
+		addIn(packet.size()+CPacket::headerSize(getFraming(), packet.size()));
 		return true;
 	}
 	return false;
 }
 
+void IClient::wait(int timeout)
+{
+	if (!getSocket().hasPacket())
+		m_socketSet.check(timeout);
+}
+
 string IClient::getRemoteIP() const
 {
 	return getSocket().getAddress().getIPAndPort();
@@ -68,9 +87,8 @@ void CClientTCP::disconnect()
 
 /////////////////////////////////////////////
 
-/*
 CClientUDP::CClientUDP()
-	: m_connected(false)
+	: m_connection(m_socket, CIP())
 { }
 
 CClientUDP::~CClientUDP()
@@ -78,36 +96,89 @@ CClientUDP::~CClientUDP()
 	disconnect();
 }
 
-void CClientUDP::connect(const CIP& ip, Uint16 listenPort)
+void CClientUDP::connect(const CIP& ip, int localPort)
 {
 	disconnect();
-	m_socket.open(listenPort);
-	m_socket.bind(ip);
-	m_connected = true;
+	m_socket.open(localPort);
+	m_connection.reset(ip);
+
+	// the first datagram is the connection request
+	m_connection.flush();
+}
+
+ConnectionStatus CClientUDP::status()
+{
+	if (!m_socket.open())
+		return DISCONNECTED;
+
+	pump();
+	if (m_connection.disconnected())
+		return DISCONNECTED;
+	if (m_connection.connected())
+		return CONNECTED;
+
+	m_connection.flush();
+	return PENDING;
 }
 
 void CClientUDP::disconnect()
 {
-	if (connected())
+	if (m_socket.open())
 	{
-		m_socket.unbind();
+		m_connection.disconnect();
+		m_connection.reset(m_connection.getAddress());
 		m_socket.close();
-		m_connected = false;
 	}
 }
 
-bool CClientUDP::connected() const
+bool CClientUDP::recv(CPacket& packet)
 {
-	return m_connected;
+	if (!m_socket.open())
+		return false;
+
+	pump();
+	if (m_connection.disconnected())
+		throw error::net_disconnect("Disconnected");
+	return IClient::recv(packet, false);
 }
 
+bool CClientUDP::recvView(CPacket& packet)
+{
+	if (!m_socket.open())
+		return false;
+
+	pump();
+	if (m_connection.disconnected())
+		throw error::net_disconnect("Disconnected");
+	return IClient::recv(packet, true);
+}
 
-bool CClientUDP::recv(CPacket& packet)
+void CClientUDP::sendUnreliable(const CPacket& packet)
 {
-	if (m_connected)
-		return IClient::recv(packet);
+	m_connection.sendUnreliable(packet);
+	addOut(packet.size()+CPacket::headerSize(getFraming(), packet.size()));
+}
+
+void CClientUDP::wait(int timeout)
+{
+	if (m_socket.open())
+		m_socket.wait(timeout);
 	else
-		return false;
+		IClient::wait(timeout);
 }
 
-*/
+void CClientUDP::pump()
+{
+	uchar buffer[CConnectionUDP::MAX_DATAGRAM_SIZE];
+	CIP ip;
+	uint n;
+	while ((n = m_socket.recvFrom(ip, buffer, sizeof(buffer))) != 0)
+	{
+		// only datagrams from the host
+		const CIP& host = m_connection.getAddress();
+		if (ip.getIP() != host.getIP() || ip.getPort() != host.getPort() ||
+			!CConnectionUDP::isDatagram(buffer, n))
+			continue;
+		m_connection.deliver(buffer, n);
+	}
+}
@@ -0,0 +1,278 @@
+#include "milk/net/cnetthread.h"
+#include "milk/net/host.h"
+#include "milk/net/client.h"
+#include "milk/error.h"
+using namespace milk;
+using namespace std;
+
+#ifdef _MSC_VER
+#pragma warning(disable: 4355)
+#endif
+
+CNetThread::CNetThread(IHost& host, int firstId, size_t queueSize)
+	: m_pHost(&host), m_pClient(0), m_nextId(firstId), m_waitTime(1), m_connected(false), m_done(false),
+	m_in(queueSize), m_out(queueSize), m_stop(0),
+	m_thread(function_member(*this, &CNetThread::run))
+{
+}
+
+CNetThread::CNetThread(IClient& client, size_t queueSize)
+	: m_pHost(0), m_pClient(&client), m_nextId(0), m_waitTime(1), m_connected(false), m_done(false),
+	m_in(queueSize), m_out(queueSize), m_stop(0),
+	m_thread(function_member(*this, &CNetThread::run))
+{
+}
+
+#ifdef _MSC_VER
+#pragma warning(default: 4355)
+#endif
+
+CNetThread::~CNetThread()
+{
+	stop();
+}
+
+void CNetThread::start()
+{
+	if (m_thread.running())
+		return;
+
+	// the sends of a round are flushed together
+	if (m_pHost)
+		m_pHost->setAutoFlush(false);
+	else
+		m_pClient->setAutoFlush(false);
+
+	m_stop = 0;
+	m_thread.start();
+}
+
+void CNetThread::stop()
+{
+	if (!m_thread.running())
+		return;
+
+	detail::storeRelease(m_stop, 1);
+	m_thread.wait();
+}
+
+bool CNetThread::running() const
+{
+	return m_thread.running();
+}
+
+bool CNetThread::send(int id, const CPacket& packet)
+{
+	return push(CNetMessage::PACKET, id, &packet);
+}
+
+bool CNetThread::sendAll(const CPacket& packet)
+{
+	BOOST_ASSERT(m_pHost);
+	return push(CNetMessage::PACKET_ALL, 0, &packet);
+}
+
+bool CNetThread::removeClient(int id)
+{
+	BOOST_ASSERT(m_pHost);
+	return push(CNetMessage::REMOVE, id, 0);
+}
+
+bool CNetThread::push(CNetMessage::Type type, int id, const CPacket *pPacket)
+{
+	if (m_out.full())
+		return false;
+
+	m_gameMessage.m_type = type;
+	m_gameMessage.m_id = id;
+	CPacket& packet = m_gameMessage.m_packet;
+	if (pPacket)
+	{
+		// into the buffer of an old message, a view is copied too
+		packet.resize(pPacket->size());
+		if (pPacket->size() != 0)
+			memcpy(packet.getDataPtr(), pPacket->getDataPtr(), pPacket->size());
+	}
+	else
+		packet.clear();
+
+	return m_out.push(m_gameMessage);
+}
+
+bool CNetThread::recv(CNetMessage& message)
+{
+	return m_in.pop(message);
+}
+
+void CNetThread::run()
+{
+	while (!detail::loadAcquire(m_stop))
+	{
+		/*	the client being served, so an exception
+			can be put on the right one */
+		int id = -1;
+		try
+		{
+			update(id);
+		}
+		catch (error::net&)
+		{
+			disconnected(id);
+		}
+	}
+}
+
+void CNetThread::update(int& id)
+{
+	// what didn't fit earlier goes first, to keep the order
+	while (!m_backlog.empty() && m_in.push(m_backlog.front()))
+		m_backlog.pop_front();
+
+	if (m_done)
+	{
+		// a client thread whose connection has ended
+		m_out.pop(m_threadMessage);
+		m_pClient->wait(m_waitTime);
+		return;
+	}
+
+	if (m_pClient && !m_connected)
+	{
+		ConnectionStatus status = m_pClient->status();
+		if (status == PENDING)
+		{
+			m_pClient->wait(m_waitTime);
+			return;
+		}
+		if (status == DISCONNECTED)
+		{
+			post(CNetMessage::DISCONNECTED, 0);
+			m_done = true;
+			return;
+		}
+		m_connected = true;
+		post(CNetMessage::CONNECTED, 0);
+	}
+
+	sendQueued(id);
+
+	if (m_pHost)
+	{
+		id = -1;
+		while (m_pHost->listen(m_nextId))
+			post(CNetMessage::CONNECTED, m_nextId++);
+	}
+
+	receive(id);
+
+	if (m_pHost)
+		m_pHost->flush(&id);
+	else
+		m_pClient->flush();
+
+	/*	no waiting while the game thread has queued more, but a full
+		queue to the game thread is waited out like an idle network,
+		it's drained once per frame at most */
+	if (m_out.empty())
+	{
+		if (m_pHost)
+			m_pHost->wait(m_waitTime);
+		else
+			m_pClient->wait(m_waitTime);
+	}
+}
+
+void CNetThread::sendQueued(int& id)
+{
+	CNetMessage& message = m_threadMessage;
+	while (m_out.pop(message))
+	{
+		id = message.m_id;
+		if (!m_pHost)
+		{
+			m_pClient->send(message.m_packet);
+			continue;
+		}
+
+		switch (message.m_type)
+		{
+		case CNetMessage::PACKET:
+			// the client may have been removed since it was queued
+			if (m_pHost->hasClient(id))
+				m_pHost->send(id, message.m_packet);
+			break;
+		case CNetMessage::PACKET_ALL:
+			m_pHost->sendAll(message.m_packet);
+			break;
+		case CNetMessage::REMOVE:
+			if (m_pHost->hasClient(id))
+				m_pHost->removeClient(id);
+			break;
+		default:
+			BOOST_ASSERT(false);
+		}
+	}
+}
+
+void CNetThread::receive(int& id)
+{
+	CNetMessage& message = m_threadMessage;
+	message.m_type = CNetMessage::PACKET;
+	while (m_backlog.empty() && !m_in.full())
+	{
+		if (m_pHost)
+		{
+			if (!m_pHost->recv(message.m_packet, &id))
+				return;
+			message.m_id = id;
+		}
+		else
+		{
+			if (!m_pClient->recv(message.m_packet))
+				return;
+			message.m_id = 0;
+		}
+
+		m_in.push(message);
+		message.m_type = CNetMessage::PACKET;
+	}
+}
+
+void CNetThread::post(CNetMessage::Type type, int id)
+{
+	CNetMessage& message = m_threadMessage;
+	message.m_type = type;
+	message.m_id = id;
+	message.m_packet.clear();
+
+	if (!m_backlog.empty() || !m_in.push(message))
+	{
+		m_backlog.push_back(CNetMessage());
+		m_backlog.back().swap(message);
+	}
+}
+
+void CNetThread::disconnected(int id)
+{
+	if (m_pClient)
+	{
+		m_pClient->disconnect();
+		post(CNetMessage::DISCONNECTED, 0);
+		m_done = true;
+		return;
+	}
+
+	// a failure that isn't any client's, like a failed accept
+	if (id == -1 || !m_pHost->hasClient(id))
+		return;
+
+	try
+	{
+		m_pHost->removeClient(id);
+	}
+	catch (error::net&)
+	{
+		// nothing more can be done about it
+	}
+	post(CNetMessage::DISCONNECTED, id);
+}
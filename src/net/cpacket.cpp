@@ -7,17 +7,103 @@ using namespace std;
 
 void CPacket::clear()
 {
+	m_pView = 0;
+	m_viewSize = 0;
 	resize(0);
 	setReadPos(0);
 }
 
+void CPacket::swap(CPacket& packet)
+{
+	m_data.swap(packet.m_data);
+	std::swap(m_readpos, packet.m_readpos);
+	std::swap(m_pView, packet.m_pView);
+	std::swap(m_viewSize, packet.m_viewSize);
+}
+
+void CPacket::view(const uchar *data, size_t size)
+{
+	m_data.resize(MAX_HEADER_SIZE);
+	m_pView = data;
+	m_viewSize = size;
+	m_readpos = 0;
+}
+
+void CPacket::detach_private() const
+{
+	const uchar *data = m_pView;
+	m_pView = 0;
+	m_data.resize(m_viewSize+MAX_HEADER_SIZE);
+	memcpy(&m_data[0]+MAX_HEADER_SIZE, data, m_viewSize);
+	m_viewSize = 0;
+}
+
 void CPacket::putSizeFront() const
 {
-	if (size() > numeric_limits<SizeHeader_t>::max())
+	putSizeFront(FRAMING_SHORT);
+}
+
+size_t CPacket::putSizeFront(Framing framing) const
+{
+	// the size goes in front of the data, which a view doesn't own
+	detach();
+
+	size_t header = headerSize(framing, size());
+	uchar *p = &m_data[0] + MAX_HEADER_SIZE - header;
+	if (framing == FRAMING_SHORT)
+	{
+		SizeHeader_t s = static_cast<SizeHeader_t>(size());
+		memcpy(p, &s, sizeof(s));
+	}
+	else
+	{
+		size_t s = size();
+		for (; s >= 0x80; s >>= 7)
+			*p++ = static_cast<uchar>(s | 0x80);
+		*p = static_cast<uchar>(s);
+	}
+	return header;
+}
+
+size_t CPacket::headerSize(Framing framing, size_t size)
+{
+	if (framing == FRAMING_SHORT)
+	{
+		if (size > numeric_limits<SizeHeader_t>::max())
+			throw error::net_corrupt_packet("Too large packet!");
+		return sizeof(SizeHeader_t);
+	}
+
+	if (size > numeric_limits<Uint32>::max())
 		throw error::net_corrupt_packet("Too large packet!");
+	size_t header = 1;
+	for (; size >= 0x80; size >>= 7)
+		++header;
+	return header;
+}
 
-	SizeHeader_t s = static_cast<SizeHeader_t>(size());
-	memcpy(&m_data[0], &s, sizeof(s));
+size_t CPacket::readSizeHeader(Framing framing, const uchar *data, size_t available, size_t& size)
+{
+	if (framing == FRAMING_SHORT)
+	{
+		if (available < sizeof(SizeHeader_t))
+			return 0;
+		SizeHeader_t s;
+		memcpy(&s, data, sizeof(s));
+		size = s;
+		return sizeof(SizeHeader_t);
+	}
+
+	size = 0;
+	for (size_t i = 0; i < MAX_HEADER_SIZE; ++i)
+	{
+		if (i == available)
+			return 0;
+		size |= size_t(data[i] & 0x7f) << (7*i);
+		if (!(data[i] & 0x80))
+			return i+1;
+	}
+	throw error::net_corrupt_packet("Malformed packet size");
 }
 
 void CPacket::write(const void *data, size_t nbytes)
@@ -0,0 +1,92 @@
+#include "milk/net/cpacketpool.h"
+#include <new>
+using namespace milk;
+
+CPacketPool::CSizeClass CPacketPool::ms_classes[CPacketPool::NUM_CLASSES];
+size_t CPacketPool::ms_maxFree = 256;
+
+int CPacketPool::sizeClass(size_t nbytes)
+{
+	int c = 0;
+	for (size_t size = MIN_SIZE; size < nbytes && c < NUM_CLASSES; size <<= 1)
+		++c;
+	return c;
+}
+
+void* CPacketPool::allocate(size_t nbytes)
+{
+	int c = sizeClass(nbytes);
+	if (c == NUM_CLASSES)
+		return ::operator new(nbytes);
+
+	CSizeClass& pool = ms_classes[c];
+	{
+		CMutexLock lock(pool.m_mutex);
+		if (CFreeBuffer *pBuffer = pool.m_pFree)
+		{
+			pool.m_pFree = pBuffer->m_pNext;
+			--pool.m_numFree;
+			return pBuffer;
+		}
+	}
+	return ::operator new(size_t(MIN_SIZE) << c);
+}
+
+void CPacketPool::deallocate(void *p, size_t nbytes)
+{
+	if (!p)
+		return;
+
+	int c = sizeClass(nbytes);
+	if (c != NUM_CLASSES)
+	{
+		CSizeClass& pool = ms_classes[c];
+		CMutexLock lock(pool.m_mutex);
+		if (pool.m_numFree < ms_maxFree)
+		{
+			CFreeBuffer *pBuffer = static_cast<CFreeBuffer*>(p);
+			pBuffer->m_pNext = pool.m_pFree;
+			pool.m_pFree = pBuffer;
+			++pool.m_numFree;
+			return;
+		}
+	}
+	::operator delete(p);
+}
+
+void CPacketPool::setMaxFree(size_t maxFree)
+{
+	ms_maxFree = maxFree;
+}
+
+size_t CPacketPool::numFree()
+{
+	size_t n = 0;
+	for (int c = 0; c < NUM_CLASSES; ++c)
+	{
+		CMutexLock lock(ms_classes[c].m_mutex);
+		n += ms_classes[c].m_numFree;
+	}
+	return n;
+}
+
+void CPacketPool::clear()
+{
+	for (int c = 0; c < NUM_CLASSES; ++c)
+	{
+		CSizeClass& pool = ms_classes[c];
+		CFreeBuffer *pBuffer;
+		{
+			CMutexLock lock(pool.m_mutex);
+			pBuffer = pool.m_pFree;
+			pool.m_pFree = 0;
+			pool.m_numFree = 0;
+		}
+		while (pBuffer)
+		{
+			CFreeBuffer *pNext = pBuffer->m_pNext;
+			::operator delete(pBuffer);
+			pBuffer = pNext;
+		}
+	}
+}
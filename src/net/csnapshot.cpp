@@ -0,0 +1,317 @@
+#include "milk/net/csnapshot.h"
+#include "milk/net/cbitstream.h"
+#include "milk/error.h"
+#include <cstring>
+#include <algorithm>
+using namespace milk;
+using namespace std;
+
+namespace
+{
+	enum Change
+	{
+		REMOVED,
+		ADDED,
+		CHANGED
+	};
+
+	void writeState(CBitWriter& bits, const CSnapshot::state& s)
+	{
+		bits.writeVarint(static_cast<uint>(s.size()));
+		for (size_t i = 0; i < s.size(); ++i)
+			bits.writeBits(s[i], 8);
+	}
+
+	void readState(CBitReader& bits, CSnapshot::state& s)
+	{
+		// checked before allocating, the size comes from the network
+		uint size = bits.readVarint();
+		if (size > bits.bitsLeft()/8)
+			throw error::net_corrupt_packet("Snapshot state larger than the packet");
+		s.resize(size);
+		for (size_t i = 0; i < size; ++i)
+			s[i] = static_cast<uchar>(bits.readBits(8));
+	}
+
+	// a bit per byte, followed by the new value of changed bytes
+	void writeDelta(CBitWriter& bits, const CSnapshot::state& from, const CSnapshot::state& to)
+	{
+		BOOST_ASSERT(from.size() == to.size());
+		for (size_t i = 0; i < to.size(); ++i)
+		{
+			bool changed = from[i] != to[i];
+			bits.writeBool(changed);
+			if (changed)
+				bits.writeBits(to[i], 8);
+		}
+	}
+
+	void readDelta(CBitReader& bits, CSnapshot::state& s)
+	{
+		for (size_t i = 0; i < s.size(); ++i)
+			if (bits.readBool())
+				s[i] = static_cast<uchar>(bits.readBits(8));
+	}
+
+	void writeEntity(CBitWriter& bits, uint& lastId, uint id, Change change)
+	{
+		bits.writeBool(true);
+		bits.writeVarint(id - lastId);
+		bits.writeBits(change, 2);
+		lastId = id;
+	}
+
+	/*	sequence, baseline and then the entities that differ, in id order
+		with the id as the difference from the previous one */
+	void encodeSnapshot(const CSnapshot *pBase, const CSnapshot& snapshot, uint baseline, CPacket& packet)
+	{
+		static const CSnapshot::entityMap empty;
+		const CSnapshot::entityMap& from = pBase ? pBase->getEntities() : empty;
+		const CSnapshot::entityMap& to = snapshot.getEntities();
+
+		CBitWriter bits(packet);
+		bits.writeVarint(snapshot.getSequence());
+		bits.writeVarint(baseline);
+
+		uint lastId = 0;
+		CSnapshot::entityMap::const_iterator f = from.begin(), t = to.begin();
+		while (f != from.end() || t != to.end())
+		{
+			if (t == to.end() || (f != from.end() && f->first < t->first))
+			{
+				writeEntity(bits, lastId, f->first, REMOVED);
+				++f;
+			}
+			else if (f == from.end() || t->first < f->first)
+			{
+				writeEntity(bits, lastId, t->first, ADDED);
+				writeState(bits, t->second);
+				++t;
+			}
+			else
+			{
+				const CSnapshot::state& a = f->second;
+				const CSnapshot::state& b = t->second;
+				if (a.size() != b.size())
+				{
+					writeEntity(bits, lastId, t->first, ADDED);
+					writeState(bits, b);
+				}
+				else if (a.size() && memcmp(&a[0], &b[0], a.size()) != 0)
+				{
+					writeEntity(bits, lastId, t->first, CHANGED);
+					writeDelta(bits, a, b);
+				}
+				++f;
+				++t;
+			}
+		}
+		bits.writeBool(false);
+	}
+}
+
+void CSnapshot::set(uint id, const void *data, size_t size)
+{
+	state& s = m_entities[id];
+	s.resize(size);
+	if (size)
+		memcpy(&s[0], data, size);
+}
+
+const CSnapshot::state* CSnapshot::get(uint id) const
+{
+	entityMap::const_iterator it = m_entities.find(id);
+	return it == m_entities.end() ? 0 : &it->second;
+}
+
+void CSnapshot::swap(CSnapshot& snapshot)
+{
+	std::swap(m_sequence, snapshot.m_sequence);
+	m_entities.swap(snapshot.m_entities);
+}
+
+/////////////////////////////////////////////
+
+CSnapshotServer::CSnapshotServer(size_t historySize)
+	: m_historySize(std::max(historySize, size_t(1)))
+{
+}
+
+uint CSnapshotServer::add(CSnapshot& snapshot)
+{
+	uint sequence = m_history.empty() ? 1 : m_history.back().m_sequence + 1;
+
+	if (m_history.size() == m_historySize)
+	{
+		// reuse the oldest
+		m_history.push_back(CSnapshot());
+		m_history.back().swap(m_history.front());
+		m_history.pop_front();
+	}
+	else
+		m_history.push_back(CSnapshot());
+
+	CSnapshot& latest = m_history.back();
+	latest.swap(snapshot);
+	latest.m_sequence = sequence;
+	snapshot.clear();
+	snapshot.m_sequence = 0;
+
+	m_encoded.clear();
+	return sequence;
+}
+
+const CSnapshot& CSnapshotServer::getLatest() const
+{
+	BOOST_ASSERT(!m_history.empty());
+	return m_history.back();
+}
+
+void CSnapshotServer::encode(int client, CPacket& packet) const
+{
+	BOOST_ASSERT(!m_history.empty());
+
+	// the baseline must still be kept, otherwise a full snapshot is sent
+	uint baseline = getAck(client);
+	const CSnapshot *pBase = find(baseline);
+	if (!pBase)
+		baseline = 0;
+
+	map<uint, CPacket>::iterator it = m_encoded.find(baseline);
+	if (it == m_encoded.end())
+	{
+		it = m_encoded.insert(make_pair(baseline, CPacket())).first;
+		encodeSnapshot(pBase, getLatest(), baseline, it->second);
+	}
+	packet.write(it->second.getDataPtr(), it->second.size());
+}
+
+void CSnapshotServer::ack(int client, uint sequence)
+{
+	// a snapshot that wasn't produced yet can't have been received
+	if (m_history.empty() || sequence > getLatest().getSequence())
+		return;
+
+	uint& acked = m_acks[client];
+	if (sequence > acked)
+		acked = sequence;
+}
+
+void CSnapshotServer::readAck(int client, const CPacket& packet)
+{
+	uint sequence;
+	{
+		CBitReader bits(packet);
+		sequence = bits.readVarint();
+	}
+	ack(client, sequence);
+}
+
+uint CSnapshotServer::getAck(int client) const
+{
+	map<int, uint>::const_iterator it = m_acks.find(client);
+	return it == m_acks.end() ? 0 : it->second;
+}
+
+void CSnapshotServer::removeClient(int client)
+{
+	m_acks.erase(client);
+}
+
+const CSnapshot* CSnapshotServer::find(uint sequence) const
+{
+	if (sequence == 0 || m_history.empty())
+		return 0;
+
+	// sequence numbers are consecutive
+	uint first = m_history.front().m_sequence;
+	if (sequence < first || sequence > m_history.back().m_sequence)
+		return 0;
+	return &m_history[sequence - first];
+}
+
+/////////////////////////////////////////////
+
+CSnapshotClient::CSnapshotClient(size_t historySize)
+	: m_historySize(std::max(historySize, size_t(1)))
+{
+}
+
+bool CSnapshotClient::decode(const CPacket& packet)
+{
+	CBitReader bits(packet);
+	uint sequence = bits.readVarint();
+	uint baseline = bits.readVarint();
+
+	if (sequence == 0 || (!m_history.empty() && sequence <= m_history.back().m_sequence))
+		return false;
+
+	// the sizes of changed entities are those of the baseline, so it's needed to read on
+	const CSnapshot *pBase = find(baseline);
+	if (baseline != 0 && !pBase)
+		return false;
+
+	CSnapshot snapshot;
+	if (pBase)
+		snapshot.m_entities = pBase->m_entities;
+	snapshot.m_sequence = sequence;
+
+	uint id = 0;
+	while (bits.readBool())
+	{
+		id += bits.readVarint();
+		Change change = static_cast<Change>(bits.readBits(2));
+		switch (change)
+		{
+		case REMOVED:
+			snapshot.m_entities.erase(id);
+			break;
+
+		case ADDED:
+			readState(bits, snapshot.m_entities[id]);
+			break;
+
+		case CHANGED:
+			{
+				CSnapshot::entityMap::iterator it = snapshot.m_entities.find(id);
+				if (it == snapshot.m_entities.end())
+					throw error::net_corrupt_packet("Snapshot delta of unknown entity");
+				readDelta(bits, it->second);
+			}
+			break;
+
+		default:
+			throw error::net_corrupt_packet("Malformed snapshot");
+		}
+	}
+
+	if (m_history.size() == m_historySize)
+		m_history.pop_front();
+	m_history.push_back(CSnapshot());
+	m_history.back().swap(snapshot);
+	return true;
+}
+
+const CSnapshot& CSnapshotClient::getLatest() const
+{
+	static const CSnapshot empty;
+	return m_history.empty() ? empty : m_history.back();
+}
+
+void CSnapshotClient::writeAck(CPacket& packet) const
+{
+	CBitWriter bits(packet);
+	bits.writeVarint(getLatest().getSequence());
+}
+
+const CSnapshot* CSnapshotClient::find(uint sequence) const
+{
+	if (sequence == 0)
+		return 0;
+
+	// received snapshots need not be consecutive
+	for (deque<CSnapshot>::const_reverse_iterator it = m_history.rbegin(); it != m_history.rend(); ++it)
+		if (it->m_sequence == sequence)
+			return &*it;
+	return 0;
+}
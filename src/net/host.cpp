@@ -1,46 +1,222 @@
 #include "milk/net/host.h"
 #include "milk/helper.h"
+#include <algorithm>
 using namespace milk;
 using namespace std;
 
 
 void IHost::send(int id, const CPacket& packet)
 {
-	BOOST_ASSERT(m_clients[id]);
-	m_clients[id]->send(packet);
-	addOut(packet.size()+sizeof(CPacket::SizeHeader_t));
+	ISocket *pSocket = getClientPriv(id)->second;
+	pSocket->send(packet);
+	queued(id, pSocket);
+	addOut(packet.size()+CPacket::headerSize(m_framing, packet.size()));
 }
 
-/*
-void IHost::sendAll(const CPacket& packet)
+void IHost::sendAll(const CPacket& packet, const vector<int>& exclude)
 {
+	ISocket::sharedBuffer pData = ISocket::framePacket(packet, m_framing);
+
+	vector<int> sorted(exclude);
+	sort(sorted.begin(), sorted.end());
+
+	size_t count = 0;
 	for (clientIterator it = m_clients.begin() ; it != m_clients.end() ; ++it)
-		it->second->send(packet);
-	addOut((packet.size()+sizeof(Uint32)) * m_clients.size());
+	{
+		if (binary_search(sorted.begin(), sorted.end(), it->first))
+			continue;
+		send(it, pData);
+		++count;
+	}
+	addOut(pData->size() * count);
 }
-*/
 
-bool IHost::recv(CPacket& packet, int *id)
+void IHost::send(const vector<int>& ids, const CPacket& packet)
 {
-	m_socketSet.check();
+	// look up every id first, so an unknown one doesn't leave a partial send
+	vector<clientIterator> clients;
+	clients.reserve(ids.size());
+	for (size_t i = 0 ; i < ids.size() ; ++i)
+		clients.push_back(getClientPriv(ids[i]));
+
+	ISocket::sharedBuffer pData = ISocket::framePacket(packet, m_framing);
+	for (size_t i = 0 ; i < clients.size() ; ++i)
+		send(clients[i], pData);
+	addOut(pData->size() * clients.size());
+}
 
-	for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
+void IHost::send(clientIterator client, const ISocket::sharedBuffer& pData)
+{
+	try
+	{
+		client->second->send(pData);
+	}
+	catch (error::net&)
+	{
+		// the other clients still get it, recv reports this one
+		m_failed.insert(client->first);
+		return;
+	}
+	queued(client->first, client->second);
+}
+
+void IHost::queued(int id, ISocket *pSocket)
+{
+	if (pSocket->queuedBytes() == 0)
+		return;
+	m_sending.insert(id);
+
+	// with auto flush the socket is full, so send the rest when it has room
+	if (m_autoFlush && m_socketSet.contains(*pSocket))
+		m_socketSet.watchWrite(*pSocket, true);
+}
+
+void IHost::flush(int *id)
+{
+	set<int>::iterator it = m_sending.begin();
+	while (it != m_sending.end())
 	{
-		if (m_socketSet.isSet(*it->second))
+		clientIterator client = m_clients.find(*it);
+		if (client != m_clients.end())
 		{
-			/*	set id first, since recv may throw an
-				exception on disconnect, for instance. */
 			if (id)
-				*id = it->first;
-			if (it->second->recv(packet))
+				*id = client->first;
+			ISocket *pSocket = client->second;
+			pSocket->flush();
+			bool full = pSocket->queuedBytes() != 0;
+			if (m_socketSet.contains(*pSocket))
+				m_socketSet.watchWrite(*pSocket, full);
+			if (full)
 			{
-				addIn(packet.size()+sizeof(CPacket::SizeHeader_t));
-				return true;
+				++it;
+				continue;
 			}
 		}
+		m_sending.erase(it++);
 	}
+}
 
-	return false;
+void IHost::flushWritable(int *id)
+{
+	// backwards, since a socket that is done is taken off the list
+	const vector<const ISocket*>& writable = m_socketSet.getWritable();
+	for (size_t i = writable.size() ; i-- != 0 ; )
+	{
+		socketIdMap::const_iterator it = m_ids.find(writable[i]);
+		BOOST_ASSERT(it != m_ids.end());
+
+		if (id)
+			*id = it->second;
+		ISocket *pSocket = m_clients[it->second];
+		pSocket->flush();
+		if (pSocket->queuedBytes() == 0)
+		{
+			m_sending.erase(it->second);
+			m_socketSet.watchWrite(*pSocket, false);
+		}
+	}
+}
+
+void IHost::setFraming(CPacket::Framing framing)
+{
+	m_framing = framing;
+	for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
+		it->second->setFraming(framing);
+}
+
+void IHost::setAutoFlush(bool autoFlush)
+{
+	m_autoFlush = autoFlush;
+	for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
+		it->second->setAutoFlush(autoFlush);
+}
+
+bool IHost::recv(CPacket& packet, int *id)
+{
+	return recv(packet, id, false);
+}
+
+bool IHost::recvView(CPacket& packet, int *id)
+{
+	return recv(packet, id, true);
+}
+
+void IHost::wait(int timeout)
+{
+	m_socketSet.check(timeout);
+}
+
+bool IHost::recv(ISocket *pSocket, CPacket& packet, bool view)
+{
+	return view ? pSocket->recvView(packet) : pSocket->recv(packet);
+}
+
+bool IHost::recv(CPacket& packet, int *id, bool view)
+{
+	// clients that failed while sending to many, one at a time
+	while (!m_failed.empty())
+	{
+		int failed = *m_failed.begin();
+		m_failed.erase(m_failed.begin());
+		if (!hasClient(failed))
+			continue;
+
+		if (id)
+			*id = failed;
+		throw error::net_disconnect("Disconnected");
+	}
+
+	// first the packets that were received along with earlier ones
+	while (!m_buffered.empty())
+	{
+		set<int>::iterator it = m_buffered.begin();
+		clientIterator client = m_clients.find(*it);
+		if (client == m_clients.end() || !client->second->hasPacket())
+		{
+			m_buffered.erase(it);
+			continue;
+		}
+
+		if (id)
+			*id = client->first;
+		recv(client->second, packet, view);
+		addIn(packet.size()+CPacket::headerSize(m_framing, packet.size()));
+		return true;
+	}
+
+	/*	only the ready sockets, not all clients. the ready list of a
+		check is used up over several calls before checking again */
+	const vector<const ISocket*>& ready = m_socketSet.getReady();
+	bool checked = false;
+	for (;;)
+	{
+		if (m_readyPos >= ready.size())
+		{
+			if (checked)
+				return false;
+			m_socketSet.check();
+			m_readyPos = 0;
+			checked = true;
+			flushWritable(id);
+			continue;
+		}
+
+		socketIdMap::const_iterator it = m_ids.find(ready[m_readyPos++]);
+		BOOST_ASSERT(it != m_ids.end());
+
+		/*	set id first, since recv may throw an
+			exception on disconnect, for instance. */
+		if (id)
+			*id = it->second;
+		ISocket *pSocket = m_clients[it->second];
+		if (recv(pSocket, packet, view))
+		{
+			if (pSocket->hasPacket())
+				m_buffered.insert(it->second);
+			addIn(packet.size()+CPacket::headerSize(m_framing, packet.size()));
+			return true;
+		}
+	}
 }
 
 string IHost::getLocalAddress()
@@ -107,6 +283,7 @@ IHost::clientIterator IHost::getClientPriv(int id)
 
 
 CHostTCP::CHostTCP()
+	: m_acceptSet(CSocketSet::SELECT)
 { }
 
 CHostTCP::~CHostTCP()
@@ -116,6 +293,7 @@ void CHostTCP::open(int port)
 {
 	close();
 	m_listenSocket.open(CIP(port));
+	m_acceptSet.add(m_listenSocket);
 }
 
 bool CHostTCP::open() const
@@ -128,6 +306,11 @@ void CHostTCP::close()
 	if (open())
 	{
 		m_socketSet.clear();
+		m_acceptSet.clear();
+		m_ids.clear();
+		m_buffered.clear();
+		m_sending.clear();
+		m_failed.clear();
 
 		m_listenSocket.close();
 		for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
@@ -139,29 +322,51 @@ void CHostTCP::close()
 
 void CHostTCP::addClient(CSocketTCP *sock, int id)
 {
-	m_clients[id] = sock;
+	BOOST_ASSERT(!hasClient(id));
+	sock->setAutoFlush(m_autoFlush);
+	sock->setFraming(m_framing);
 	m_socketSet.add(*sock);
+	m_clients[id] = sock;
+	m_ids[sock] = id;
 }
 
 bool CHostTCP::listen(int id)
 {
-	CSocketSet acceptSet;
-	acceptSet.add(m_listenSocket);
-	acceptSet.check();
-	if (acceptSet.isSet(m_listenSocket))
+	m_acceptSet.check();
+	if (m_acceptSet.isSet(m_listenSocket))
 	{
 		CSocketTCP *temp = new CSocketTCP();
-		m_listenSocket.accept(*temp);
-		addClient(temp, id);
+		try
+		{
+			m_listenSocket.accept(*temp);
+			addClient(temp, id);
+		}
+		catch(...)
+		{
+			delete temp;
+			throw;
+		}
 		return true;
 	}
 	return false;
 }
 
+void CHostTCP::wait(int timeout)
+{
+	if (m_clients.empty())
+		m_acceptSet.check(timeout);
+	else
+		IHost::wait(timeout);
+}
+
 void CHostTCP::removeClient(int id)
 {
 	clientIterator it = getClientPriv(id);
 	m_socketSet.remove(static_cast<CSocketTCP&>(*it->second));
+	m_ids.erase(it->second);
+	m_buffered.erase(id);
+	m_sending.erase(id);
+	m_failed.erase(id);
 	delete it->second;
 	m_clients.erase(it);
 }
@@ -173,39 +378,179 @@ const CSocketTCP& CHostTCP::getClient(int id) const
 
 ///////////////////////////////////////////////7
 
-/*
 CHostUDP::CHostUDP()
 { }
 
 CHostUDP::~CHostUDP()
-{ removeAllClients(); }
+{ close(); }
 
-void CHostUDP::addClient(const CIP& ip, Uint16 localPort, int id)
+void CHostUDP::open(int port)
 {
-	BOOST_ASSERT(!hasClient(id));
+	close();
+	m_socket.open(port);
+}
 
-	CSocketUDP *sock = new CSocketUDP();
-	sock->open(localPort);
-	sock->bind(ip);
-	m_clients[id] = sock;
+bool CHostUDP::open() const
+{
+	return m_socket.open();
+}
+
+void CHostUDP::close()
+{
+	if (open())
+	{
+		for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
+		{
+			static_cast<CConnectionUDP*>(it->second)->disconnect();
+			delete it->second;
+		}
+
+		m_clients.clear();
+		m_addresses.clear();
+		m_pending.clear();
+		m_buffered.clear();
+		m_sending.clear();
+		m_failed.clear();
+
+		m_socket.close();
+	}
+}
+
+bool CHostUDP::listen(int id)
+{
+	pump(0);
+
+	if (m_pending.empty())
+		return false;
+
+	BOOST_ASSERT(!hasClient(id));
+	CPending& pending = m_pending.begin()->second;
+	CConnectionUDP *pConnection = new CConnectionUDP(m_socket, pending.m_ip);
+	pConnection->setAutoFlush(m_autoFlush);
+	pConnection->setFraming(m_framing);
+	m_clients[id] = pConnection;
+	m_addresses[m_pending.begin()->first] = id;
+
+	vector<uchar> datagram;
+	datagram.swap(pending.m_datagram);
+	m_pending.erase(m_pending.begin());
+
+	pConnection->deliver(&datagram[0], static_cast<uint>(datagram.size()));
+	if (pConnection->hasPacket())
+		m_buffered.insert(id);
+
+	return true;
 }
 
 void CHostUDP::removeClient(int id)
 {
 	clientIterator it = getClientPriv(id);
-	delete it->second;
+	CConnectionUDP *pConnection = static_cast<CConnectionUDP*>(it->second);
+	if (!pConnection->disconnected())
+		pConnection->disconnect();
+
+	m_addresses.erase(getKey(pConnection->getAddress()));
+	m_buffered.erase(id);
+	m_sending.erase(id);
+	m_failed.erase(id);
+	delete pConnection;
 	m_clients.erase(it);
 }
 
-void CHostUDP::removeAllClients()
+const CConnectionUDP& CHostUDP::getClient(int id) const
 {
-	for (clientIterator it = m_clients.begin() ; it != m_clients.end() ; ++it)
-		delete it->second;
-	m_clients.clear();
+	return static_cast<const CConnectionUDP&>(IHost::getClient(id));
 }
 
-const CSocketUDP& CHostUDP::getClient(int id) const
+bool CHostUDP::recv(CPacket& packet, int *id)
 {
-	return static_cast<const CSocketUDP&>(IHost::getClient(id));
+	pump(id);
+	checkDisconnected(id);
+	return IHost::recv(packet, id, false);
+}
+
+bool CHostUDP::recvView(CPacket& packet, int *id)
+{
+	pump(id);
+	checkDisconnected(id);
+	return IHost::recv(packet, id, true);
+}
+
+void CHostUDP::flush(int *id)
+{
+	for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
+	{
+		if (id)
+			*id = it->first;
+		it->second->flush();
+	}
+}
+
+void CHostUDP::wait(int timeout)
+{
+	if (open())
+		m_socket.wait(timeout);
+	else
+		IHost::wait(timeout);
+}
+
+void CHostUDP::sendUnreliable(int id, const CPacket& packet)
+{
+	static_cast<CConnectionUDP*>(getClientPriv(id)->second)->sendUnreliable(packet);
+	addOut(packet.size()+CPacket::headerSize(m_framing, packet.size()));
+}
+
+void CHostUDP::pump(int *id)
+{
+	if (!open())
+		return;
+
+	uchar buffer[CConnectionUDP::MAX_DATAGRAM_SIZE];
+	CIP ip;
+	uint n;
+	while ((n = m_socket.recvFrom(ip, buffer, sizeof(buffer))) != 0)
+	{
+		if (!CConnectionUDP::isDatagram(buffer, n))
+			continue;
+
+		address key = getKey(ip);
+		map<address, int>::const_iterator it = m_addresses.find(key);
+		if (it == m_addresses.end())
+		{
+			// a removed client's late datagrams or disconnect aren't a new client
+			if (!CConnectionUDP::isConnectRequest(buffer, n))
+				continue;
+
+			// kept for listen, a flood of new addresses can't use up memory
+			if (m_pending.size() < MAX_PENDING || m_pending.count(key))
+			{
+				CPending& pending = m_pending[key];
+				pending.m_ip = ip;
+				pending.m_datagram.assign(buffer, buffer+n);
+			}
+			continue;
+		}
+
+		/*	set id first, since deliver may throw an
+			exception on a corrupt datagram, for instance. */
+		if (id)
+			*id = it->second;
+		ISocket *pSocket = m_clients[it->second];
+		static_cast<CConnectionUDP*>(pSocket)->deliver(buffer, n);
+		if (pSocket->hasPacket())
+			m_buffered.insert(it->second);
+	}
+}
+
+void CHostUDP::checkDisconnected(int *id)
+{
+	for (clientIterator it = m_clients.begin() ; it!=m_clients.end() ; ++it)
+	{
+		if (static_cast<CConnectionUDP*>(it->second)->disconnected())
+		{
+			if (id)
+				*id = it->first;
+			throw error::net_disconnect("Disconnected");
+		}
+	}
 }
-*/
@@ -3,6 +3,7 @@
 #include "milk/error.h"
 #include "milk/helper.h"
 #include <string>
+#include <algorithm>
 using namespace milk;
 using namespace std;
 
@@ -93,61 +94,238 @@ string CIP::getIPAndPort() const
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-CSocketSet::CSocketSet()
+CSocketSet::CSocketSet(Backend backend)
 {
-	clear();
+#ifdef MILK_EPOLL
+	m_epoll = -1;
+	if(backend == EPOLL)
+	{
+		// size is only a hint
+		m_epoll = epoll_create(64);
+	}
+#else
+	(void)backend;
+#endif
 }
 
 CSocketSet::~CSocketSet()
 {
-	//clear(); //should we clear?
+#ifdef MILK_EPOLL
+	if(m_epoll != -1)
+		::close(m_epoll);
+#endif
+}
+
+CSocketSet::Backend CSocketSet::getBackend() const
+{
+#ifdef MILK_EPOLL
+	if(m_epoll != -1)
+		return EPOLL;
+#endif
+	return SELECT;
 }
 
 void CSocketSet::check(int timeout)
 {
-	if(!m_set.empty())
+	m_ready.clear();
+	m_readySockets.clear();
+	m_writable.clear();
+	if(m_set.empty())
+	{
+		// nothing to wait for, but the timeout is still waited out
+		if(timeout > 0)
+		{
+#ifdef WIN32
+			Sleep(timeout);
+#else
+			timeval time;
+			time.tv_sec		= timeout/1000;
+			time.tv_usec	= (timeout%1000)*1000;
+			select(0, 0, 0, 0, &time);
+#endif
+		}
+		return;
+	}
+
+#ifdef MILK_EPOLL
+	if(m_epoll != -1)
 	{
-		FD_ZERO(&m_in);
-		for(set<int>::iterator it = m_set.begin(); it != m_set.end(); ++it)
+		m_events.resize(m_set.size());
+		int n = epoll_wait(m_epoll, &m_events[0], static_cast<int>(m_events.size()), timeout);
+		if (n == -1)
 		{
+			if (errno == EINTR)
+				return;
+			throw error::net("Call to epoll_wait failed"+Net::errorStr());
+		}
+
+		for(int i = 0; i < n; ++i)
+		{
+			const ISocket *pSocket = static_cast<const ISocket*>(m_events[i].data.ptr);
+			if(m_events[i].events & EPOLLOUT)
+				m_writable.push_back(pSocket);
+
+			// errors and hangups are reported to recv as well
+			if(m_events[i].events & ~EPOLLOUT)
+			{
+				m_ready.push_back(pSocket);
+				m_readySockets.push_back(pSocket->m_socket);
+			}
+		}
+		sort(m_readySockets.begin(), m_readySockets.end());
+		return;
+	}
+#endif
+
+	fd_set in;
+	FD_ZERO(&in);
+	for(socketMap::iterator it = m_set.begin(); it != m_set.end(); ++it)
+	{
 
 #ifdef _MSC_VER
 #pragma warning(disable: 4127)
 #endif
 
-			FD_SET(static_cast<uint>(*it), &m_in);
+		FD_SET(static_cast<uint>(it->first), &in);
 
 #ifdef _MSC_VER
 #pragma warning(default: 4127)
 #endif
 
-		}
+	}
+
+	fd_set out;
+	FD_ZERO(&out);
+	for(set<int>::iterator it = m_writers.begin(); it != m_writers.end(); ++it)
+	{
+
+#ifdef _MSC_VER
+#pragma warning(disable: 4127)
+#endif
+
+		FD_SET(static_cast<uint>(*it), &out);
+
+#ifdef _MSC_VER
+#pragma warning(default: 4127)
+#endif
+
+	}
 
-		timeval time;
-		time.tv_sec		= timeout/1000;
-		time.tv_usec	= (timeout%1000)*1000;
+	timeval time;
+	time.tv_sec		= timeout/1000;
+	time.tv_usec	= (timeout%1000)*1000;
 
-		//check in-streams
-		int max_socket_value = *max_element(m_set.begin(), m_set.end());
-		if (select(max_socket_value + 1, &m_in, 0, 0, &time) == -1)
-			throw error::net("Call to select failed"+Net::errorStr());
+	//check in-streams, the map is sorted so the last socket is the largest
+	int max_socket_value = m_set.rbegin()->first;
+	if (select(max_socket_value + 1, &in, m_writers.empty() ? 0 : &out, 0, &time) == -1)
+		throw error::net("Call to select failed"+Net::errorStr());
+
+	for(socketMap::iterator it = m_set.begin(); it != m_set.end(); ++it)
+	{
+		if (FD_ISSET(it->first, &in))
+		{
+			m_ready.push_back(it->second);
+			m_readySockets.push_back(it->first);
+		}
+		if (FD_ISSET(it->first, &out))
+			m_writable.push_back(it->second);
 	}
 }
 
 void CSocketSet::add(const ISocket& sock)
 {
-	m_set.insert(sock.m_socket);
+	if (m_set.count(sock.m_socket))
+		return;
+
+#ifdef MILK_EPOLL
+	if(m_epoll != -1)
+	{
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = const_cast<ISocket*>(&sock);
+		if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, sock.m_socket, &event) == -1)
+			throw error::net("Call to epoll_ctl failed"+Net::errorStr());
+		m_set[sock.m_socket] = &sock;
+		return;
+	}
+#endif
+
+#ifdef WIN32
+	// the windows fd_set is an array of FD_SETSIZE sockets
+	if (m_set.size() >= FD_SETSIZE)
+#else
+	// the unix fd_set is a bitmask of FD_SETSIZE bits
+	if (sock.m_socket >= FD_SETSIZE)
+#endif
+		throw error::net("Too many sockets for select");
+
+	m_set[sock.m_socket] = &sock;
+}
+
+void CSocketSet::watchWrite(const ISocket& sock, bool watch)
+{
+	BOOST_ASSERT(contains(sock));
+	if (watch == (m_writers.count(sock.m_socket) == 1))
+		return;
+
+#ifdef MILK_EPOLL
+	if(m_epoll != -1)
+	{
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = watch ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		event.data.ptr = const_cast<ISocket*>(&sock);
+		if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, sock.m_socket, &event) == -1)
+			throw error::net("Call to epoll_ctl failed"+Net::errorStr());
+	}
+#endif
+
+	if (watch)
+		m_writers.insert(sock.m_socket);
+	else
+	{
+		m_writers.erase(sock.m_socket);
+		m_writable.erase(std::remove(m_writable.begin(), m_writable.end(), &sock), m_writable.end());
+	}
 }
 
 void CSocketSet::remove(const ISocket& sock)
 {
-	m_set.erase(sock.m_socket);
+	if (!m_set.erase(sock.m_socket))
+		return;
+
+	m_writers.erase(sock.m_socket);
+	m_writable.erase(std::remove(m_writable.begin(), m_writable.end(), &sock), m_writable.end());
+
+#ifdef MILK_EPOLL
+	// fails if the socket is closed already, which removes it anyway
+	if(m_epoll != -1)
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, sock.m_socket, 0);
+#endif
+
+	vector<int>::iterator it = lower_bound(m_readySockets.begin(), m_readySockets.end(), sock.m_socket);
+	if (it != m_readySockets.end() && *it == sock.m_socket)
+	{
+		m_readySockets.erase(it);
+		m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), &sock), m_ready.end());
+	}
 }
 
 void CSocketSet::clear()
 {
+#ifdef MILK_EPOLL
+	if(m_epoll != -1)
+	{
+		for(socketMap::iterator it = m_set.begin(); it != m_set.end(); ++it)
+			epoll_ctl(m_epoll, EPOLL_CTL_DEL, it->first, 0);
+	}
+#endif
 	m_set.clear();
-	FD_ZERO(&m_in);
+	m_ready.clear();
+	m_readySockets.clear();
+	m_writers.clear();
+	m_writable.clear();
 }
 
 bool CSocketSet::contains(const ISocket& sock)
@@ -157,8 +335,7 @@ bool CSocketSet::contains(const ISocket& sock)
 
 bool CSocketSet::isSet(const ISocket& sock)
 {
-	int isset = FD_ISSET(sock.m_socket, &m_in);
-	return isset != 0;
+	return binary_search(m_readySockets.begin(), m_readySockets.end(), sock.m_socket);
 }
 
 /////////////////////////////////////////////////////
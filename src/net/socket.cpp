@@ -2,15 +2,28 @@
 #include "milk/net/socket.h"
 #include "milk/net/net.h"
 #include "milk/boost.h"
+#ifndef WIN32
+#	include <sys/uio.h>
+#	include <fcntl.h>
+#endif
 using namespace milk;
 using namespace std;
 
+ISocket::sharedBuffer ISocket::framePacket(const CPacket& packet, CPacket::Framing framing)
+{
+	size_t header = packet.putSizeFront(framing);
+	const uchar *data = packet.getDataPtr()-header;
+	return sharedBuffer(new vectorPOD<uchar>(data, data+packet.size()+header));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 #ifdef _MSC_VER
 #pragma warning(disable: 4355)
 #endif
 
 CSocketTCP::CSocketTCP()
-	: m_open(false), m_nagle(false), m_status(DISCONNECTED),
+	: m_queuedBytes(0), m_open(false), m_nagle(false), m_recvBufferSize(16*1024), m_status(DISCONNECTED),
 	m_connectThread(function_member(*this, &CSocketTCP::connect_private))
 {
 }
@@ -121,13 +134,18 @@ void CSocketTCP::close()
 		shutdown(m_socket, SD_BOTH);
 		if (closesocket(m_socket) != 0)
 #else
-		if (::close(m_socket) == -1);
+		if (::close(m_socket) == -1)
 #endif
 			throw error::net("Could not close socket"+Net::errorStr());
 	}
 
 	m_open = false;
 	m_status = DISCONNECTED;
+	m_bufferBegin = m_bufferEnd = 0;
+
+	// anything not sent yet is lost
+	m_sendQueue.clear();
+	m_queuedBytes = 0;
 }
 
 void CSocketTCP::accept(CSocketTCP& client)
@@ -176,432 +194,990 @@ void CSocketTCP::send(const void *data, uint nbytes)
 {
 	BOOST_ASSERT(status_private()==CONNECTED);
 
-	int parameter = 0;
-#ifndef WIN32
-	if (m_nagle)
-		parameter = MSG_DONTWAIT;
+	queue(data, nbytes);
+}
+
+void CSocketTCP::send(const CPacket& packet)
+{
+	BOOST_ASSERT(status_private()==CONNECTED);
+
+	size_t header = packet.putSizeFront(m_framing);
+	queue(packet.getDataPtr()-header, static_cast<uint>(packet.size()+header));
+}
+
+void CSocketTCP::send(const sharedBuffer& pData)
+{
+	BOOST_ASSERT(status_private()==CONNECTED);
+	BOOST_ASSERT(pData);
+
+	uint nbytes = static_cast<uint>(pData->size());
+	if (nbytes == 0)
+		return;
+
+	checkQueueLimit(nbytes);
+	m_sendQueue.push_back(CSendChunk(pData, 0, nbytes));
+	m_queuedBytes += nbytes;
+
+	if (m_autoFlush)
+		flush();
+}
+
+void CSocketTCP::queue(const void *data, uint nbytes)
+{
+	if (nbytes == 0)
+		return;
+
+	checkQueueLimit(nbytes);
+
+	/*	small sends are appended to the last buffer, unless it is
+		shared with other sockets, so a flush has few ranges to send */
+	if (m_sendQueue.empty() || !m_sendQueue.back().m_pData.unique())
+	{
+		sharedBuffer pData(new vectorPOD<uchar>());
+		pData->reserve(std::max(nbytes, 1024u));
+		m_sendQueue.push_back(CSendChunk(pData, 0, 0));
+	}
+
+	CSendChunk& chunk = m_sendQueue.back();
+	vectorPOD<uchar>& buffer = *chunk.m_pData;
+	BOOST_ASSERT(chunk.m_end == buffer.size());
+	buffer.resize(buffer.size() + nbytes);
+	memcpy(&buffer[0]+chunk.m_end, data, nbytes);
+	chunk.m_end += nbytes;
+	m_queuedBytes += nbytes;
+
+	if (m_autoFlush)
+		flush();
+}
+
+void CSocketTCP::checkQueueLimit(uint nbytes)
+{
+	// the limit may have been lowered below what is already queued
+	if (m_maxQueuedBytes == 0 ||
+		(m_queuedBytes <= m_maxQueuedBytes && nbytes <= m_maxQueuedBytes-m_queuedBytes))
+		return;
+
+	// the peer isn't reading, give up on it instead of queueing forever
+	m_sendQueue.clear();
+	m_queuedBytes = 0;
+#ifdef WIN32
+	shutdown(m_socket, SD_BOTH);
+#else
+	shutdown(m_socket, SHUT_RDWR);
 #endif
+	throw error::net_disconnect("Send queue overflow");
+}
 
-	//*
+void CSocketTCP::flush()
+{
+	BOOST_ASSERT(status_private()==CONNECTED);
 
-	int sent = 0;	// how many bytes we have sent
+#ifdef WIN32
+	/*	WinSock 1.1 has no gather send, so the ranges are sent one
+		by one, with the socket non-blocking during the flush */
+	u_long nonBlocking = 1;
+	ioctlsocket(m_socket, FIONBIO, &nonBlocking);
 
-	while (sent < static_cast<int>(nbytes))
+	int lastError = 0;
+	while (!m_sendQueue.empty())
 	{
+		const CSendChunk& chunk = m_sendQueue.front();
+		int n = ::send(m_socket, reinterpret_cast<const char*>(&(*chunk.m_pData)[0]+chunk.m_begin), static_cast<int>(chunk.m_end-chunk.m_begin), 0);
+		if (n == -1)
+		{
+			lastError = WSAGetLastError();
+			break;
+		}
+		sent(static_cast<uint>(n));
+	}
+
+	nonBlocking = 0;
+	ioctlsocket(m_socket, FIONBIO, &nonBlocking);
+
+	if (lastError==0 || lastError==WSAEWOULDBLOCK)
+		return;
+	if (lastError==WSAECONNRESET || lastError==WSAECONNABORTED || lastError==WSAENETRESET)
+		throw error::net_disconnect("Disconnected");
+	WSASetLastError(lastError);
+	throw error::net_send("Could not send data"+Net::errorStr());
+#else
+	// ranges gathered into one call
+	const int maxRanges = 16;
+
+	int flags = MSG_DONTWAIT;
+#	ifdef MSG_NOSIGNAL
+	// a disconnect is an exception, not a SIGPIPE
+	flags |= MSG_NOSIGNAL;
+#	endif
+
+	while (!m_sendQueue.empty())
+	{
+		iovec ranges[maxRanges];
+		int numRanges = 0;
+		uint total = 0;
+		for (sendQueue::const_iterator it = m_sendQueue.begin(); it != m_sendQueue.end() && numRanges < maxRanges; ++it, ++numRanges)
+		{
+			ranges[numRanges].iov_base = &(*it->m_pData)[0]+it->m_begin;
+			ranges[numRanges].iov_len = it->m_end-it->m_begin;
+			total += it->m_end-it->m_begin;
+		}
 
-		BOOST_ASSERT(sent==0);
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = ranges;
+		message.msg_iovlen = numRanges;
 
-		int n = ::send(m_socket, reinterpret_cast<const char*>(data)+sent, static_cast<int>(nbytes)-sent, parameter);
+		ssize_t n = sendmsg(m_socket, &message, flags);
 		if (n == -1)
 		{
-#ifdef WIN32
-			int error = WSAGetLastError();
-			if (error==WSAECONNRESET || error==WSAECONNABORTED || error==WSAENETRESET)
+			if (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)
+				return;
+			if (errno==EPIPE || errno==ECONNRESET)
 				throw error::net_disconnect("Disconnected");
-#endif
 			throw error::net_send("Could not send data"+Net::errorStr());
 		}
-		else if (n == 0)
-			throw error::net_send("Send returned 0!?"+Net::errorStr());
 
-		BOOST_ASSERT(n>0);
+		sent(static_cast<uint>(n));
 
-		sent += n;
+		// the socket buffer is full
+		if (static_cast<uint>(n) < total)
+			return;
 	}
+#endif
+}
 
-	/*/
-
-	int n = ::send(m_socket, reinterpret_cast<const char*>(data), nbytes, parameter);
-	if (n == -1)
+void CSocketTCP::sent(uint nbytes)
+{
+	BOOST_ASSERT(nbytes <= m_queuedBytes);
+	m_queuedBytes -= nbytes;
+	while (nbytes != 0)
 	{
-#ifdef WIN32
-		if (WSAGetLastError()==WSAECONNRESET)
-			throw error::net_disconnect("Disconnected");
-#endif
-		throw error::net_send("Could not send data"+Net::errorStr());
+		CSendChunk& chunk = m_sendQueue.front();
+		uint n = std::min(nbytes, chunk.m_end-chunk.m_begin);
+		chunk.m_begin += n;
+		nbytes -= n;
+		if (chunk.m_begin == chunk.m_end)
+			m_sendQueue.pop_front();
 	}
-	else if (n == 0)
-		throw error::net_send("Send returned 0!?"+Net::errorStr());
-
-	/**/
 }
 
-void CSocketTCP::send(const CPacket& packet)
+
+uint CSocketTCP::recv(void *data, uint maxlen)
 {
 	BOOST_ASSERT(status_private()==CONNECTED);
 
-	CPacket::SizeHeader_t size = static_cast<CPacket::SizeHeader_t>(packet.size());
+	if (maxlen==0)
+		return 0;
 
-	int headerSize = sizeof(CPacket::SizeHeader_t);
+	if (m_bufferBegin == m_bufferEnd)
+		recv_private();
 
-	//*
+	BOOST_ASSERT(m_bufferBegin < m_bufferEnd);
 
-	packet.putSizeFront();
-	send(packet.getDataPtr()-headerSize, size+headerSize);
+	uint howMuch = std::min(maxlen, m_bufferEnd-m_bufferBegin);
 
-	/*/
+	memcpy(data, &m_buffer[0]+m_bufferBegin, howMuch);
+	m_bufferBegin += howMuch;
 
-	send(reinterpret_cast<const void*>(&size), sizeof(size));
-	send(reinterpret_cast<const void*>(packet.getDataPtr()), size);
+	return howMuch;
+}
 
-	/**/
+bool CSocketTCP::recv(CPacket& packet)
+{
+	return recv_private(packet, false);
 }
 
+bool CSocketTCP::recvView(CPacket& packet)
+{
+	return recv_private(packet, true);
+}
 
-uint CSocketTCP::recv(void *data, uint maxlen)
+bool CSocketTCP::recv_private(CPacket& packet, bool view)
 {
 	BOOST_ASSERT(status_private()==CONNECTED);
 
-	if (maxlen==0)
+	packet.clear();
+
+	/*	one receive per call at most, it gets everything that
+		has arrived so the following packets are already buffered */
+	uint header;
+	uint total = bufferedPacketSize(&header);
+	if (total == 0 || total > m_bufferEnd-m_bufferBegin)
+	{
+		recv_private();
+		total = bufferedPacketSize(&header);
+		if (total == 0 || total > m_bufferEnd-m_bufferBegin)
+			return false;
+	}
+
+	uint size = total - header;
+	const uchar *data = &m_buffer[0] + m_bufferBegin + header;
+	if (view)
+		packet.view(data, size);
+	else
+	{
+		packet.resize(size);
+		memcpy(packet.getDataPtr(), data, size);
+	}
+	m_bufferBegin += total;
+
+	return true;
+}
+
+bool CSocketTCP::hasPacket() const
+{
+	uint total = bufferedPacketSize();
+	return total != 0 && total <= m_bufferEnd-m_bufferBegin;
+}
+
+uint CSocketTCP::bufferedPacketSize(uint *pHeaderSize) const
+{
+	if (m_bufferBegin == m_bufferEnd)
 		return 0;
 
-	//*
+	size_t size;
+	size_t header = CPacket::readSizeHeader(m_framing, &m_buffer[0]+m_bufferBegin, m_bufferEnd-m_bufferBegin, size);
+	if (header == 0)
+		return 0;
+	if (size > m_maxPacketSize)
+		throw error::net_corrupt_packet("Too large packet received");
 
-	recv_private(maxlen);
+	if (pHeaderSize)
+		*pHeaderSize = static_cast<uint>(header);
+	return static_cast<uint>(header + size);
+}
 
-	BOOST_ASSERT(!m_buffer.empty());
+void CSocketTCP::setRecvBufferSize(uint size)
+{
+	// room for at least a packet header
+	m_recvBufferSize = std::max(size, static_cast<uint>(CPacket::MAX_HEADER_SIZE));
+}
 
-	uint howMuch = std::min(maxlen, static_cast<uint>(m_buffer.size()));
+void CSocketTCP::recv_private()
+{
+	BOOST_ASSERT(status_private()==CONNECTED);
 
-	memcpy(data, &m_buffer[0], howMuch);
-	m_buffer.erase(m_buffer.begin(), m_buffer.begin()+howMuch);
+	if (m_bufferBegin == m_bufferEnd)
+	{
+		m_bufferBegin = m_bufferEnd = 0;
 
-	return howMuch;
+		// give back the memory of a large packet
+		if (m_buffer.size() > 4*m_recvBufferSize)
+		{
+			vectorPOD<uchar> buffer(m_recvBufferSize);
+			m_buffer.swap(buffer);
+		}
+	}
+
+	/*	the whole packet must fit, so the buffer grows for larger
+		packets, once to the full size as soon as the header is known */
+	uint capacity = std::max(m_recvBufferSize, bufferedPacketSize());
+	if (m_buffer.size() < capacity)
+	{
+		// exactly the size needed, only the bytes received so far are copied
+		vectorPOD<uchar> buffer(capacity);
+		memcpy(&buffer[0], &m_buffer[0]+m_bufferBegin, m_bufferEnd-m_bufferBegin);
+		m_bufferEnd -= m_bufferBegin;
+		m_bufferBegin = 0;
+		m_buffer.swap(buffer);
+	}
+
+	/*	only move the remaining bytes to the front when the end is
+		getting close, instead of once for every packet */
+	uint capacityLeft = static_cast<uint>(m_buffer.size()) - m_bufferEnd;
+	if (m_bufferBegin != 0 && capacityLeft < m_buffer.size()/2)
+	{
+		memmove(&m_buffer[0], &m_buffer[0]+m_bufferBegin, m_bufferEnd-m_bufferBegin);
+		m_bufferEnd -= m_bufferBegin;
+		m_bufferBegin = 0;
+		capacityLeft = static_cast<uint>(m_buffer.size()) - m_bufferEnd;
+	}
+
+	if (capacityLeft == 0)
+		return;
 
-	/*/
+	int nr = ::recv(m_socket, reinterpret_cast<char*>(&m_buffer[0]+m_bufferEnd), capacityLeft, 0);
 
-	int nr = ::recv(m_socket, reinterpret_cast<char*>(data), maxlen, 0);
 	if (nr == 0)
 	{
 		throw error::net_disconnect("Disconnected");
 	}
 	else if (nr == -1)
 	{
-		#ifdef WIN32
-		if (WSAGetLastError()==WSAECONNRESET)
-		throw error::net_disconnect("Disconnected");
-		#endif
+#ifdef WIN32
+		int error = WSAGetLastError();
+		if (error==WSAECONNRESET || error==WSAECONNABORTED || error==WSAENETRESET)
+			throw error::net_disconnect("Disconnected");
+#endif
 		throw error::net_recv("Could not receive data"+Net::errorStr());
 	}
-	return nr;
 
-	/**/
+	m_bufferEnd += nr;
 }
 
-bool CSocketTCP::recv(CPacket& packet)
+void CSocketTCP::setNagle(bool nagle)
 {
 	BOOST_ASSERT(status_private()==CONNECTED);
 
-	packet.setReadPos(0);
-	packet.resize(0);
+	m_nagle = nagle;
+
+#ifdef WIN32
+	/* the next stuff sets the socket to send directly,
+	instead of waiting for a filled up ip-packet. */
+	//*
+	int on = (nagle ? 1 : 0);
+	if (setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&on), sizeof(int)) != 0)
+		throw error::net("setsockopt failed"+Net::errorStr());
+	/**/
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CSocketUDP::CSocketUDP()
+	: m_socket(-1), m_open(false), m_loss(0.0f), m_latency(0.0), m_jitter(0.0), m_seed(12345)
+{ }
 
-	/*
+CSocketUDP::~CSocketUDP()
+{ close(); }
 
-	if (false)// sizeof(Uint32) <= m_buffer.size())
+void CSocketUDP::open(int port)
+{
+	close();
+
+	//UDP socket
+	m_socket = static_cast<int>(socket(AF_INET, SOCK_DGRAM, 0));
+	if (m_socket == -1)
+		throw error::net("Could not create UDP-socket"+Net::errorStr());
+	m_open = true;
+
+	CIP ip(port);
+	if (bind(m_socket, reinterpret_cast<const sockaddr*>(ip.getAddress()), sizeof(sockaddr)) == -1)
 	{
-		Uint32 packetSize;
-		memcpy(&packetSize, &m_buffer[0], sizeof(Uint32));
-		recv_private(2*packetSize+1024);
+		string str = Net::errorStr();
+		close();
+		throw error::net("Could not bind socket to local port"+str);
 	}
-	else
+
+	// never block, a receive with nothing waiting just returns
+#ifdef WIN32
+	u_long nonBlocking = 1;
+	if (ioctlsocket(m_socket, FIONBIO, &nonBlocking) != 0)
+#else
+	if (fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL, 0) | O_NONBLOCK) == -1)
+#endif
 	{
-		//512 bytes should be a big enough buffer for most packages
-		recv_private(512);
+		string str = Net::errorStr();
+		close();
+		throw error::net("Could not make socket non-blocking"+str);
 	}
+}
 
-	BOOST_ASSERT(!m_buffer.empty());
+bool CSocketUDP::open() const
+{
+	return m_open;
+}
 
+void CSocketUDP::close()
+{
+	if (!m_open)
+		return;
 
-	if (sizeof(Uint32) <= m_buffer.size())
-	{
-		Uint32 packetSize;
-		memcpy(&packetSize, &m_buffer[0], sizeof(Uint32));
+#ifdef WIN32
+	closesocket(m_socket);
+#else
+	::close(m_socket);
+#endif
+	m_socket = -1;
+	m_open = false;
+	m_delayed.clear();
+}
 
-		if (packetSize == 0)
-		{
-			return true;
-		}
+void CSocketUDP::sendTo(const CIP& ip, const void *data, uint nbytes)
+{
+	BOOST_ASSERT(m_open);
 
-		if (sizeof(Uint32) + packetSize  <= m_buffer.size())
-		{
-			packet.resize(packetSize);
-			memcpy(packet.getDataPtr(), &m_buffer[0] + sizeof(Uint32), packetSize);
-			m_buffer.erase(m_buffer.begin(), m_buffer.begin() + packetSize + sizeof(Uint32));
-			return true;
-		}
-		BOOST_ASSERT(m_buffer.empty());
-		return false;
+	sendDelayed();
+
+	if (m_loss == 0.0f && m_latency == 0.0 && m_jitter == 0.0)
+	{
+		sendNow(ip, data, nbytes);
+		return;
 	}
-	BOOST_ASSERT(m_buffer.empty());
-	return false;
 
-	/*/
+	if (random() < m_loss)
+		return;
 
-	/* the code above is flawed, i think the code
-	below is flawless, and is the best we can do */
+	const uchar *p = reinterpret_cast<const uchar*>(data);
+	m_delayed.push_back(CDelayed());
+	CDelayed& delayed = m_delayed.back();
+	delayed.m_time = highResolutionTime() + m_latency + m_jitter*random();
+	delayed.m_ip = ip;
+	delayed.m_data.assign(p, p+nbytes);
+}
 
-	if (sizeof(CPacket::SizeHeader_t) > m_buffer.size())
+void CSocketUDP::sendNow(const CIP& ip, const void *data, uint nbytes)
+{
+	int n = ::sendto(m_socket, reinterpret_cast<const char*>(data), static_cast<int>(nbytes), 0,
+		reinterpret_cast<const sockaddr*>(ip.getAddress()), sizeof(sockaddr));
+	if (n == -1)
 	{
-		recv_private(static_cast<uint>(sizeof(CPacket::SizeHeader_t)-m_buffer.size()));
+		// a full send buffer is just a lost datagram
+#ifdef WIN32
+		if (WSAGetLastError() == WSAEWOULDBLOCK)
+			return;
+#else
+		if (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)
+			return;
+#endif
+		throw error::net_send("Could not send datagram"+Net::errorStr());
 	}
+}
 
-	if (sizeof(CPacket::SizeHeader_t) <= m_buffer.size())
-	{
-		CPacket::SizeHeader_t size;
-		memcpy(&size, &m_buffer[0], sizeof(size));
+void CSocketUDP::sendDelayed()
+{
+	if (m_delayed.empty())
+		return;
 
-		if (size==0)
+	double now = highResolutionTime();
+	size_t kept = 0;
+	for (size_t i = 0 ; i < m_delayed.size() ; ++i)
+	{
+		CDelayed& delayed = m_delayed[i];
+		if (delayed.m_time <= now)
 		{
-			return true;
+			sendNow(delayed.m_ip, &delayed.m_data[0], static_cast<uint>(delayed.m_data.size()));
+			continue;
 		}
-
-		if (sizeof(size) + size > m_buffer.size())
+		if (kept != i)
 		{
-			// this might have to wait for some more data to recevie.
-			// can we make it so that recv_private is only called once?
-
-			recv_private(static_cast<uint>(sizeof(size) + size - m_buffer.size()));
+			m_delayed[kept].m_time = delayed.m_time;
+			m_delayed[kept].m_ip = delayed.m_ip;
+			m_delayed[kept].m_data.swap(delayed.m_data);
 		}
+		++kept;
+	}
+	m_delayed.resize(kept);
+}
 
-		if (sizeof(size) + size <= m_buffer.size())
-		{
-			packet.resize(size);
-			memcpy(packet.getDataPtr(), &m_buffer[0] + sizeof(size), size);
-			m_buffer.erase(m_buffer.begin(), m_buffer.begin() + sizeof(size) + size);
+uint CSocketUDP::recvFrom(CIP& ip, void *data, uint maxlen)
+{
+	BOOST_ASSERT(m_open);
 
-			return true;
-		}
-		return false;
-	}
-	return false;
+	sendDelayed();
 
-	/**/
+#ifdef WIN32
+	typedef int socklen_t;
+#endif
 
-	/*
-	if (sizeof(Uint32) > m_buffer.size())
+	for (;;)
 	{
-		recv_private(sizeof(Uint32));
+		int size = sizeof(sockaddr_in);
+		int n = ::recvfrom(m_socket, reinterpret_cast<char*>(data), static_cast<int>(maxlen), 0,
+			reinterpret_cast<sockaddr*>(ip.getAddress()), reinterpret_cast<socklen_t*>(&size));
+		if (n >= 0)
+			return static_cast<uint>(n);
+
+#ifdef WIN32
+		int lastError = WSAGetLastError();
+		// an earlier datagram was refused by its destination
+		if (lastError == WSAECONNRESET)
+			continue;
+		if (lastError == WSAEMSGSIZE)
+			return maxlen;
+		if (lastError == WSAEWOULDBLOCK)
+			return 0;
+#else
+		if (errno==EAGAIN || errno==EWOULDBLOCK)
+			return 0;
+		if (errno==EINTR || errno==ECONNREFUSED)
+			continue;
+#endif
+		throw error::net_recv("Could not receive datagram"+Net::errorStr());
 	}
+}
 
-	if (sizeof(Uint32) <= m_buffer.size())
-	{
-		Uint32 size;
-		memcpy(&size, &m_buffer[0], sizeof(size));
+bool CSocketUDP::wait(int timeout)
+{
+	BOOST_ASSERT(m_open);
 
-		if (size==0)
-		{
-			return true;
-		}
+	// the simulation may have datagrams to send before then
+	if (!m_delayed.empty())
+		timeout = std::min(timeout, 1);
 
-		if (sizeof(Uint32) + size > m_buffer.size())
-		{
-			// this might have to wait for some more data to recevie.
-			// can we make it so that recv_private is only called once?
+	fd_set in;
+	FD_ZERO(&in);
 
-			recv_private(size);
-		}
+#ifdef _MSC_VER
+#pragma warning(disable: 4127)
+#endif
 
-		if (sizeof(Uint32) + size <= m_buffer.size())
-		{
-			packet.resize(size);
-			memcpy(packet.getDataPtr(), &m_buffer[0] + sizeof(size), size);
-			m_buffer.erase(m_buffer.begin(), m_buffer.begin() + sizeof(size) + size);
+	FD_SET(static_cast<uint>(m_socket), &in);
 
-			return true;
-		}
-		return false;
-	}
-	return false;
-	*/
+#ifdef _MSC_VER
+#pragma warning(default: 4127)
+#endif
 
-	/*
+	timeval time;
+	time.tv_sec		= timeout/1000;
+	time.tv_usec	= (timeout%1000)*1000;
 
-	Uint32 size;
-	if (recv(&size, sizeof(size)) != sizeof(size))
-	{
-		throw error::milk("To small packet-size received");
-	}
-	packet.resize(size);
-	if (recv(packet.getDataPtr(), size) != size)
+	int n = select(m_socket + 1, &in, 0, 0, &time);
+	if (n == -1)
 	{
-		throw error::milk("To small packet-data received");
+#ifndef WIN32
+		if (errno == EINTR)
+			return false;
+#endif
+		throw error::net("Call to select failed"+Net::errorStr());
 	}
-	return true;
-	*/
+
+	sendDelayed();
+	return n != 0;
 }
 
-void CSocketTCP::recv_private(uint maxlen)
+void CSocketUDP::setSimulation(float loss, double latency, double jitter)
 {
-	BOOST_ASSERT(status_private()==CONNECTED);
+	m_loss = loss;
+	m_latency = latency;
+	m_jitter = jitter;
+}
 
-	if (maxlen==0)
-		return;
+double CSocketUDP::random()
+{
+	m_seed = m_seed*1664525u + 1013904223u;
+	return (m_seed >> 8) / double(1 << 24);
+}
 
-	uint oldsize = static_cast<uint>(m_buffer.size());
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	m_buffer.resize(oldsize+maxlen);
+namespace
+{
+	const uchar udpMagic[2] = { 'm', 'k' };
 
-	int nr = ::recv(m_socket, reinterpret_cast<char*>(&m_buffer[0]+oldsize), maxlen, 0);
+	// the datagrams are little endian
 
-	if (nr == 0)
+	void put16(uchar *p, Uint16 value)
 	{
-		throw error::net_disconnect("Disconnected");
+		p[0] = uchar(value);
+		p[1] = uchar(value >> 8);
 	}
-	else if (nr == -1)
+
+	void put32(uchar *p, Uint32 value)
 	{
-#ifdef WIN32
-		int error = WSAGetLastError();
-		if (error==WSAECONNRESET || error==WSAECONNABORTED || error==WSAENETRESET)
-			throw error::net_disconnect("Disconnected");
-#endif
-		throw error::net_recv("Could not receive data"+Net::errorStr());
+		put16(p, Uint16(value));
+		put16(p+2, Uint16(value >> 16));
 	}
 
-	m_buffer.resize(oldsize+nr);
+	Uint16 get16(const uchar *p)
+	{ return Uint16(p[0] | (p[1] << 8)); }
+
+	Uint32 get32(const uchar *p)
+	{ return get16(p) | (Uint32(get16(p+2)) << 16); }
+
+	// is a more recent than b, the numbers wrap around
+	bool sequenceNewer(Uint16 a, Uint16 b)
+	{ return a != b && Uint16(a - b) < 0x8000; }
+
+	// append n bytes and return where they start
+	uchar *grow(vectorPOD<uchar>& v, size_t n)
+	{
+		size_t size = v.size();
+		v.resize(size + n);
+		return &v[0] + size;
+	}
 }
 
-void CSocketTCP::setNagle(bool nagle)
+CConnectionUDP::CConnectionUDP(CSocketUDP& socket, const CIP& ip)
+	: m_udpSocket(socket), m_sent(SENT_HISTORY), m_timeout(10.0)
 {
-	BOOST_ASSERT(status_private()==CONNECTED);
+	m_socket = -1;
+	reset(ip);
+}
 
-	m_nagle = nagle;
+void CConnectionUDP::reset(const CIP& ip)
+{
+	m_ip = ip;
+
+	m_reliable.clear();
+	m_unreliable.clear();
+	for (size_t i = 0 ; i < m_sent.size() ; ++i)
+		m_sent[i].m_valid = false;
+	m_queuedBytes = 0;
+	m_localSequence = 0;
+	m_nextMessageId = 0;
+	m_lastSendTime = 0.0;
+
+	m_remoteSequence = 0;
+	m_receivedBits = 0;
+	m_receivedAny = false;
+	m_ackPending = false;
+	m_nextReceiveId = 0;
+	m_outOfOrder.clear();
+	m_received.clear();
+
+	m_rtt = 0.1;
+	m_lastReceiveTime = highResolutionTime();
+	m_connected = false;
+	m_disconnected = false;
+}
 
-#ifdef WIN32
-	/* the next stuff sets the socket to send directly,
-	instead of waiting for a filled up ip-packet. */
-	//*
-	int on = (nagle ? 1 : 0);
-	if (setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&on), sizeof(int)) != 0)
-		throw error::net("setsockopt failed"+Net::errorStr());
-	/**/
-#endif
+void CConnectionUDP::send(const void *data, uint nbytes)
+{
+	if (nbytes > MAX_PACKET_SIZE)
+		throw error::net_send("Packet too large for a datagram");
+
+	const uchar *p = reinterpret_cast<const uchar*>(data);
+	queue(sharedBuffer(new vectorPOD<uchar>(p, p+nbytes)), 0, nbytes);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+void CConnectionUDP::send(const CPacket& packet)
+{
+	send(packet.getDataPtr(), static_cast<uint>(packet.size()));
+}
 
-/*
-CSocketUDP::CSocketUDP() : m_socket(0)
-{ }
+void CConnectionUDP::send(const sharedBuffer& pData)
+{
+	BOOST_ASSERT(pData && !pData->empty());
 
-CSocketUDP::CSocketUDP(Uint16 port) : m_socket(0)
-{ open(port); }
+	size_t size;
+	size_t header = CPacket::readSizeHeader(m_framing, &(*pData)[0], pData->size(), size);
+	BOOST_ASSERT(header != 0 && header+size == pData->size());
+	if (size > MAX_PACKET_SIZE)
+		throw error::net_send("Packet too large for a datagram");
 
-CSocketUDP::~CSocketUDP()
-{ close(); }
+	queue(pData, static_cast<uint>(header), static_cast<uint>(header+size));
+}
 
-void CSocketUDP::open(Uint16 port)
+void CConnectionUDP::queue(const sharedBuffer& pData, uint begin, uint end)
 {
-	close();
-	m_socket = SDLNet_UDP_Open(port);
-	if (!m_socket)
-		throw error::net((string)"Could not open UDP socket, SDL_Net error: " + SDLNet_GetError());
+	// the peer isn't acknowledging, give up on it instead of queueing forever
+	if (m_maxQueuedBytes != 0 &&
+		(m_queuedBytes > m_maxQueuedBytes || end-begin > m_maxQueuedBytes-m_queuedBytes))
+	{
+		disconnect();
+		m_disconnected = true;
+		m_reliable.clear();
+		m_queuedBytes = 0;
+		throw error::net_disconnect("Send queue overflow");
+	}
+
+	m_reliable.push_back(CReliable(m_nextMessageId++, pData, begin, end));
+	m_queuedBytes += end-begin;
+
+	if (m_autoFlush)
+		flush();
 }
 
-bool CSocketUDP::open() const
-{ return (m_socket!=0); }
+void CConnectionUDP::sendUnreliable(const CPacket& packet)
+{
+	if (packet.size() > MAX_PACKET_SIZE)
+		throw error::net_send("Packet too large for a datagram");
 
-void CSocketUDP::close()
+	const uchar *p = packet.getDataPtr();
+	m_unreliable.push_back(vectorPOD<uchar>(p, p+packet.size()));
+
+	if (m_autoFlush)
+		flush();
+}
+
+void CConnectionUDP::flush()
 {
-	if (open())
+	if (m_disconnected)
+		throw error::net_disconnect("Disconnected");
+
+	double now = highResolutionTime();
+	double resendTime = std::max(0.05, 2.0*m_rtt);
+	bool keepAlive = now - m_lastSendTime > (m_connected ? 0.25 : 0.1);
+
+	// only messages in the window are sent, so the peer can tell their ids apart
+	size_t window = std::min(m_reliable.size(), static_cast<size_t>(SEND_WINDOW));
+	size_t next = 0;
+
+	vectorPOD<uchar> datagram;
+	for (;;)
 	{
-		SDLNet_UDP_Close(m_socket);
-		m_socket=0;
+		beginDatagram(datagram, DATAGRAM_DATA);
+		CSent& sent = m_sent[m_localSequence % SENT_HISTORY];
+		sent.m_messages.clear();
+		sent.m_valid = false;
+
+		// new messages and the ones whose datagram wasn't acknowledged in time
+		for ( ; next < window ; ++next)
+		{
+			CReliable& message = m_reliable[next];
+			if (message.m_acked || (message.m_sentTime >= 0.0 && now-message.m_sentTime < resendTime))
+				continue;
+
+			uint size = message.m_end-message.m_begin;
+			if (datagram.size() + MESSAGE_HEADER_SIZE + size > MAX_DATAGRAM_SIZE)
+				break;
+
+			uchar *p = grow(datagram, MESSAGE_HEADER_SIZE + size);
+			p[0] = CHANNEL_RELIABLE;
+			put16(p+1, message.m_id);
+			put16(p+3, Uint16(size));
+			if (size != 0)
+				memcpy(p+MESSAGE_HEADER_SIZE, &(*message.m_pData)[0]+message.m_begin, size);
+
+			message.m_sentTime = now;
+			sent.m_messages.push_back(message.m_id);
+		}
+
+		while (!m_unreliable.empty())
+		{
+			const vectorPOD<uchar>& message = m_unreliable.front();
+			uint size = static_cast<uint>(message.size());
+			if (datagram.size() + 3 + size > MAX_DATAGRAM_SIZE)
+				break;
+
+			uchar *p = grow(datagram, 3 + size);
+			p[0] = CHANNEL_UNRELIABLE;
+			put16(p+1, Uint16(size));
+			if (size != 0)
+				memcpy(p+3, &message[0], size);
+			m_unreliable.pop_front();
+		}
+
+		if (datagram.size() == DATAGRAM_HEADER_SIZE && !m_ackPending && !keepAlive)
+			break;
+
+		sendDatagram(datagram, now);
+		keepAlive = false;
+
+		if (next == window && m_unreliable.empty())
+			break;
 	}
 }
 
-void CSocketUDP::bind(const CIP& ip)
+void CConnectionUDP::beginDatagram(vectorPOD<uchar>& datagram, DatagramType type)
 {
-	unbind();
-	if (SDLNet_UDP_Bind(m_socket, 0, ip.getIPPointer()) != 0)
-		throw error::net((string)"Could not bind UDP socket, SDL_Net error: " + SDLNet_GetError());
+	datagram.resize(DATAGRAM_HEADER_SIZE);
+	uchar *p = &datagram[0];
+	p[0] = udpMagic[0];
+	p[1] = udpMagic[1];
+	if (m_receivedAny)
+		p[2] = uchar(type|DATAGRAM_ACK);
+	else
+		p[2] = uchar(type == DATAGRAM_DATA ? type|DATAGRAM_CONNECT : type);
+	put16(p+3, m_localSequence);
+	put16(p+5, m_remoteSequence);
+	put32(p+7, m_receivedBits);
 }
 
-void CSocketUDP::unbind()
+void CConnectionUDP::sendDatagram(const vectorPOD<uchar>& datagram, double now)
 {
-	SDLNet_UDP_Unbind(m_socket, 0);
+	CSent& sent = m_sent[m_localSequence % SENT_HISTORY];
+	sent.m_sequence = m_localSequence;
+	sent.m_time = now;
+	sent.m_valid = true;
+
+	++m_localSequence;
+	m_lastSendTime = now;
+	m_ackPending = false;
+
+	m_udpSocket.sendTo(m_ip, &datagram[0], static_cast<uint>(datagram.size()));
 }
 
-CIP CSocketUDP::getAddress() const
+void CConnectionUDP::disconnect()
 {
-	IPaddress *ip = SDLNet_UDP_GetPeerAddress(m_socket, 0);
-	if (!ip)
-		throw error::net((string)"Could not get address of UDP socket, SDL_Net error: " + SDLNet_GetError());
-	CIP temp;
-	temp.m_ip = *ip;
-	return temp;
+	vectorPOD<uchar> datagram;
+	beginDatagram(datagram, DATAGRAM_DISCONNECT);
+
+	// a few times, since it isn't acknowledged
+	for (int i = 0 ; i < 3 ; ++i)
+		m_udpSocket.sendTo(m_ip, &datagram[0], static_cast<uint>(datagram.size()));
 }
 
+bool CConnectionUDP::disconnected() const
+{
+	return m_disconnected || highResolutionTime()-m_lastReceiveTime > m_timeout;
+}
+
+bool CConnectionUDP::isDatagram(const uchar *data, uint nbytes)
+{
+	return nbytes >= DATAGRAM_HEADER_SIZE && data[0] == udpMagic[0] && data[1] == udpMagic[1];
+}
 
-void CSocketUDP::send(const void *data, int nbytes)
+bool CConnectionUDP::isConnectRequest(const uchar *data, uint nbytes)
 {
-	UDPpacket p;	//ugly
-	//outcommented assignments are unneeded
-	//p.channel	= 0;
-	p.data		= reinterpret_cast<Uint8*>(const_cast<void*>(data));
-	p.len		= nbytes;
-	p.maxlen	= nbytes;
-	p.status	= -1;
-	//p.address	= *getAddress().getIPPointer();
+	return isDatagram(data, nbytes) && data[2] == (DATAGRAM_DATA|DATAGRAM_CONNECT);
+}
+
+void CConnectionUDP::deliver(const uchar *data, uint nbytes)
+{
+	if (!isDatagram(data, nbytes))
+		throw error::net_corrupt_packet("Invalid datagram");
+
+	uchar type = data[2] & ~(DATAGRAM_ACK|DATAGRAM_CONNECT);
+	if (type == DATAGRAM_DISCONNECT)
+	{
+		m_disconnected = true;
+		return;
+	}
+	if (type != DATAGRAM_DATA)
+		throw error::net_corrupt_packet("Invalid datagram");
+
+	double now = highResolutionTime();
+	Uint16 sequence = get16(data+3);
+
+	// duplicates and datagrams older than the ack bits are dropped
+	bool newest = !m_receivedAny || sequenceNewer(sequence, m_remoteSequence);
+	if (!m_receivedAny)
+	{
+		m_remoteSequence = sequence;
+		m_receivedBits = 0;
+		m_receivedAny = true;
+	}
+	else if (newest)
+	{
+		uint shift = Uint16(sequence - m_remoteSequence);
+		if (shift > 32)
+			m_receivedBits = 0;
+		else
+			m_receivedBits = (shift == 32 ? 0 : m_receivedBits << shift) | (1u << (shift-1));
+		m_remoteSequence = sequence;
+	}
+	else
+	{
+		uint age = Uint16(m_remoteSequence - sequence);
+		if (age == 0 || age > 32 || (m_receivedBits & (1u << (age-1))))
+			return;
+		m_receivedBits |= 1u << (age-1);
+	}
+
+	m_connected = true;
+	m_lastReceiveTime = now;
 
-	if (SDLNet_UDP_Send(m_socket, 0, &p) != 1)	//should have been sent to ONE place only
-		throw error::net((string)"Could not send data, SDL_Net error: " + SDLNet_GetError());
+	if (data[2] & DATAGRAM_ACK)
+	{
+		Uint16 ack = get16(data+5);
+		Uint32 bits = get32(data+7);
+		acked(ack, now);
+		for (uint i = 0 ; i < 32 ; ++i)
+			if (bits & (1u << i))
+				acked(Uint16(ack-i-1), now);
+	}
+
+	const uchar *p = data + DATAGRAM_HEADER_SIZE;
+	const uchar *end = data + nbytes;
+	while (p != end)
+	{
+		// only datagrams with messages are acknowledged right away
+		m_ackPending = true;
+
+		uint header = (p[0] == CHANNEL_RELIABLE) ? MESSAGE_HEADER_SIZE : 3;
+		if (p[0] > CHANNEL_UNRELIABLE || static_cast<uint>(end-p) < header)
+			throw error::net_corrupt_packet("Invalid datagram");
+		uint size = get16(p+header-2);
+		if (static_cast<uint>(end-p) < header+size)
+			throw error::net_corrupt_packet("Invalid datagram");
+
+		if (p[0] == CHANNEL_RELIABLE)
+			received(get16(p+1), p+header, size);
+		else if (newest)
+			m_received.push_back(vectorPOD<uchar>(p+header, p+header+size));
+
+		p += header+size;
+	}
 }
 
-void CSocketUDP::send(const CPacket& packet)
+void CConnectionUDP::acked(Uint16 sequence, double now)
 {
-	Uint32 size = static_cast<Uint32>(packet.size());
-	packet.putSizeFront();
+	CSent& sent = m_sent[sequence % SENT_HISTORY];
+	if (!sent.m_valid || sent.m_sequence != sequence)
+		return;
+	sent.m_valid = false;
 
-	UDPpacket p;	//ugly
-	memset(&p, 0, sizeof(p));
-	//commented assignments are unneeded
-	//p.channel	= 0;
-	p.data		= const_cast<Uint8*>(packet.getDataPtr()-4);
-	p.len		= size+4;
-	p.maxlen	= size+4;
-	p.status	= -1;
-	//p.address	= *getAdress().getIPPointer();
+	m_rtt += (now-sent.m_time - m_rtt) * 0.1;
+
+	for (size_t i = 0 ; i < sent.m_messages.size() && !m_reliable.empty() ; ++i)
+	{
+		size_t index = Uint16(sent.m_messages[i] - m_reliable.front().m_id);
+		if (index >= std::min(m_reliable.size(), static_cast<size_t>(SEND_WINDOW)))
+			continue;
+
+		CReliable& message = m_reliable[index];
+		if (!message.m_acked)
+		{
+			message.m_acked = true;
+			m_queuedBytes -= message.m_end-message.m_begin;
+		}
+	}
 
-	if (SDLNet_UDP_Send(m_socket, 0, &p) != 1)	//should have been sent to ONE place only
-		throw error::net((string)"Could not send data, SDL_Net error: " + SDLNet_GetError());
+	while (!m_reliable.empty() && m_reliable.front().m_acked)
+		m_reliable.pop_front();
 }
 
-uint CSocketUDP::recv(void *data, int maxlen)
+void CConnectionUDP::received(Uint16 id, const uchar *data, uint nbytes)
 {
-	UDPpacket p;	//ugly again
-	memset(&p, 0, sizeof(p));
-	//commented assignments are unneeded
-	//p.channel	= 0;
-	p.data		= reinterpret_cast<Uint8*>(data);
-	p.len		= maxlen;
-	p.maxlen	= maxlen;
-	p.status	= -1;
-	//p.address	= *getAddress().getIPPointer();
+	// the peer only sends ids within its window, older ones are duplicates
+	uint ahead = Uint16(id - Uint16(m_nextReceiveId));
+	if (ahead >= SEND_WINDOW)
+		return;
+
+	if (ahead != 0)
+	{
+		m_outOfOrder.insert(make_pair(m_nextReceiveId+ahead, vectorPOD<uchar>(data, data+nbytes)));
+		return;
+	}
 
-	int ret = SDLNet_UDP_Recv(m_socket, &p);
-	if (ret == 1)
-		return p.len;
-	else if (ret == 0)
+	m_received.push_back(vectorPOD<uchar>(data, data+nbytes));
+	++m_nextReceiveId;
+
+	// and the ones that were waiting for it
+	while (!m_outOfOrder.empty() && m_outOfOrder.begin()->first == m_nextReceiveId)
+	{
+		m_received.push_back(vectorPOD<uchar>());
+		m_received.back().swap(m_outOfOrder.begin()->second);
+		m_outOfOrder.erase(m_outOfOrder.begin());
+		++m_nextReceiveId;
+	}
+}
+
+uint CConnectionUDP::recv(void *data, uint maxlen)
+{
+	if (m_received.empty())
 		return 0;
 
-	throw error::net_recv((string)"Could not receive packet, SDL_Net error: " + SDLNet_GetError());
+	const vectorPOD<uchar>& message = m_received.front();
+	uint howMuch = std::min(maxlen, static_cast<uint>(message.size()));
+	if (howMuch != 0)
+		memcpy(data, &message[0], howMuch);
+	m_received.pop_front();
+
+	return howMuch;
 }
 
-bool CSocketUDP::recv(CPacket& packet)
+bool CConnectionUDP::recv(CPacket& packet)
 {
-	Uint32 size;
-	if (recv(&size, sizeof(size)) != sizeof(size))
+	packet.clear();
+	if (m_received.empty())
 		return false;
-	packet.allocate(size);
-	if (recv(packet.getDataPtr(), size) != size)
-		throw error::net((string)"Could only receive packet-size, but no data... BUFFER UDP AS WELL AS TCP!!1, SDL_Net error: " + SDLNet_GetError());
+
+	const vectorPOD<uchar>& message = m_received.front();
+	packet.resize(message.size());
+	if (!message.empty())
+		memcpy(packet.getDataPtr(), &message[0], message.size());
+	m_received.pop_front();
+
 	return true;
 }
 
-
-bool CSocketUDP::ready()
+bool CConnectionUDP::recvView(CPacket& packet)
 {
-	return (SDLNet_SocketReady(m_socket)!=0);
+	packet.clear();
+	if (m_received.empty())
+		return false;
+
+	m_view.swap(m_received.front());
+	m_received.pop_front();
+	packet.view(m_view.empty() ? 0 : &m_view[0], m_view.size());
+
+	return true;
 }
 
-*/
+bool CConnectionUDP::hasPacket() const
+{
+	return !m_received.empty();
+}
@@ -0,0 +1,283 @@
+#include "milk/includes.h"
+#include "milk/parallel.h"
+#include <deque>
+#ifndef WIN32
+#	include <pthread.h>
+#endif
+using namespace milk;
+using namespace std;
+
+uint milk::numProcessors()
+{
+	static uint processors = 0;
+	if(!processors)
+	{
+#ifdef WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		processors = uint(info.dwNumberOfProcessors);
+#else
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		processors = n > 0 ? uint(n) : 1;
+#endif
+		if(!processors)
+			processors = 1;
+	}
+	return processors;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+class CWorkerPool::CState
+{
+public:
+	CState()
+		: m_stop(false)
+	{
+#ifdef WIN32
+		InitializeCriticalSection(&m_lock);
+		initCondition(m_work);
+		initCondition(m_done);
+#else
+		pthread_mutex_init(&m_lock, 0);
+		pthread_cond_init(&m_work, 0);
+		pthread_cond_init(&m_done, 0);
+#endif
+	}
+
+	class CLock
+	{
+	public:
+		CLock(CState& state)
+			: m_state(state)
+		{ m_state.lock(); }
+
+		~CLock()
+		{ m_state.unlock(); }
+
+	private:
+		CState& m_state;
+	};
+
+	~CState()
+	{
+#ifdef WIN32
+		CloseHandle(m_done.m_event);
+		CloseHandle(m_work.m_event);
+		DeleteCriticalSection(&m_lock);
+#else
+		pthread_cond_destroy(&m_done);
+		pthread_cond_destroy(&m_work);
+		pthread_mutex_destroy(&m_lock);
+#endif
+	}
+
+	void lock()
+	{
+#ifdef WIN32
+		EnterCriticalSection(&m_lock);
+#else
+		pthread_mutex_lock(&m_lock);
+#endif
+	}
+
+	void unlock()
+	{
+#ifdef WIN32
+		LeaveCriticalSection(&m_lock);
+#else
+		pthread_mutex_unlock(&m_lock);
+#endif
+	}
+
+#ifdef WIN32
+	/*	condition variables are Vista and later, so a manual reset event
+		is kept set until the waiters that were woken have seen it */
+	class condition_type
+	{
+	public:
+		HANDLE m_event;
+		// threads sleeping, and how many of them are let through
+		int m_waiters, m_released;
+		// woken waiters only leave if they slept before the wake up
+		uint m_generation;
+	};
+
+	static void initCondition(condition_type& condition)
+	{
+		condition.m_event = CreateEvent(0, TRUE, FALSE, 0);
+		condition.m_waiters = condition.m_released = 0;
+		condition.m_generation = 0;
+	}
+
+	void sleep(condition_type& condition)
+	{
+		++condition.m_waiters;
+		uint generation = condition.m_generation;
+		for(;;)
+		{
+			LeaveCriticalSection(&m_lock);
+			WaitForSingleObject(condition.m_event, INFINITE);
+			EnterCriticalSection(&m_lock);
+			if(condition.m_released > 0 && condition.m_generation != generation)
+				break;
+		}
+		--condition.m_waiters;
+		if(--condition.m_released == 0)
+			ResetEvent(condition.m_event);
+	}
+
+	void wakeOne(condition_type& condition)
+	{
+		if(condition.m_waiters <= condition.m_released)
+			return;
+		++condition.m_released;
+		++condition.m_generation;
+		SetEvent(condition.m_event);
+	}
+
+	void wakeAll(condition_type& condition)
+	{
+		if(condition.m_waiters <= condition.m_released)
+			return;
+		condition.m_released = condition.m_waiters;
+		++condition.m_generation;
+		SetEvent(condition.m_event);
+	}
+#else
+	typedef pthread_cond_t condition_type;
+
+	void sleep(condition_type& condition)
+	{ pthread_cond_wait(&condition, &m_lock); }
+
+	void wakeOne(condition_type& condition)
+	{ pthread_cond_signal(&condition); }
+
+	void wakeAll(condition_type& condition)
+	{ pthread_cond_broadcast(&condition); }
+#endif
+
+#ifdef WIN32
+	CRITICAL_SECTION m_lock;
+#else
+	pthread_mutex_t m_lock;
+#endif
+	// Signalled when a task is queued or the pool stops
+	condition_type m_work;
+	// Signalled when a task is done
+	condition_type m_done;
+	deque<CWorkerTask*> m_queue;
+	bool m_stop;
+};
+
+CWorkerPool::CWorkerPool(uint numThreads)
+	: m_pState(new CState)
+{
+	if(!numThreads)
+		numThreads = numProcessors() - 1;
+
+	for(uint i = 0; i < numThreads; ++i)
+	{
+		m_threads.push_back(new CThread(function_member(*this, &CWorkerPool::work)));
+		m_threads.back()->start();
+	}
+}
+
+CWorkerPool::~CWorkerPool()
+{
+	{
+		CState::CLock lock(*m_pState);
+		m_pState->m_stop = true;
+		m_pState->wakeAll(m_pState->m_work);
+	}
+
+	// Queued tasks are still run before the workers stop
+	for(size_t i = 0; i < m_threads.size(); ++i)
+	{
+		m_threads[i]->wait();
+		delete m_threads[i];
+	}
+	m_threads.clear();
+	delete m_pState;
+}
+
+void CWorkerPool::submit(CWorkerTask& task)
+{
+	CState::CLock lock(*m_pState);
+	BOOST_ASSERT(task.m_state == CWorkerTask::IDLE);
+	task.m_state = CWorkerTask::QUEUED;
+	task.m_failed = false;
+	m_pState->m_queue.push_back(&task);
+	m_pState->wakeOne(m_pState->m_work);
+}
+
+void CWorkerPool::wait(CWorkerTask& task)
+{
+	CState::CLock lock(*m_pState);
+	BOOST_ASSERT(task.m_state != CWorkerTask::IDLE);
+
+	if(task.m_state == CWorkerTask::QUEUED)
+	{
+		// Nobody has started it, faster to run it here than to wait for a worker
+		m_pState->m_queue.erase(find(m_pState->m_queue.begin(), m_pState->m_queue.end(), &task));
+		task.m_state = CWorkerTask::RUNNING;
+		m_pState->unlock();
+		try
+		{
+			task.run();
+		}
+		catch(...)
+		{
+			m_pState->lock();
+			task.m_state = CWorkerTask::IDLE;
+			throw;
+		}
+		m_pState->lock();
+		task.m_state = CWorkerTask::DONE;
+	}
+
+	while(task.m_state != CWorkerTask::DONE)
+		m_pState->sleep(m_pState->m_done);
+
+	task.m_state = CWorkerTask::IDLE;
+	if(task.m_failed)
+		throw error::milk("CWorkerPool::wait - Error, task failed on a worker thread");
+}
+
+void CWorkerPool::work()
+{
+	CState::CLock lock(*m_pState);
+	for(;;)
+	{
+		while(m_pState->m_queue.empty() && !m_pState->m_stop)
+			m_pState->sleep(m_pState->m_work);
+		if(m_pState->m_queue.empty())
+			return;
+
+		CWorkerTask& task = *m_pState->m_queue.front();
+		m_pState->m_queue.pop_front();
+		task.m_state = CWorkerTask::RUNNING;
+
+		m_pState->unlock();
+		bool failed = false;
+		try
+		{
+			task.run();
+		}
+		catch(...)
+		{
+			failed = true;
+		}
+		m_pState->lock();
+
+		task.m_failed = failed;
+		task.m_state = CWorkerTask::DONE;
+		m_pState->wakeAll(m_pState->m_done);
+	}
+}
+
+CWorkerPool& CWorkerPool::instance()
+{
+	static CWorkerPool pool;
+	return pool;
+}
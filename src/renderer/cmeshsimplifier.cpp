@@ -0,0 +1,261 @@
+#include <map>
+#include <algorithm>
+#include "milk/renderer/cmeshsimplifier.h"
+using namespace milk;
+using namespace std;
+
+namespace
+{
+	struct PositionLess
+	{
+		bool operator()(const CVector3f& a, const CVector3f& b) const
+		{
+			if(a.x != b.x) return a.x < b.x;
+			if(a.y != b.y) return a.y < b.y;
+			return a.z < b.z;
+		}
+	};
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+CMeshSimplifier::CQuadric::CQuadric()
+{
+	for(int i = 0; i < 10; ++i)
+		a[i] = 0.0;
+}
+
+void CMeshSimplifier::CQuadric::addPlane(const CVector3f& n, float d, float weight)
+{
+	a[0] += weight * n.x * n.x;	a[1] += weight * n.x * n.y;	a[2] += weight * n.x * n.z;	a[3] += weight * n.x * d;
+								a[4] += weight * n.y * n.y;	a[5] += weight * n.y * n.z;	a[6] += weight * n.y * d;
+															a[7] += weight * n.z * n.z;	a[8] += weight * n.z * d;
+																						a[9] += weight * d * d;
+}
+
+CMeshSimplifier::CQuadric& CMeshSimplifier::CQuadric::operator+=(const CQuadric& rhs)
+{
+	for(int i = 0; i < 10; ++i)
+		a[i] += rhs.a[i];
+	return *this;
+}
+
+double CMeshSimplifier::CQuadric::error(const CVector3f& p) const
+{
+	double x = p.x, y = p.y, z = p.z;
+	return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+		 + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+		 + a[7]*z*z + 2*a[8]*z
+		 + a[9];
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+CMeshSimplifier::CMeshSimplifier(const vector<CVector3f>& positions, const vector<uint>& indices)
+: m_positions(positions), m_indices(indices),
+  m_triangleRemoved(indices.size() / 3, false), m_numTriangles(indices.size() / 3),
+  m_vertexTriangles(positions.size()), m_quadrics(positions.size()),
+  m_locked(positions.size(), false), m_removed(positions.size(), false), m_version(positions.size(), 0)
+{
+	// Lock vertices sharing position with another vertex (seams)
+	map<CVector3f, uint, PositionLess> firstAt;
+	for(uint i = 0; i < m_positions.size(); ++i)
+	{
+		pair<map<CVector3f, uint, PositionLess>::iterator, bool> res = firstAt.insert(make_pair(m_positions[i], i));
+		if(!res.second)
+			m_locked[i] = m_locked[res.first->second] = true;
+	}
+
+	// Lock border vertices, ie. edges used by one triangle only
+	map<pair<uint, uint>, int> edgeCount;
+	for(size_t t = 0; t < m_numTriangles; ++t)
+	{
+		for(int e = 0; e < 3; ++e)
+		{
+			uint a = m_indices[t*3 + e], b = m_indices[t*3 + (e+1)%3];
+			++edgeCount[make_pair(min(a,b), max(a,b))];
+		}
+	}
+	for(map<pair<uint, uint>, int>::iterator it = edgeCount.begin(); it != edgeCount.end(); ++it)
+		if(it->second == 1)
+			m_locked[it->first.first] = m_locked[it->first.second] = true;
+
+	// Adjacency and quadrics
+	for(size_t t = 0; t < m_numTriangles; ++t)
+	{
+		uint i0 = m_indices[t*3], i1 = m_indices[t*3+1], i2 = m_indices[t*3+2];
+		if(i0 == i1 || i0 == i2 || i1 == i2)
+		{
+			m_triangleRemoved[t] = true;
+			continue;
+		}
+
+		m_vertexTriangles[i0].push_back(uint(t));
+		m_vertexTriangles[i1].push_back(uint(t));
+		m_vertexTriangles[i2].push_back(uint(t));
+
+		CVector3f n = cross(m_positions[i1] - m_positions[i0], m_positions[i2] - m_positions[i0]);
+		float area2 = n.abs();
+		if(area2 <= 0.0f)
+			continue;
+		n *= 1.0f / area2;
+		float d = -dot(n, m_positions[i0]);
+		m_quadrics[i0].addPlane(n, d, area2);
+		m_quadrics[i1].addPlane(n, d, area2);
+		m_quadrics[i2].addPlane(n, d, area2);
+	}
+
+	// Degenerate triangles are not counted
+	m_numTriangles = count(m_triangleRemoved.begin(), m_triangleRemoved.end(), false);
+
+	for(uint i = 0; i < m_positions.size(); ++i)
+		addCollapses(i);
+}
+
+void CMeshSimplifier::neighbours(uint vertex, vector<uint>& result) const
+{
+	result.clear();
+	const vector<uint>& tris = m_vertexTriangles[vertex];
+	for(vector<uint>::const_iterator it = tris.begin(); it != tris.end(); ++it)
+	{
+		if(m_triangleRemoved[*it])
+			continue;
+		for(int i = 0; i < 3; ++i)
+		{
+			uint v = m_indices[*it*3 + i];
+			if(v != vertex)
+				result.push_back(v);
+		}
+	}
+	sort(result.begin(), result.end());
+	result.erase(unique(result.begin(), result.end()), result.end());
+}
+
+void CMeshSimplifier::addCollapse(uint from, uint to)
+{
+	if(m_locked[from])
+		return;
+	CQuadric q = m_quadrics[from];
+	q += m_quadrics[to];
+	m_queue.push(CCollapse(float(q.error(m_positions[to])), from, to, m_version[from], m_version[to]));
+}
+
+void CMeshSimplifier::addCollapses(uint vertex)
+{
+	if(m_removed[vertex])
+		return;
+	vector<uint> n;
+	neighbours(vertex, n);
+	for(vector<uint>::iterator it = n.begin(); it != n.end(); ++it)
+	{
+		addCollapse(vertex, *it);
+		addCollapse(*it, vertex);
+	}
+}
+
+bool CMeshSimplifier::canCollapse(uint from, uint to) const
+{
+	// Link condition, the only shared neighbours may be the ones of the
+	// triangles on the edge, otherwise the surface would fold onto itself
+	vector<uint> nf, nt, shared;
+	neighbours(from, nf);
+	neighbours(to, nt);
+	set_intersection(nf.begin(), nf.end(), nt.begin(), nt.end(), back_inserter(shared));
+
+	size_t edgeTriangles = 0;
+	const vector<uint>& tris = m_vertexTriangles[from];
+	for(vector<uint>::const_iterator it = tris.begin(); it != tris.end(); ++it)
+	{
+		if(m_triangleRemoved[*it])
+			continue;
+
+		const uint *tri = &m_indices[*it*3];
+		if(tri[0] == to || tri[1] == to || tri[2] == to)
+		{
+			++edgeTriangles;
+			continue;
+		}
+
+		// Reject collapses flipping or squashing a remaining triangle
+		CVector3f p[3], q[3];
+		for(int i = 0; i < 3; ++i)
+		{
+			p[i] = m_positions[tri[i]];
+			q[i] = m_positions[tri[i] == from ? to : tri[i]];
+		}
+		CVector3f n0 = cross(p[1] - p[0], p[2] - p[0]);
+		CVector3f n1 = cross(q[1] - q[0], q[2] - q[0]);
+		float l0 = n0.abs(), l1 = n1.abs();
+		if(l1 <= 0.0f || dot(n0, n1) < 0.2f * l0 * l1)
+			return false;
+	}
+
+	return shared.size() <= edgeTriangles;
+}
+
+void CMeshSimplifier::collapse(uint from, uint to)
+{
+	vector<uint>& fromTris = m_vertexTriangles[from];
+	vector<uint>& toTris = m_vertexTriangles[to];
+	for(vector<uint>::iterator it = fromTris.begin(); it != fromTris.end(); ++it)
+	{
+		if(m_triangleRemoved[*it])
+			continue;
+
+		uint *tri = &m_indices[*it*3];
+		if(tri[0] == to || tri[1] == to || tri[2] == to)
+		{
+			m_triangleRemoved[*it] = true;
+			--m_numTriangles;
+			continue;
+		}
+
+		for(int i = 0; i < 3; ++i)
+			if(tri[i] == from)
+				tri[i] = to;
+		toTris.push_back(*it);
+	}
+	fromTris.clear();
+
+	// Drop removed triangles from the target
+	vector<uint> live;
+	for(vector<uint>::iterator it = toTris.begin(); it != toTris.end(); ++it)
+		if(!m_triangleRemoved[*it])
+			live.push_back(*it);
+	toTris.swap(live);
+
+	m_quadrics[to] += m_quadrics[from];
+	m_removed[from] = true;
+	++m_version[from];
+	++m_version[to];
+
+	addCollapses(to);
+}
+
+void CMeshSimplifier::simplify(size_t numTriangles)
+{
+	while(m_numTriangles > numTriangles && !m_queue.empty())
+	{
+		CCollapse c = m_queue.top();
+		m_queue.pop();
+
+		// Outdated?
+		if(m_removed[c.m_from] || m_removed[c.m_to] ||
+		   m_version[c.m_from] != c.m_fromVersion || m_version[c.m_to] != c.m_toVersion)
+			continue;
+
+		if(!canCollapse(c.m_from, c.m_to))
+			continue;
+
+		collapse(c.m_from, c.m_to);
+	}
+}
+
+void CMeshSimplifier::getIndices(vector<uint>& indices) const
+{
+	indices.clear();
+	indices.reserve(m_numTriangles * 3);
+	for(size_t t = 0; t < m_triangleRemoved.size(); ++t)
+		if(!m_triangleRemoved[t])
+			indices.insert(indices.end(), &m_indices[t*3], &m_indices[t*3] + 3);
+}
@@ -2,7 +2,9 @@
 #include "milk/cimage.h"
 #include "milk/renderer/ivertexbuffernormal.h"
 #include "milk/scenegraph/ccamera.h"
+#include "milk/parallel.h"
 #include <limits>
+#include <cmath>
 using namespace milk;
 using namespace milk::milkModelFile;
 using namespace std;
@@ -24,11 +26,12 @@ struct MMFHeader
 } MILK_PACK_STRUCT;
 #include "milk/pack8disable.h"
 
+// Sort weights by descending influence
 struct Wee
 {
 	bool operator()(const weight& a, const weight& b)
 	{
-		return a.first > b.first;
+		return a.second > b.second;
 	}
 };
 
@@ -82,6 +85,213 @@ static void freadvector(FILE *fp, vector<T>& v, uint num)
 
 //////////////////////////////////////////////////////////////////////////
 
+static bool sameWeights(const weightList& a, const weightList& b)
+{
+	if(a.size() != b.size())
+		return false;
+	for(size_t i = 0; i < a.size(); ++i)
+		if(a[i].first != b[i].first || math::abs(a[i].second - b[i].second) > 1e-4f)
+			return false;
+	return true;
+}
+
+// Merge vertices with (nearly) the same position, normal, texture coordinate
+// and weights, and remap the indices. Candidates are found through a hash
+// grid over the positions with cells of the position tolerance, so only the
+// 27 cells around a vertex need to be searched.
+static void weldVertices(vector<CSkinnedVertex>& vertices, vector<CVector2f>& texCoords, vector<ushort>& indices)
+{
+	if(vertices.empty())
+		return;
+
+	// Tolerances, position relative to the size of the mesh
+	float extent = 0.0f;
+	for(vector<CSkinnedVertex>::const_iterator it = vertices.begin(); it != vertices.end(); ++it)
+		extent = max(extent, max(math::abs(it->p.x), max(math::abs(it->p.y), math::abs(it->p.z))));
+	const float cellSize = max(extent * 1e-5f, 1e-7f);
+	const float normalTolerance = 1e-3f;
+	const float texCoordTolerance = 1e-5f;
+
+	size_t numBuckets = 1;
+	while(numBuckets < vertices.size() * 2)
+		numBuckets <<= 1;
+	vector<int> buckets(numBuckets, -1);
+	vector<int> next;
+
+	vector<CSkinnedVertex> welded;
+	vector<CVector2f> weldedTexCoords;
+	vector<ushort> remap(vertices.size());
+	welded.reserve(vertices.size());
+	weldedTexCoords.reserve(vertices.size());
+	next.reserve(vertices.size());
+
+	for(size_t v = 0; v < vertices.size(); ++v)
+	{
+		const CSkinnedVertex& vertex = vertices[v];
+		int cx = int(floor(vertex.p.x / cellSize));
+		int cy = int(floor(vertex.p.y / cellSize));
+		int cz = int(floor(vertex.p.z / cellSize));
+
+		int match = -1;
+		for(int dx = -1; dx <= 1 && match < 0; ++dx)
+		for(int dy = -1; dy <= 1 && match < 0; ++dy)
+		for(int dz = -1; dz <= 1 && match < 0; ++dz)
+		{
+			uint hash = (uint(cx+dx) * 73856093u ^ uint(cy+dy) * 19349663u ^ uint(cz+dz) * 83492791u) & uint(numBuckets-1);
+			for(int u = buckets[hash]; u >= 0; u = next[u])
+			{
+				const CSkinnedVertex& other = welded[u];
+				if(math::abs(vertex.p.x - other.p.x) <= cellSize &&
+				   math::abs(vertex.p.y - other.p.y) <= cellSize &&
+				   math::abs(vertex.p.z - other.p.z) <= cellSize &&
+				   (vertex.n - other.n).abs2() <= normalTolerance * normalTolerance &&
+				   (texCoords[v] - weldedTexCoords[u]).abs2() <= texCoordTolerance * texCoordTolerance &&
+				   sameWeights(vertex.weights, other.weights))
+				{
+					match = u;
+					break;
+				}
+			}
+		}
+
+		if(match < 0)
+		{
+			match = int(welded.size());
+			welded.push_back(vertex);
+			weldedTexCoords.push_back(texCoords[v]);
+
+			uint hash = (uint(cx) * 73856093u ^ uint(cy) * 19349663u ^ uint(cz) * 83492791u) & uint(numBuckets-1);
+			next.push_back(buckets[hash]);
+			buckets[hash] = match;
+		}
+		remap[v] = ushort(match);
+	}
+
+	for(vector<ushort>::iterator it = indices.begin(); it != indices.end(); ++it)
+		*it = remap[*it];
+	vertices.swap(welded);
+	texCoords.swap(weldedTexCoords);
+}
+
+// Tangent generation, first a tangent direction per triangle, then the sum
+// over the triangles of every vertex. Both passes only write their own items,
+// so they are split over worker threads.
+class CTriangleTangents
+{
+public:
+	CTriangleTangents(const vector<CSkinnedVertex>& vertices, const vector<CVector2f>& texCoords,
+					  const vector<uint>& triangles, vector<CVector3f>& result)
+		: m_vertices(vertices), m_texCoords(texCoords), m_triangles(triangles), m_result(result)
+	{ }
+
+	void operator()(size_t begin, size_t end)
+	{
+		for(size_t t = begin; t < end; ++t)
+		{
+			uint i0 = m_triangles[t*3], i1 = m_triangles[t*3+1], i2 = m_triangles[t*3+2];
+
+			CVector3f e1 = m_vertices[i1].p - m_vertices[i0].p;
+			CVector3f e2 = m_vertices[i2].p - m_vertices[i0].p;
+			CVector2f w1 = m_texCoords[i1] - m_texCoords[i0];
+			CVector2f w2 = m_texCoords[i2] - m_texCoords[i0];
+
+			float det = w1.x * w2.y - w2.x * w1.y;
+			if(det == 0.0f)
+				m_result[t] = CVector3f(0.0f, 0.0f, 0.0f);
+			else
+				m_result[t] = (e1 * w2.y - e2 * w1.y) * (1.0f / det);
+		}
+	}
+
+private:
+	const vector<CSkinnedVertex>& m_vertices;
+	const vector<CVector2f>& m_texCoords;
+	const vector<uint>& m_triangles;
+	vector<CVector3f>& m_result;
+};
+
+class CVertexTangents
+{
+public:
+	CVertexTangents(const vector<CSkinnedVertex>& vertices, const vector<uint>& offsets, const vector<uint>& vertexTriangles,
+					const vector<CVector3f>& triangleTangents, vector<CVector3f>& tangents, vector<CVector3f>& bitangents)
+		: m_vertices(vertices), m_offsets(offsets), m_vertexTriangles(vertexTriangles),
+		  m_triangleTangents(triangleTangents), m_tangents(tangents), m_bitangents(bitangents)
+	{ }
+
+	void operator()(size_t begin, size_t end)
+	{
+		for(size_t v = begin; v < end; ++v)
+		{
+			CVector3f t(0.0f, 0.0f, 0.0f);
+			for(uint i = m_offsets[v]; i < m_offsets[v+1]; ++i)
+				t += m_triangleTangents[m_vertexTriangles[i]];
+
+			// Gram-Schmidt orthogonalize
+			const CVector3f& n = m_vertices[v].n;
+			CVector3f tangent = t - n * dot(n, t);
+			if(tangent.abs2() < 1e-12f)
+			{
+				// No usable texture mapping, any direction on the surface will do
+				tangent = cross(n, math::abs(n.x) < 0.9f ? CVector3f(1.0f, 0.0f, 0.0f) : CVector3f(0.0f, 1.0f, 0.0f));
+			}
+			tangent.normalize();
+
+			m_tangents[v] = tangent;
+			m_bitangents[v] = cross(n, tangent);
+		}
+	}
+
+private:
+	const vector<CSkinnedVertex>& m_vertices;
+	const vector<uint>& m_offsets;
+	const vector<uint>& m_vertexTriangles;
+	const vector<CVector3f>& m_triangleTangents;
+	vector<CVector3f>& m_tangents;
+	vector<CVector3f>& m_bitangents;
+};
+
+static void generateTangents(const vector<CSkinnedVertex>& vertices, const vector<CVector2f>& texCoords,
+							 const vector<ushort>& indices, bool strip,
+							 vector<CVector3f>& tangents, vector<CVector3f>& bitangents)
+{
+	// Triangle list without degenerates
+	vector<uint> triangles;
+	uint step = strip ? 1 : 3;
+	for(size_t i = 2; i < indices.size(); i += step)
+	{
+		uint i0 = indices[i-2], i1 = indices[i-1], i2 = indices[i];
+		if(i0 == i1 || i0 == i2 || i1 == i2)
+			continue;
+		triangles.push_back(i0);
+		triangles.push_back(i1);
+		triangles.push_back(i2);
+	}
+	size_t numTriangles = triangles.size() / 3;
+
+	vector<CVector3f> triangleTangents(numTriangles);
+	CTriangleTangents triangleBody(vertices, texCoords, triangles, triangleTangents);
+	parallelFor(numTriangles, triangleBody, 4096);
+
+	// Triangles of each vertex, offsets[v] to offsets[v+1] in vertexTriangles
+	vector<uint> offsets(vertices.size() + 1, 0);
+	for(vector<uint>::const_iterator it = triangles.begin(); it != triangles.end(); ++it)
+		++offsets[*it + 1];
+	for(size_t v = 0; v < vertices.size(); ++v)
+		offsets[v+1] += offsets[v];
+	vector<uint> fill(offsets.begin(), offsets.end() - 1);
+	vector<uint> vertexTriangles(triangles.size());
+	for(size_t i = 0; i < triangles.size(); ++i)
+		vertexTriangles[fill[triangles[i]]++] = uint(i / 3);
+
+	tangents.resize(vertices.size());
+	bitangents.resize(vertices.size());
+	CVertexTangents vertexBody(vertices, offsets, vertexTriangles, triangleTangents, tangents, bitangents);
+	parallelFor(vertices.size(), vertexBody, 4096);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 float CComponent::getValue(float frame) const
 {
 	if(!m_keyframes.size())
@@ -132,6 +342,9 @@ bool CModel::load(string filename)
 {
 	unload();
 
+	CTimer loadTimer;
+	m_loadStats = CLoadStats();
+
 	FILE *inputFile = fopen(filename.c_str(), "rb");
 	if(!inputFile)
 		throw error::file_not_found("Could not find file \""+filename+"\".");
@@ -297,6 +510,45 @@ bool CModel::load(string filename)
 
 		vector<CSkinnedVertex>& vertices = mesh.m_skinnedVertices;
 		vertices.resize(numVertices);
+		vector<CVector2f> texCoords(numVertices);
+		for(uint v = 0; v < numVertices; ++v)
+		{
+			CSkinnedVertex& vertex = vertices[v];
+			vertex.p = freadtype<CVector3f>(inputFile);
+			vertex.n = freadtype<CVector3f>(inputFile);
+			texCoords[v] = freadtype<CVector2f>(inputFile);
+			uchar numWeights = freadtype<uchar>(inputFile);
+			for(int w = 0; w < numWeights; ++w)
+			{
+				char index = freadtype<char>(inputFile);
+				float weight = freadtype<float>(inputFile);
+				vertex.weights.push_back(make_pair<int,float>(index, weight));
+			}
+		}
+
+		// Load indices
+		if(header.version == 2)
+			lists = freadtype<uchar>(inputFile);
+		uint indexFormat = freadtype<ulong>(inputFile);
+		uint numIndices = freadtype<ulong>(inputFile);
+
+		mesh.m_renderMode = lists ? GL_TRIANGLES : GL_TRIANGLE_STRIP;
+
+		vector<ushort> indices;
+		if(numIndices)
+			freadvector<ushort>(inputFile, indices, numIndices);
+		else
+		{
+			indices.resize(numVertices);
+			for(uint v = 0; v < numVertices; ++v)
+				indices[v] = ushort(v);
+		}
+
+		// Merge duplicated vertices
+		m_loadStats.verticesRead += vertices.size();
+		weldVertices(vertices, texCoords, indices);
+		m_loadStats.verticesWelded += vertices.size();
+		numVertices = uint(vertices.size());
 
 		CAppearance *pMat = m_materials[mesh.m_materialIndex];
 		bool skinning = pMat && header.numBones;
@@ -311,12 +563,12 @@ bool CModel::load(string filename)
 		{
 			CProgramObject& po = *pMat->getPass(0).getProgramObject();
 
-			for(uint i = 0; i < header.numBones; ++i)
-				m_boneSources[i]->setSkinMatrixUniform(po.getUniform<CMatrix4f>("skinMatrices["+toStr(i)+"]"));
+			// The whole palette is uploaded at once, starting at the first element
+			mesh.m_paletteUniform = po.getUniform<CMatrix4f>("skinMatrices[0]");
 
 			mesh.m_hwSkinning = true;
-			skinIndicesAttrib = vf.addShaderAttrib(po.getAttrib<CVector3f>("skinIndices"));
-			skinWeightsAttrib = vf.addShaderAttrib(po.getAttrib<CVector2f>("skinWeights"));
+			skinIndicesAttrib = vf.addShaderAttrib(po.getAttrib<CColor4ub>("skinIndices"));
+			skinWeightsAttrib = vf.addShaderAttrib(po.getAttrib<CVector4f>("skinWeights"));
 		}
 
 		bool tangent = true && pMat;
@@ -339,284 +591,81 @@ bool CModel::load(string filename)
 		mesh.m_pVertexBuffer->lock();
 		{
 			vector<CSkinnedVertex>::iterator it = vertices.begin();
+			vector<CVector2f>::iterator uvit = texCoords.begin();
 			CDataContainer<CVector3f>::iterator vit = mesh.m_pVertexBuffer->getVertices3f().begin();
 			CDataContainer<CVector3f>::iterator nit = mesh.m_pVertexBuffer->getNormals3f().begin();
 			CDataContainer<CVector2f>::iterator tit = mesh.m_pVertexBuffer->getTexCoords2f(0).begin();
-			for(; it != vertices.end(); ++it, ++vit, ++nit, ++tit)
+			for(; it != vertices.end(); ++it, ++uvit, ++vit, ++nit, ++tit)
 			{
-				// read from file
-				it->p = freadtype<CVector3f>(inputFile);
-				it->n = freadtype<CVector3f>(inputFile);
-				CVector2f uv = freadtype<CVector2f>(inputFile);
-				uchar numWeights = freadtype<uchar>(inputFile);
-				for(int i = 0; i < numWeights; ++i)
-				{
-					char index = freadtype<char>(inputFile);
-					float w = freadtype<float>(inputFile);
-					it->weights.push_back(make_pair<int,float>(index,w));
-				}
-				// put into vertexbuffer...
 				*vit = it->p;
 				*nit = it->n;
-				*tit = uv;
+				*tit = *uvit;
 			}
 			BOOST_ASSERT(vit == mesh.m_pVertexBuffer->getVertices3f().end());
 
 			if(skinning)
 			{
 				it = vertices.begin();
-				CDataContainer<CVector3f>::iterator siit = mesh.m_pVertexBuffer->getAttrib3f(skinIndicesAttrib).begin();
-				CDataContainer<CVector2f>::iterator swit = mesh.m_pVertexBuffer->getAttrib2f(skinWeightsAttrib).begin();
+				CDataContainer<CColor4ub>::iterator siit = mesh.m_pVertexBuffer->getAttrib4ub(skinIndicesAttrib).begin();
+				CDataContainer<CVector4f>::iterator swit = mesh.m_pVertexBuffer->getAttrib4f(skinWeightsAttrib).begin();
 				for(; it != vertices.end(); ++it, ++siit, ++swit)
 				{
-					int numWeights = it->weights.size();
-					if(numWeights == 0)
-					{
-						// FIXME: hmm?
-						siit->set(0.0f, 0.0f, 0.0f);
-						swit->set(1.0f, 0.0f);
-					}
-					else if(numWeights == 1)
-					{
-						siit->set(float(it->weights[0].first)+0.5f, 0.0f, 0.0f);
-						swit->set(it->weights[0].second, 0.0f);
-					}
-					else if(numWeights == 2)
+					// Keep the four strongest influences, weights summing to one
+					uchar indices[4] = { 0, 0, 0, 0 };
+					float weights[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+					sort(it->weights.begin(), it->weights.end(), Wee());
+					size_t numWeights = min<size_t>(it->weights.size(), 4);
+					float total = 0.0f;
+					for(size_t w = 0; w < numWeights; ++w)
 					{
-						siit->set(float(it->weights[0].first)+0.5f, float(it->weights[1].first)+0.5f, 0.0f);
-						swit->set(it->weights[0].second, it->weights[1].second);
-					}
-					else if(numWeights == 3)
-					{
-						siit->set(float(it->weights[0].first)+0.5f, float(it->weights[1].first)+0.5f, float(it->weights[2].first)+0.5f);
-						swit->set(it->weights[0].second, it->weights[1].second);
+						BOOST_ASSERT(it->weights[w].first >= 0 && it->weights[w].first < 256);
+						indices[w] = uchar(it->weights[w].first);
+						weights[w] = it->weights[w].second;
+						total += weights[w];
 					}
+					if(total > 0.0f)
+						for(size_t w = 0; w < numWeights; ++w)
+							weights[w] /= total;
 					else
-					{
-						sort(it->weights.begin(), it->weights.end(), Wee());
-						CVector3f v(it->weights[0].second, it->weights[1].second, it->weights[2].second);
-						v.normalize();
-						siit->set(float(it->weights[0].first)+0.5f, float(it->weights[1].first)+0.5f, float(it->weights[2].first)+0.5f);
-						swit->set(v.x, v.y);
-					}
-				}
-			}
-			mesh.m_pVertexBuffer->unlock();
-		}
-
-		// Load indices
-		if(header.version == 2)
-			lists = freadtype<uchar>(inputFile);
-		uint indexFormat = freadtype<ulong>(inputFile);
-		uint numIndices = freadtype<ulong>(inputFile);
-
-		mesh.m_renderMode = lists ? GL_TRIANGLES : GL_TRIANGLE_STRIP;
+						weights[0] = 1.0f; // no influences, follow the first bone
 
-		if(numIndices)
-		{
-			vector<ushort> indices;
-			freadvector<ushort>(inputFile, indices, numIndices);
-
-			mesh.m_pIndexBuffer = IIndexBuffer::create(GL_UNSIGNED_SHORT, numIndices);
-			mesh.m_pIndexBuffer->lock();
-			{
-				vector<ushort>::const_iterator it = indices.begin();
-				ushort* iit = mesh.m_pIndexBuffer->getIndicesus();
-				for(; it != indices.end(); ++it, ++iit)
-					*iit = *it;
-			}
-			mesh.m_pIndexBuffer->unlock();
-		}
-
-		if(tangent && tangentAttrib != -1 && bitangentAttrib != -1)
-		{
-			/**/
-			mesh.m_pVertexBuffer->lock();
-			mesh.m_pIndexBuffer->lock(READ);
-
-			vector<CVector3f> tan1(mesh.m_pVertexBuffer->numVertices(), normalize(CVector3f(1.0f, 1.0f, 1.0f)));
-			vector<CVector3f> tan2(mesh.m_pVertexBuffer->numVertices(), normalize(CVector3f(1.0f, 1.0f, 1.0f)));
-
-			CDataContainer<CVector3f>::iterator vit = mesh.m_pVertexBuffer->getVertices3f().begin();
-			CDataContainer<CVector2f>::iterator tit = mesh.m_pVertexBuffer->getTexCoords2f(0).begin();
-
-			ushort* iit = mesh.m_pIndexBuffer->getIndicesus() + 2;
-			uint step = mesh.m_renderMode == GL_TRIANGLES ? 3 : 1;
-			for(uint i = 2; i < mesh.m_pIndexBuffer->numIndices(); iit+=step, i+=step)
-			{
-				uint i0 = *(iit-2), i1 = *(iit-1), i2 = *iit;
-
-				// degenerate?
-				if(i0 == i1 || i0 == i2 || i1 == i2)
-					continue;
-
-				const CVector3f& v1 = vit[i0];
-				const CVector3f& v2 = vit[i1];
-				const CVector3f& v3 = vit[i2];
-				const CVector2f& w1 = tit[i0];
-				const CVector2f& w2 = tit[i1];
-				const CVector2f& w3 = tit[i2];
-
-				float x1 = v2.x - v1.x;
-				float x2 = v3.x - v1.x;
-				float y1 = v2.y - v1.y;
-				float y2 = v3.y - v1.y;
-				float z1 = v2.z - v1.z;
-				float z2 = v3.z - v1.z;
-
-				float s1 = w2.x - w1.x;
-				float s2 = w3.x - w1.x;
-				float t1 = w2.y - w1.y;
-				float t2 = w3.y - w1.y;
-
-				float r = 1.0f / (s1 * t2 - s2 * t1);
-				CVector3f sdir((t2 * x1 - t1 * x2) * r, (t2 * y1 - t1 * y2) * r, (t2 * z1 - t1 * z2) * r);
-				CVector3f tdir((s1 * x2 - s2 * x1) * r, (s1 * y2 - s2 * y1) * r, (s1 * z2 - s2 * z1) * r);
-
-				tan1.at(i0) += sdir;
-				tan1.at(i1) += sdir;
-				tan1.at(i2) += sdir;
-
-				tan2.at(i0) += tdir;
-				tan2.at(i1) += tdir;
-				tan2.at(i2) += tdir;
+					*siit = CColor4ub(indices[0], indices[1], indices[2], indices[3]);
+					swit->set(weights[0], weights[1], weights[2], weights[3]);
+				}
 			}
-			mesh.m_pIndexBuffer->unlock();
 
-			CDataContainer<CVector3f>::iterator nit = mesh.m_pVertexBuffer->getNormals3f().begin();
-			CDataContainer<CVector3f>::iterator tait = mesh.m_pVertexBuffer->getAttrib3f(tangentAttrib).begin();
-			CDataContainer<CVector3f>::iterator btit = mesh.m_pVertexBuffer->getAttrib3f(bitangentAttrib).begin();
-			for(uint i = 0; i < mesh.m_pVertexBuffer->numVertices(); ++i, ++tait, ++btit, ++nit)
+			if(tangent && tangentAttrib != -1 && bitangentAttrib != -1)
 			{
-				CVector3f n = *nit;
-				CVector3f t = tan1[i];
-
-				// Gram-Schmidt orthogonalize
-				CVector3f tangent = normalize( t - n * dot(n, t) );
-				CVector3f bitangent = cross(n, tangent);
+				vector<CVector3f> tangents, bitangents;
+				generateTangents(vertices, texCoords, indices, mesh.m_renderMode == GL_TRIANGLE_STRIP, tangents, bitangents);
 
-				*tait = tangent;
-				*btit = bitangent;
-
-				// Calculate handedness
-				//tangent[i].w = (dot(cross(n, t), tan2[i]) < 0.0F) ? -1.0F : 1.0F;
-			}
-			BOOST_ASSERT(tait == mesh.m_pVertexBuffer->getAttrib3f(tangentAttrib).end());
-			mesh.m_pVertexBuffer->unlock();
-			/*/
-			IVertexBuffer *pVB = IVertexBuffer::create(mesh.m_pVertexBuffer->format(), (mesh.m_pIndexBuffer->numIndices()-2)*3);
-			pVB->lock();
-
-			mesh.m_pVertexBuffer->lock();
-			mesh.m_pIndexBuffer->lock(READ);
-
-			CDataContainer<CVector3f>::iterator nv = pVB->getVertices3f().begin();
-			CDataContainer<CVector2f>::iterator nt = pVB->getTexCoords2f(0).begin();
-			CDataContainer<CVector3f>::iterator nn = pVB->getNormals3f().begin();
-			CDataContainer<CVector3f>::iterator nta = pVB->getAttrib3f(tangentAttrib).begin();
-			CDataContainer<CVector3f>::iterator nbi = pVB->getAttrib3f(bitangentAttrib).begin();
-
-			CDataContainer<CVector3f>::iterator vit = mesh.m_pVertexBuffer->getVertices3f().begin();
-			CDataContainer<CVector2f>::iterator tit = mesh.m_pVertexBuffer->getTexCoords2f(0).begin();
-
-			ushort* iit = mesh.m_pIndexBuffer->getIndicesus() + 2;
-			uint step = mesh.m_renderMode == GL_TRIANGLES ? 3 : 1;
-			for(uint i = 2; i < mesh.m_pIndexBuffer->numIndices(); iit+=step, i+=step)
-			{
-				uint i0 = *(iit-2), i1 = *(iit-1), i2 = *iit;
-
-				// degenerate?
-				if(i0 == i1 || i0 == i2 || i1 == i2)
-					continue;
-
-				const CVector3f& v1 = vit[i0];
-				const CVector3f& v2 = vit[i1];
-				const CVector3f& v3 = vit[i2];
-				const CVector2f& w1 = tit[i0];
-				const CVector2f& w2 = tit[i1];
-				const CVector2f& w3 = tit[i2];
-
-				float x1 = v2.x - v1.x;
-				float x2 = v3.x - v1.x;
-				float y1 = v2.y - v1.y;
-				float y2 = v3.y - v1.y;
-				float z1 = v2.z - v1.z;
-				float z2 = v3.z - v1.z;
-
-				float s1 = w2.x - w1.x;
-				float s2 = w3.x - w1.x;
-				float t1 = w2.y - w1.y;
-				float t2 = w3.y - w1.y;
-
-				float r = 1.0f / (s1 * t2 - s2 * t1);
-				CVector3f sdir((t2 * x1 - t1 * x2) * r, (t2 * y1 - t1 * y2) * r, (t2 * z1 - t1 * z2) * r);
-				CVector3f tdir((s1 * x2 - s2 * x1) * r, (s1 * y2 - s2 * y1) * r, (s1 * z2 - s2 * z1) * r);
-
-				CVector3f n = normalize(cross(v2-v1, v3-v1));
-				CVector3f t = normalize(tdir - n * dot(n, tdir) );
-				CVector3f b = cross(n, t);
-
-				*nv++ = v1;
-				*nt++ = w1;
-				*nn++ = n;
-				*nta++ = t;
-				*nbi++ = b;
-
-				*nv++ = v2;
-				*nt++ = w2;
-				*nn++ = n;
-				*nta++ = t;
-				*nbi++ = b;
-
-				*nv++ = v3;
-				*nt++ = w3;
-				*nn++ = n;
-				*nta++ = t;
-				*nbi++ = b;
+				CDataContainer<CVector3f>::iterator tait = mesh.m_pVertexBuffer->getAttrib3f(tangentAttrib).begin();
+				CDataContainer<CVector3f>::iterator btit = mesh.m_pVertexBuffer->getAttrib3f(bitangentAttrib).begin();
+				for(uint v = 0; v < numVertices; ++v, ++tait, ++btit)
+				{
+					*tait = tangents[v];
+					*btit = bitangents[v];
+				}
+				BOOST_ASSERT(tait == mesh.m_pVertexBuffer->getAttrib3f(tangentAttrib).end());
 			}
-
-			mesh.m_pIndexBuffer->unlock();
-			mesh.m_pVertexBuffer->unlock();
-
-			pVB->unlock();
-
-			safeDelete(mesh.m_pIndexBuffer);
-			safeDelete(mesh.m_pVertexBuffer);
-			mesh.m_pVertexBuffer = pVB;
-			/**/
 		}
+		mesh.m_pVertexBuffer->unlock();
 
-		/*
-		mesh.m_pVertexBuffer->lock();
+		mesh.m_pIndexBuffer = IIndexBuffer::create(GL_UNSIGNED_SHORT, uint(indices.size()));
+		mesh.m_pIndexBuffer->lock();
 		{
-			CDataContainer<CVector3f>::iterator tait = mesh.m_pVertexBuffer->getAttrib3f(tangentAttrib).begin();
-			CDataContainer<CVector3f>::iterator btit = mesh.m_pVertexBuffer->getAttrib3f(bitangentAttrib).begin();
-			for(int i = 0; i < mesh.m_pVertexBuffer->numVertices(); ++i, ++tait, ++btit)
-			{
-				CVector3f tan = *tait;
-				CVector3f bitan = *btit;
-
-				float l = tait->abs2();
-
-				if(l < 0.9f || l > 1.1f)
-					l = 1.0f;
-
-				l = btit->abs2();
-
-				if(l < 0.9f || l > 1.1f)
-					l = 1.0f;
-
-				if(dot(tan, bitan) > 0.1f || dot(tan, bitan) < -0.1f)
-					l = 1.0f;
-			}
-			BOOST_ASSERT(tait == mesh.m_pVertexBuffer->getAttrib3f(tangentAttrib).end());
+			vector<ushort>::const_iterator it = indices.begin();
+			ushort* iit = mesh.m_pIndexBuffer->getIndicesus();
+			for(; it != indices.end(); ++it, ++iit)
+				*iit = *it;
 		}
-		mesh.m_pVertexBuffer->unlock();
-		*/
+		mesh.m_pIndexBuffer->unlock();
 	}
 
 	fclose(inputFile);
 
+	m_loadStats.loadTime = loadTimer.time();
+
 	return true;
 }
 
@@ -0,0 +1,200 @@
+#include "milk/renderer/cskeleton.h"
+#include "milk/math/cquaternion.h"
+#include "milk/error.h"
+using namespace milk;
+using namespace std;
+
+CSkeleton::CSkeleton()
+	: m_pBoneSources(0)
+{
+}
+
+void CSkeleton::create(const vector<IBoneSource*>& boneSources)
+{
+	clear();
+
+	if(boneSources.size() > 0x7fff)
+		throw error::milk("CSkeleton::create - Error, too many bones");
+
+	size_t numBones = boneSources.size();
+	m_pBoneSources = &boneSources;
+	m_states.resize(numBones);
+	m_animations.push_back(CAnimation());
+	m_local.resize(numBones);
+	m_modelRelative.resize(numBones);
+	m_palette.resize(numBones);
+
+	for(size_t i = 0; i < numBones; ++i)
+	{
+		int parent = boneSources[i]->m_parent;
+		if(parent != -1)
+		{
+			BOOST_ASSERT(parent >= 0 && size_t(parent) < i);
+			m_states[i].m_parent = short(parent);
+			++m_states[parent].m_children;
+		}
+		m_local[i] = boneSources[i]->getBoneMatrixPose();
+		update(i, 0.0f, false);
+	}
+}
+
+void CSkeleton::clear()
+{
+	m_pBoneSources = 0;
+	m_states.clear();
+	m_animations.clear();
+	m_local.clear();
+	m_modelRelative.clear();
+	m_blendFrom.clear();
+	m_blendTo.clear();
+	m_palette.resize(0);
+}
+
+int CSkeleton::find(const string& name) const
+{
+	for(size_t i = 0; i < m_states.size(); ++i)
+		if(getBoneSource(i)->m_name == name)
+			return int(i);
+	return -1;
+}
+
+const string& CSkeleton::getName(size_t bone) const
+{
+	return getBoneSource(bone)->m_name;
+}
+
+int CSkeleton::getParent(size_t bone) const
+{
+	return m_states[bone].m_parent;
+}
+
+bool CSkeleton::atEnd(size_t bone) const
+{
+	if(m_states[bone].m_frame == getAnimation(bone).m_endFrame)
+		return true;
+	return false;
+}
+
+unsigned short CSkeleton::findAnimation(const CAnimation& animation)
+{
+	for(size_t i = 0; i < m_animations.size(); ++i)
+	{
+		const CAnimation& a = m_animations[i];
+		if(a.m_name == animation.m_name && a.m_startFrame == animation.m_startFrame &&
+			a.m_endFrame == animation.m_endFrame && a.m_fps == animation.m_fps && a.m_loop == animation.m_loop)
+			return (unsigned short)i;
+	}
+
+	if(m_animations.size() > 0xffff)
+		throw error::milk("CSkeleton::findAnimation - Error, too many animations");
+	m_animations.push_back(animation);
+	return (unsigned short)(m_animations.size() - 1);
+}
+
+void CSkeleton::setAnimation(const CAnimation& animation, float blendTime)
+{
+	unsigned short index = findAnimation(animation);
+	for(size_t i = 0; i < m_states.size(); ++i)
+		setBoneAnimation(i, index, blendTime);
+}
+
+void CSkeleton::setAnimation(size_t bone, const CAnimation& animation, float blendTime, bool children)
+{
+	unsigned short index = findAnimation(animation);
+	setBoneAnimation(bone, index, blendTime);
+	if(!children)
+		return;
+
+	// Parents come first, so the whole subtree follows the bone
+	vector<bool> below(m_states.size(), false);
+	below[bone] = true;
+	for(size_t i = bone+1; i < m_states.size(); ++i)
+	{
+		int parent = m_states[i].m_parent;
+		if(parent != -1 && below[parent])
+		{
+			below[i] = true;
+			setBoneAnimation(i, index, blendTime);
+		}
+	}
+}
+
+void CSkeleton::setBoneAnimation(size_t bone, unsigned short animation, float blendTime)
+{
+	CBoneState& state = m_states[bone];
+	const CAnimation& a = m_animations[animation];
+
+	if(blendTime > 0.0f)
+	{
+		if(m_blendFrom.empty())
+		{
+			m_blendFrom.resize(m_states.size());
+			m_blendTo.resize(m_states.size());
+		}
+
+		// Blend from the current pose, which might be a blend itself
+		if(state.m_blendTime > 0.0f)
+		{
+			float delta = math::clamp(1.0f - (state.m_blendTime / state.m_totalBlendTime), 0.0f, 1.0f);
+			m_blendFrom[bone] = matrixLerp(delta, m_blendFrom[bone], m_blendTo[bone]);
+		}
+		else
+			m_blendFrom[bone] = getBoneSource(bone)->getBoneMatrix(state.m_frame);
+
+		state.m_animation = animation;
+		state.m_frame = math::clamp(state.m_frame, a.m_startFrame, a.m_endFrame);
+		state.m_totalBlendTime = state.m_blendTime = blendTime;
+
+		m_blendTo[bone] = getBoneSource(bone)->getBoneMatrix(state.m_frame);
+	}
+	else
+	{
+		state.m_animation = animation;
+		state.m_frame = math::clamp(state.m_frame, a.m_startFrame, a.m_endFrame);
+	}
+}
+
+void CSkeleton::update(size_t bone, float dt, bool evaluate)
+{
+	CBoneState& state = m_states[bone];
+	if(state.m_blendTime > 0.0f)
+	{
+		// We are blending...
+		state.m_blendTime -= dt;
+		if(evaluate)
+		{
+			float delta = 1.0f - (state.m_blendTime / state.m_totalBlendTime);
+			delta = math::clamp(delta, 0.0f, 1.0f);
+			m_local[bone] = matrixLerp(delta, m_blendFrom[bone], m_blendTo[bone]);
+		}
+	}
+	else
+	{
+		const CAnimation& animation = m_animations[state.m_animation];
+		state.m_frame += dt * animation.m_fps;
+		if(state.m_frame > animation.m_endFrame)
+			state.m_frame = animation.m_loop ? animation.m_startFrame : animation.m_endFrame;
+		if(evaluate)
+			m_local[bone] = getBoneSource(bone)->getBoneMatrix(state.m_frame);
+	}
+
+	// Set final absolute-skeleton-matrix
+	if(state.m_parent == -1)
+		m_modelRelative[bone] = m_local[bone];
+	else
+		m_modelRelative[bone] = m_modelRelative[state.m_parent] * m_local[bone];
+
+	// set the final transform
+	m_palette[bone] = m_modelRelative[bone] * getBoneSource(bone)->getWorldInv();
+}
+
+size_t CSkeleton::memoryUsage() const
+{
+	size_t retval = sizeof(CSkeleton);
+	retval += m_states.capacity() * sizeof(CBoneState);
+	retval += m_animations.capacity() * sizeof(CAnimation);
+	retval += (m_local.capacity() + m_modelRelative.capacity()) * sizeof(CMatrix4f);
+	retval += (m_blendFrom.capacity() + m_blendTo.capacity()) * sizeof(CMatrix4f);
+	retval += m_palette.size() * sizeof(CMatrix4f);
+	return retval;
+}
@@ -0,0 +1,34 @@
+#include "milk/renderer/cskinpalette.h"
+#include "milk/glhelper.h"
+using namespace milk;
+
+const CSkinPalette* CSkinPalette::ms_pLastPalette = 0;
+const CProgramObject* CSkinPalette::ms_pLastProgramObject = 0;
+unsigned int CSkinPalette::ms_lastVersion = 0;
+size_t CSkinPalette::ms_uploadCount = 0;
+size_t CSkinPalette::ms_skipCount = 0;
+
+void CSkinPalette::upload(const CProgramObject *pProgramObject, const CUniformHandle& uniform) const
+{
+	if(m_matrices.empty())
+		return;
+
+	if(ms_pLastPalette == this && ms_pLastProgramObject == pProgramObject && ms_lastVersion == m_version)
+	{
+		++ms_skipCount;
+		return;
+	}
+
+	uniform.set(&m_matrices[0], GLsizei(m_matrices.size()));
+
+	ms_pLastPalette = this;
+	ms_pLastProgramObject = pProgramObject;
+	ms_lastVersion = m_version;
+	++ms_uploadCount;
+}
+
+void CSkinPalette::reset()
+{
+	ms_pLastPalette = 0;
+	ms_pLastProgramObject = 0;
+}
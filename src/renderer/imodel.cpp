@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <algorithm>
 #include "milk/renderer/imodel.h"
 #include "milk/helper.h"
 #include "milk/glhelper.h"
@@ -10,82 +11,24 @@
 #include "milk/renderer/cmodel_ms3d.h" // FIXME: TEMP?
 #include "milk/renderer/cmodel_mmf.h" // FIXME: TEMP?
 #include "milk/renderer/cgeometry.h"
+#include "milk/renderer/cmeshsimplifier.h"
+#include "milk/renderer/cskeleton.h"
+#include "milk/io.h"
 #include "milk/scenegraph/cmodelnode.h"
 #include "milk/scenegraph/cscenemanager.h"
 using namespace milk;
 using namespace std;
 
 vector<IModelImporter*> IModel::ms_importers;
+size_t IModel::ms_trianglesDrawn = 0;
+size_t IModel::ms_loadLods = 0;
 
-//////////////////////////////////////////////////////////////////////////
-
-bool CBone::atEnd() const
+// Number of triangles drawn by an index buffer
+static size_t triangleCount(const IIndexBuffer *pIndexBuffer, GLenum renderMode)
 {
-	if(m_frame == m_animation.m_endFrame)
-		return true;
-	return false;
-}
-
-void CBone::setAnimation(const CAnimation& animation, float blendTime, bool children)
-{
-	if(blendTime > 0.0f)
-	{
-		updateBone(0.0f);
-		m_blendFrom = matrix();
-
-		m_animation = animation;
-		m_frame = math::clamp(m_frame, m_animation.m_startFrame, m_animation.m_endFrame);
-
-		m_blendTime = -1.0f;
-		updateBone(0.0f);
-		m_totalBlendTime = m_blendTime = blendTime;
-
-		m_blendTo = matrix();
-	}
-	else
-	{
-		m_animation = animation;
-		m_frame = math::clamp(m_frame, m_animation.m_startFrame, m_animation.m_endFrame);
-	}
-
-	if(children)
-	{
-		for(childList::iterator it = m_children.begin(); it != m_children.end(); ++it)
-		{
-			CBone *pBone = dynamic_cast<CBone*>(*it);
-			if(pBone)
-				pBone->setAnimation(animation, blendTime, true);
-		}
-	}
-}
-
-void CBone::updateBone(float dt)
-{
-	if(m_blendTime > 0.0f)
-	{
-		// We are blending...
-		m_blendTime -= dt;
-		float delta = 1.0f - (m_blendTime / m_totalBlendTime);
-		delta = math::clamp(delta, 0.0f, 1.0f);
-		matrix() = matrixLerp(delta, m_blendFrom, m_blendTo);
-	}
-	else
-	{
-		m_frame += dt * m_animation.m_fps;
-		if(m_frame > m_animation.m_endFrame)
-			m_frame = m_animation.m_loop ? m_animation.m_startFrame : m_animation.m_endFrame;
-		matrix() = m_pBoneSource->getBoneMatrix(m_frame);
-	}
-
-	// Set final absolute-skeleton-matrix
-	CBone *pParentBone = getParentBone();
-	if(!pParentBone)
-		m_modelRelative = matrix();
-	else
-		m_modelRelative = pParentBone->m_modelRelative * matrix();
-
-	// set the final transform
-	m_transform = m_modelRelative * m_pBoneSource->getWorldInv();
+	if(renderMode == GL_TRIANGLE_STRIP)
+		return pIndexBuffer->numIndices() > 2 ? pIndexBuffer->numIndices()-2 : 0;
+	return pIndexBuffer->numIndices() / 3;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -110,7 +53,11 @@ IModel* IModel::create(string filename)
 		{
 			IModel *pModel = (*it)->load(filename);
 			if(pModel)
+			{
+				if(ms_loadLods)
+					pModel->generateLods(ms_loadLods);
 				return pModel;
+			}
 		}
 	}
 	throw error::milk("Failed to load model '"+filename+"'.");
@@ -120,6 +67,8 @@ IModel* IModel::create(string filename)
 
 void IModel::unload()
 {
+	m_boundingRadius = -1.0f;
+	m_lodScreenSizes.clear();
 	m_meshes.clear();
 	m_materials.clear();
 	m_animations.clear();
@@ -168,6 +117,22 @@ size_t IModel::numTriangles() const
 	return retval;
 }
 
+size_t IModel::numTriangles(size_t lod) const
+{
+	if(lod == 0)
+		return numTriangles();
+
+	size_t retval = 0;
+	for(meshList::const_iterator it = m_meshes.begin(); it != m_meshes.end(); it++)
+	{
+		if(!it->m_lodIndexBuffers.empty())
+			retval += triangleCount(it->m_lodIndexBuffers[min(lod, it->m_lodIndexBuffers.size())-1], GL_TRIANGLES);
+		else if(it->m_pIndexBuffer)
+			retval += triangleCount(it->m_pIndexBuffer, it->m_renderMode);
+	}
+	return retval;
+}
+
 size_t IModel::numDegenerateTriangles() const
 {
 	size_t retval = 0;
@@ -205,6 +170,142 @@ size_t IModel::numBones() const
 	return m_boneSources.size();
 }
 
+float IModel::getBoundingRadius() const
+{
+	if(m_boundingRadius < 0.0f)
+	{
+		float radius2 = 0.0f;
+		for(meshList::const_iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
+			for(vector<CSkinnedVertex>::const_iterator svit = it->m_skinnedVertices.begin(); svit != it->m_skinnedVertices.end(); ++svit)
+				radius2 = std::max(radius2, svit->p.abs2());
+		m_boundingRadius = math::sqrt(radius2);
+	}
+	return m_boundingRadius;
+}
+
+void IModel::generateLods(size_t levels, float reduction, float screenSize)
+{
+	clearLods();
+
+	for(meshList::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
+	{
+		CMesh& mesh = *it;
+		if(!mesh.m_pVertexBuffer || !mesh.m_pIndexBuffer)
+			continue;
+
+		// Vertex positions
+		vector<CVector3f> positions(mesh.m_pVertexBuffer->numVertices());
+		mesh.m_pVertexBuffer->lock(READ);
+		CDataContainer<CVector3f>::iterator vit = mesh.m_pVertexBuffer->getVertices3f().begin();
+		for(vector<CVector3f>::iterator pit = positions.begin(); pit != positions.end(); ++pit, ++vit)
+			*pit = *vit;
+		mesh.m_pVertexBuffer->unlock();
+
+		// Triangle list, strips are unwound keeping the winding
+		vector<uint> triangles;
+		mesh.m_pIndexBuffer->lock(READ);
+		const ushort *pIndices = mesh.m_pIndexBuffer->getIndicesus();
+		uint numIndices = mesh.m_pIndexBuffer->numIndices();
+		if(mesh.m_renderMode == GL_TRIANGLE_STRIP)
+		{
+			for(uint i = 2; i < numIndices; ++i)
+			{
+				uint i0 = pIndices[i-2], i1 = pIndices[i-1], i2 = pIndices[i];
+				if(i0 == i1 || i0 == i2 || i1 == i2)
+					continue;
+				if(i & 1)
+					std::swap(i0, i1);
+				triangles.push_back(i0);
+				triangles.push_back(i1);
+				triangles.push_back(i2);
+			}
+		}
+		else
+			triangles.assign(pIndices, pIndices + numIndices);
+		mesh.m_pIndexBuffer->unlock();
+
+		CMeshSimplifier simplifier(positions, triangles);
+		float target = float(simplifier.numTriangles());
+		for(size_t level = 0; level < levels; ++level)
+		{
+			size_t before = simplifier.numTriangles();
+			target *= reduction;
+			simplifier.simplify(size_t(target));
+			if(simplifier.numTriangles() == before)
+				break;
+
+			simplifier.getIndices(triangles);
+			IIndexBuffer *pIndexBuffer = IIndexBuffer::create(GL_UNSIGNED_SHORT, uint(triangles.size()));
+			pIndexBuffer->lock(WRITE);
+			copy(triangles.begin(), triangles.end(), pIndexBuffer->getIndicesus());
+			pIndexBuffer->unlock();
+			mesh.m_lodIndexBuffers.push_back(pIndexBuffer);
+		}
+	}
+
+	// Meshes that ran out of levels keep using their last one
+	size_t numLevels = 0;
+	for(meshList::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
+		numLevels = max(numLevels, it->m_lodIndexBuffers.size());
+	for(size_t level = 0; level < numLevels; ++level, screenSize *= 0.5f)
+		m_lodScreenSizes.push_back(screenSize);
+}
+
+void IModel::clearLods()
+{
+	for(meshList::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
+	{
+		delete_range(it->m_lodIndexBuffers.begin(), it->m_lodIndexBuffers.end());
+		it->m_lodIndexBuffers.clear();
+	}
+	m_lodScreenSizes.clear();
+}
+
+void IModel::writeLods(ostream& os)
+{
+	io::writepod(os, ulong(m_lodScreenSizes.size()));
+	for(vector<float>::iterator it = m_lodScreenSizes.begin(); it != m_lodScreenSizes.end(); ++it)
+		io::writepod(os, *it);
+
+	io::writepod(os, ulong(m_meshes.size()));
+	for(meshList::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
+	{
+		io::writepod(os, ulong(it->m_lodIndexBuffers.size()));
+		for(vector<IIndexBuffer*>::iterator iit = it->m_lodIndexBuffers.begin(); iit != it->m_lodIndexBuffers.end(); ++iit)
+			(*iit)->write(os);
+	}
+}
+
+void IModel::readLods(istream& is)
+{
+	clearLods();
+
+	ulong numLevels = io::readpod<ulong>(is);
+	for(ulong i = 0; i < numLevels; ++i)
+		m_lodScreenSizes.push_back(io::readpod<float>(is));
+
+	if(io::readpod<ulong>(is) != m_meshes.size())
+	{
+		clearLods();
+		throw error::milk("IModel::readLods - Error, lod data doesn't match the model");
+	}
+
+	for(meshList::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
+	{
+		ulong numBuffers = io::readpod<ulong>(is);
+		for(ulong i = 0; i < numBuffers; ++i)
+			it->m_lodIndexBuffers.push_back(IIndexBuffer::create(is));
+	}
+}
+
+size_t IModel::selectLod(float screenSize) const
+{
+	size_t lod = 0;
+	while(lod < m_lodScreenSizes.size() && screenSize < m_lodScreenSizes[lod])
+		++lod;
+	return lod;
+}
+
 void IModel::loadAnimations(string filename, string section, string mainsection)
 {
 	/*
@@ -239,24 +340,14 @@ CAnimation& IModel::getAnimation(string name)
 	throw error::milk("IModel::getAnimation - Error, animation not found ("+name+")");
 }
 
-void IModel::createSkeleton(boneList& bones)
+void IModel::createSkeleton(CSkeleton& skeleton)
 {
-	boneSourceList::iterator it = m_boneSources.begin();
-	for(; it != m_boneSources.end(); ++it)
-	{
-		CBone *pBone = new CBone(*it);
-		bones.push_back(pBone);
-		if((*it)->m_parent != -1)
-		{
-			BOOST_ASSERT((*it)->m_parent < bones.size());
-			bones[(*it)->m_parent]->addChild(pBone);
-		}
-	}
+	skeleton.create(m_boneSources);
 }
 
-void IModel::skinVertices(CMesh& mesh, boneList& bones)
+void IModel::skinVertices(CMesh& mesh, const CSkinPalette& palette)
 {
-	if(bones.empty())
+	if(!palette.size())
 		return;
 
 	if(mesh.m_hwSkinning)
@@ -276,8 +367,7 @@ void IModel::skinVertices(CMesh& mesh, boneList& bones)
 			mesh.m_skinned = false;
 		}
 
-		for(boneList::iterator itc = bones.begin(); itc != bones.end(); ++itc)
-			(*itc)->getBoneSource()->setSkinMatrix( (*itc)->m_transform );
+		// The palette is uploaded when the geometry is rendered
 	}
 	else
 	{
@@ -307,8 +397,8 @@ void IModel::skinVertices(CMesh& mesh, boneList& bones)
 					CVector3f n;
 					for(weightList::iterator wit = svit->weights.begin(); wit != svit->weights.end(); ++wit)
 					{
-						p += bones[wit->first]->m_transform.transformPoint(svit->p) * wit->second;
-						n += bones[wit->first]->m_transform.transformVector(svit->n) * wit->second;
+						p += palette[wit->first].transformPoint(svit->p) * wit->second;
+						n += palette[wit->first].transformVector(svit->n) * wit->second;
 					}
 					*vit = p;
 					*nit = n;
@@ -316,9 +406,6 @@ void IModel::skinVertices(CMesh& mesh, boneList& bones)
 			}
 			mesh.m_pVertexBuffer->unlock();
 
-			for(boneList::iterator itc = bones.begin(); itc != bones.end(); ++itc)
-				(*itc)->getBoneSource()->m_skinFrame = (*itc)->m_frame;
-
 			mesh.m_skinned = true;
 		}
 	}
@@ -356,8 +443,10 @@ void drawTangentSpace(IVertexBuffer *pVB)
 	pVB->unlock();
 }
 
-void IModel::draw(CModelNode *pModelNode, boneList& bones)
+void IModel::draw(CModelNode *pModelNode, size_t lod)
 {
+	const CSkinPalette& palette = pModelNode->getSkinPalette();
+
 	CGeometry geometry;
 	for(vector<CMesh>::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it)
 	{
@@ -371,9 +460,7 @@ void IModel::draw(CModelNode *pModelNode, boneList& bones)
 		// Draw buffers
 		if(mesh.m_pVertexBuffer)
 		{
-			pMaterial->getPass(0).getProgramObject()->bind();
-			skinVertices(mesh, bones);
-			pMaterial->getPass(0).getProgramObject()->unbind();
+			skinVertices(mesh, palette);
 
 			/*
 			if(mesh.m_pIndexBuffer)
@@ -381,13 +468,30 @@ void IModel::draw(CModelNode *pModelNode, boneList& bones)
 			else
 				mesh.m_pVertexBuffer->draw(mesh.m_renderMode);
 			*/
-			if(mesh.m_pIndexBuffer)
+			if(lod && !mesh.m_lodIndexBuffers.empty())
+			{
+				IIndexBuffer *pIndexBuffer = mesh.m_lodIndexBuffers[min(lod, mesh.m_lodIndexBuffers.size())-1];
+				geometry = CGeometry(mesh.m_pVertexBuffer, pIndexBuffer, GL_TRIANGLES);
+				ms_trianglesDrawn += triangleCount(pIndexBuffer, GL_TRIANGLES);
+			}
+			else if(mesh.m_pIndexBuffer)
+			{
 				geometry = CGeometry(mesh.m_pVertexBuffer, mesh.m_pIndexBuffer, mesh.m_renderMode);
+				ms_trianglesDrawn += triangleCount(mesh.m_pIndexBuffer, mesh.m_renderMode);
+			}
 			else
+			{
 				geometry = CGeometry(mesh.m_pVertexBuffer, mesh.m_renderMode);
+				ms_trianglesDrawn += (mesh.m_renderMode == GL_TRIANGLE_STRIP) ? mesh.m_pVertexBuffer->numVertices()-2 : mesh.m_pVertexBuffer->numVertices()/3;
+			}
 
 			geometry.mat = pModelNode->ltm();
 			geometry.pAppearance = pMaterial;
+			if(mesh.m_hwSkinning)
+			{
+				geometry.pPalette = &palette;
+				geometry.paletteUniform = mesh.m_paletteUniform;
+			}
 
 			pModelNode->getSceneManager()->render(geometry);
 
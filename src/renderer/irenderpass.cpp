@@ -101,6 +101,7 @@ void IRenderPass::render()
 	if(beginRender())
 	{
 		ITexture::reset();
+		CSkinPalette::reset();
 
 		m_pCamera->getSceneManager()->setupLights();
 		m_pCamera->getSceneManager()->setupClipPlanes();
@@ -123,6 +124,8 @@ void IRenderPass::render()
 			PolygonMode::setWindingGL(PolygonMode::ms_winding);
 
 			pPass->bind();
+			if(pGeometry->pPalette)
+				pGeometry->pPalette->upload(pPass->getProgramObject(), pGeometry->paletteUniform);
 			pGeometry->render();
 		}
 
@@ -1,3 +1,4 @@
+#include <limits>
 #include "milk/scenegraph/ccamera.h"
 #include "milk/iwindow.h"
 #include "milk/glhelper.h"
@@ -186,3 +187,15 @@ CVector2f CCamera::deviceToViewport(const CVector2f& dev) const
 		);
 	*/
 }
+
+float CCamera::projectedSize(const CVector3f& center, float radius) const
+{
+	if(m_projection == PARALLEL)
+		return 2.0f * radius / math::abs(m_parallelWindow.getH());
+
+	// Distance along the view direction (the camera looks down -z)
+	float distance = -m_viewMatrix.transformPoint(center).z;
+	if(distance <= radius)
+		return std::numeric_limits<float>::max();
+	return radius / (distance * float(m_view.y));
+}
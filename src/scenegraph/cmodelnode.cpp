@@ -1,17 +1,48 @@
+#include <algorithm>
 #include "milk/scenegraph/cmodelnode.h"
 #include "milk/scenegraph/cscenemanager.h"
+#include "milk/renderer/irenderpass.h"
+#include "milk/error.h"
 using namespace std;
 using namespace milk;
 
+CAnimationLodStats CModelNode::ms_lodStats;
+
+namespace
+{
+	// Component-wise matrix blend, cheap and close enough for the small
+	// steps between two animation updates
+	void blendMatrix(CMatrix4f& out, const CMatrix4f& m0, const CMatrix4f& m1, float t)
+	{
+		const float *p0 = m0.ptr();
+		const float *p1 = m1.ptr();
+		float *p = out.ptr();
+		for(int i = 0; i < 16; ++i)
+			p[i] = p0[i] + (p1[i] - p0[i]) * t;
+	}
+}
+
+void CAnimationLodStats::reset()
+{
+	for(int i = 0; i < MAX_TIERS; ++i)
+		bonesEvaluated[i] = 0;
+	bonesSkipped = 0;
+	bonesInterpolated = 0;
+}
+
 
 CModelNode::CModelNode()
-: m_pModel(0), m_lastUpdate(0.0f),
+: m_pModel(0), m_meshLod(0), m_lastUpdate(0.0f),
+  m_lodTier(0), m_screenSize(0.0f), m_screenSizeFrame(0), m_lodScreenSize(0.0f),
+  m_skipLeafBonesBelow(0.0f), m_interpolatePalette(false), m_interpolating(false),
   m_bindMaterial(true), m_animate(true), m_drawSkeleton(false), m_drawMesh(true)
 {
 }
 
 CModelNode::CModelNode(IModel *pModel)
-: m_pModel(0), m_lastUpdate(0.0f),
+: m_pModel(0), m_meshLod(0), m_lastUpdate(0.0f),
+  m_lodTier(0), m_screenSize(0.0f), m_screenSizeFrame(0), m_lodScreenSize(0.0f),
+  m_skipLeafBonesBelow(0.0f), m_interpolatePalette(false), m_interpolating(false),
   m_bindMaterial(true), m_animate(true), m_drawSkeleton(false), m_drawMesh(true)
 {
 	setModel(pModel);
@@ -28,28 +59,26 @@ void CModelNode::setModel(IModel *pModel)
 	{
 		if(m_pModel)
 		{
-			m_pModel->release();
-
+			// Gameplay may still hold the bones, they must not use the skeleton
 			for(boneList::iterator itc = m_bones.begin(); itc != m_bones.end(); ++itc)
 			{
-				if((*itc)->getParentNode() == this)
-					removeInternalChild(*itc);
+				(*itc)->m_pSkeleton = 0;
+				removeInternalChild(*itc);
 				(*itc)->release();
 			}
 			m_bones.clear();
+			m_skeleton.clear();
+			m_paletteFrom.clear();
+			m_paletteTo.clear();
+			m_interpolating = false;
+
+			m_pModel->release();
 		}
 		m_pModel = pModel;
 		if(m_pModel)
 		{
 			m_pModel->addRef();
-			m_pModel->createSkeleton(m_bones);
-
-			for(boneList::iterator itc = m_bones.begin(); itc != m_bones.end(); ++itc)
-			{
-				(*itc)->addRef();
-				if(!(*itc)->getParentNode())
-					addInternalChild(*itc);
-			}
+			m_pModel->createSkeleton(m_skeleton);
 		}
 	}
 }
@@ -70,6 +99,28 @@ void CModelNode::render()
 	if(!m_pModel)
 		return;
 
+	// Select mesh lod for this camera, and remember the largest projected
+	// size over all cameras this frame for the animation lod
+	m_meshLod = 0;
+	CCamera *pCamera = m_pSceneManager->getActiveCamera();
+	if(pCamera)
+	{
+		const CMatrix4f& m = ltm();
+		float scale2 = std::max(m.right().abs2(), std::max(m.up().abs2(), m.at().abs2()));
+		float size = pCamera->projectedSize(m.position(), m_pModel->getBoundingRadius() * math::sqrt(scale2));
+
+		IRenderPass *pRenderPass = m_pSceneManager->getActiveRenderPass();
+		m_meshLod = m_pModel->selectLod(pRenderPass ? size * pRenderPass->getLod() : size);
+
+		if(m_screenSizeFrame != m_pSceneManager->getFrame())
+		{
+			m_screenSizeFrame = m_pSceneManager->getFrame();
+			m_screenSize = size;
+		}
+		else
+			m_screenSize = std::max(m_screenSize, size);
+	}
+
 	//if( m_pSceneManager->getActiveCamera()->isInside(CSphere<float>(ltm().position(), 16.0f) ) ) // FIXME: get bounding volume from IModel
 	{
 		//glPushMatrix();
@@ -77,7 +128,7 @@ void CModelNode::render()
 			//doTransform();
 
 			if(m_drawMesh)
-				m_pModel->draw(this, m_bones);
+				m_pModel->draw(this, m_meshLod);
 
 			if(m_drawSkeleton)
 				drawSkeleton();
@@ -96,14 +147,13 @@ void CModelNode::drawSkeleton()
 		glDisable(GL_DEPTH_TEST);
 
 		glPointSize(5.0f);
-		boneList::iterator itc = m_bones.begin();
-		for(; itc != m_bones.end(); ++itc)
+		for(size_t i = 0; i < m_skeleton.size(); ++i)
 		{
-			CBone& bone = **itc;
-			CVector3f v0 = bone.m_modelRelative.transformPoint(CVector3f(0,0,0));
-			CVector3f r = bone.m_modelRelative.transformVector(CVector3f(1,0,0));
-			CVector3f u = bone.m_modelRelative.transformVector(CVector3f(0,1,0));
-			CVector3f a = bone.m_modelRelative.transformVector(CVector3f(0,0,1));
+			const CMatrix4f& m = m_skeleton.getModelRelative(i);
+			CVector3f v0 = m.transformPoint(CVector3f(0,0,0));
+			CVector3f r = m.transformVector(CVector3f(1,0,0));
+			CVector3f u = m.transformVector(CVector3f(0,1,0));
+			CVector3f a = m.transformVector(CVector3f(0,0,1));
 
 			glColor3f(0.5f, 0.5f, 0.5f);
 			glBegin(GL_POINTS);
@@ -123,10 +173,10 @@ void CModelNode::drawSkeleton()
 			glEnd();
 
 			glColor3f(1.0f, 1.0f, 1.0f);
-			CBone *pParentBone = bone.getParentBone();
-			if(pParentBone)
+			int parent = m_skeleton.getParent(i);
+			if(parent != -1)
 			{
-				CVector3f v1 = pParentBone->m_modelRelative.transformPoint(CVector3f(0,0,0));
+				CVector3f v1 = m_skeleton.getModelRelative(parent).transformPoint(CVector3f(0,0,0));
 				glBegin(GL_LINES);
 				glVertex3(v0);
 				glVertex3(v1);
@@ -138,7 +188,7 @@ void CModelNode::drawSkeleton()
 	}
 }
 
-CBone* CModelNode::getBone(std::string name) const
+CBone* CModelNode::getBone(std::string name)
 {
 	if(!m_pModel)
 		return 0;
@@ -148,16 +198,58 @@ CBone* CModelNode::getBone(std::string name) const
 		if( (*itc)->getName() == name)
 			return *itc;
 
-	return 0;
+	int index = m_skeleton.find(name);
+	if(index == -1)
+		return 0;
+
+	CBone *pBone = new CBone(&m_skeleton, index);
+	pBone->addRef();
+	pBone->matrix() = m_skeleton.getModelRelative(index);
+	addInternalChild(pBone);
+	m_bones.push_back(pBone);
+
+	// Attached nodes must follow the animation, even at low lod
+	m_skeleton.setAttached(index, true);
+
+	return pBone;
 }
 
 void CModelNode::restart()
 {
 }
 
+void CModelNode::addAnimationLod(const CAnimationLod& lod)
+{
+	if(m_lods.size() >= CAnimationLodStats::MAX_TIERS)
+		throw error::milk("CModelNode::addAnimationLod - Error, too many animation lod tiers");
+
+	// Keep the tiers sorted by descending screen size
+	vector<CAnimationLod>::iterator it = m_lods.begin();
+	while(it != m_lods.end() && it->m_minScreenSize >= lod.m_minScreenSize)
+		++it;
+	m_lods.insert(it, lod);
+	m_lodTier = 0;
+}
+
+void CModelNode::updateLodScreenSize()
+{
+	// Use the size from the last rendered frame, not rendered means not visible
+	m_lodScreenSize = 0.0f;
+	if(m_pSceneManager && m_pSceneManager->getFrame() == m_screenSizeFrame)
+		m_lodScreenSize = m_screenSize;
+}
+
+size_t CModelNode::selectAnimationLod()
+{
+	for(size_t i = 0; i < m_lods.size(); ++i)
+		if(m_lodScreenSize >= m_lods[i].m_minScreenSize)
+			return i;
+	return m_lods.size() - 1;
+}
+
 void CModelNode::advanceAnimation(float dt)
 {
-	if(!m_pModel || m_bones.empty())
+	if(!m_pModel || m_skeleton.empty())
 		return;
 
 	if(m_animate)
@@ -165,14 +257,69 @@ void CModelNode::advanceAnimation(float dt)
 		// elapsed time since last update
 		m_lastUpdate += dt;
 
-		const float updateInterval = 1 / 100.0f;
+		// Both the tier and leaf bone skipping depend on this frame's size
+		updateLodScreenSize();
+
+		float updateInterval = 1 / 100.0f;
+		m_lodTier = 0;
+		if(!m_lods.empty())
+		{
+			m_lodTier = selectAnimationLod();
+			updateInterval = 1 / m_lods[m_lodTier].m_updateRate;
+		}
+
+		CSkinPalette& palette = m_skeleton.getPalette();
+		size_t numBones = m_skeleton.size();
 		if(m_lastUpdate < updateInterval)
+		{
+			// Move the skin matrices towards the last evaluated pose
+			if(m_interpolating)
+			{
+				float t = m_lastUpdate / updateInterval;
+				for(size_t i = 0; i < numBones; ++i)
+					blendMatrix(palette[i], m_paletteFrom[i], m_paletteTo[i], t);
+				ms_lodStats.bonesInterpolated += numBones;
+				palette.touch();
+			}
 			return;
+		}
 
-		// Update all bones
-		boneList::iterator itc;
-		for(itc = m_bones.begin(); itc != m_bones.end(); ++itc)
-			(*itc)->updateBone(m_lastUpdate);
+		// Interpolating only makes sense if we skip frames
+		bool interpolate = m_interpolatePalette && updateInterval > dt;
+		if(interpolate)
+		{
+			m_paletteFrom.resize(numBones);
+			m_paletteTo.resize(numBones);
+			for(size_t i = 0; i < numBones; ++i)
+				m_paletteFrom[i] = palette[i];
+		}
+
+		// Update all bones, parents first
+		bool skipLeaves = m_lodScreenSize < m_skipLeafBonesBelow;
+		size_t evaluated = 0;
+		for(size_t i = 0; i < numBones; ++i)
+		{
+			bool evaluate = !skipLeaves || !m_skeleton.isLeaf(i);
+			m_skeleton.update(i, m_lastUpdate, evaluate);
+			if(evaluate)
+				++evaluated;
+		}
+		ms_lodStats.bonesEvaluated[m_lodTier] += evaluated;
+		ms_lodStats.bonesSkipped += numBones - evaluated;
+
+		// Start over from the previously shown pose
+		if(interpolate)
+		{
+			for(size_t i = 0; i < numBones; ++i)
+			{
+				m_paletteTo[i] = palette[i];
+				palette[i] = m_paletteFrom[i];
+			}
+			ms_lodStats.bonesInterpolated += numBones;
+		}
+		m_interpolating = interpolate;
+		palette.touch();
+		updateBones();
 
 		m_lastUpdate = 0.0f;
 
@@ -181,6 +328,12 @@ void CModelNode::advanceAnimation(float dt)
 	}
 }
 
+void CModelNode::updateBones()
+{
+	for(boneList::iterator itc = m_bones.begin(); itc != m_bones.end(); ++itc)
+		(*itc)->matrix() = m_skeleton.getModelRelative((*itc)->getIndex());
+}
+
 void CModelNode::setAnimation(string animation, float blendTime)
 {
 	for(vector<CAnimation>::iterator it = m_pModel->m_animations.begin(); it != m_pModel->m_animations.end(); ++it)
@@ -190,22 +343,21 @@ void CModelNode::setAnimation(string animation, float blendTime)
 
 void CModelNode::setAnimation(const CAnimation& animation, float blendTime)
 {
-	for(boneList::iterator itc = m_bones.begin(); itc != m_bones.end(); ++itc)
-		(*itc)->setAnimation(animation, blendTime, false);
+	m_skeleton.setAnimation(animation, blendTime);
 }
 
 void CModelNode::setBoneAnimation(string bone, string animation, float blendTime)
 {
-	CBone *pBone = getBone(bone);
-	if(pBone)
+	int index = m_skeleton.find(bone);
+	if(index != -1)
 		for(vector<CAnimation>::iterator it = m_pModel->m_animations.begin(); it != m_pModel->m_animations.end(); ++it)
 			if(it->m_name == animation)
-				return pBone->setAnimation(*it, blendTime);
+				return m_skeleton.setAnimation(index, *it, blendTime);
 }
 
 void CModelNode::setBoneAnimation(string bone, const CAnimation& animation, float blendTime)
 {
-	CBone *pBone = getBone(bone);
-	if(pBone)
-		pBone->setAnimation(animation, blendTime);
+	int index = m_skeleton.find(bone);
+	if(index != -1)
+		m_skeleton.setAnimation(index, animation, blendTime);
 }
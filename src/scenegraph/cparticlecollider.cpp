@@ -0,0 +1,82 @@
+#include "milk/scenegraph/cparticlecollider.h"
+#include "milk/error.h"
+using namespace milk;
+using namespace std;
+
+CParticleCollider::CParticleCollider(const CPlane<float>& plane, float restitution, float friction)
+	: m_type(PLANE), m_plane(plane), m_width(0), m_depth(0), m_origin(0,0,0), m_cellSize(1.0f),
+	m_restitution(restitution), m_friction(friction)
+{
+	// The kernels use the equation as a distance
+	m_plane.normalize();
+}
+
+CParticleCollider::CParticleCollider(const vector<float>& heights, size_t width, size_t depth,
+	const CVector3f& origin, float cellSize, float restitution, float friction)
+	: m_type(HEIGHT_FIELD), m_heights(heights), m_width(width), m_depth(depth), m_origin(origin),
+	m_cellSize(cellSize), m_restitution(restitution), m_friction(friction)
+{
+	if(width < 2 || depth < 2 || heights.size() != width * depth || cellSize <= 0.0f)
+		throw error::milk("CParticleCollider::CParticleCollider - Error, invalid height field");
+}
+
+float CParticleCollider::sample(int x, int z) const
+{
+	x = math::clamp(x, 0, int(m_width) - 1);
+	z = math::clamp(z, 0, int(m_depth) - 1);
+	return m_heights[size_t(z) * m_width + size_t(x)];
+}
+
+bool CParticleCollider::height(float x, float z, float& h) const
+{
+	float fx = (x - m_origin.x) / m_cellSize;
+	float fz = (z - m_origin.z) / m_cellSize;
+	if(fx < 0.0f || fz < 0.0f || fx > float(m_width - 1) || fz > float(m_depth - 1))
+		return false;
+
+	int ix = int(fx), iz = int(fz);
+	fx -= float(ix);
+	fz -= float(iz);
+	float h0 = sample(ix, iz) + (sample(ix+1, iz) - sample(ix, iz)) * fx;
+	float h1 = sample(ix, iz+1) + (sample(ix+1, iz+1) - sample(ix, iz+1)) * fx;
+	h = m_origin.y + h0 + (h1 - h0) * fz;
+	return true;
+}
+
+CVector3f CParticleCollider::normal(float x, float z) const
+{
+	int ix = int((x - m_origin.x) / m_cellSize + 0.5f);
+	int iz = int((z - m_origin.z) / m_cellSize + 0.5f);
+	CVector3f n(sample(ix-1, iz) - sample(ix+1, iz), 2.0f * m_cellSize, sample(ix, iz-1) - sample(ix, iz+1));
+	return n.normalize();
+}
+
+bool CParticleCollider::collide(CVector3f& position, CVector3f& velocity) const
+{
+	CVector3f n;
+	if(m_type == PLANE)
+	{
+		const CVector4f& e = m_plane.equation;
+		float d = e.x*position.x + e.y*position.y + e.z*position.z + e.w;
+		if(d >= 0.0f)
+			return false;
+		n.set(e.x, e.y, e.z);
+		position -= n * d;
+	}
+	else
+	{
+		float h;
+		if(!height(position.x, position.z, h) || position.y >= h)
+			return false;
+		position.y = h;
+		n = normal(position.x, position.z);
+	}
+
+	float vn = dot(n, velocity);
+	if(vn < 0.0f)
+	{
+		CVector3f tangent = velocity - n * vn;
+		velocity = tangent * (1.0f - m_friction) - n * (vn * m_restitution);
+	}
+	return true;
+}
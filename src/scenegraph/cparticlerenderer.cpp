@@ -0,0 +1,164 @@
+#include "milk/scenegraph/cparticlerenderer.h"
+#include "milk/error.h"
+using namespace milk;
+using namespace std;
+
+void CParticleRenderer::CGroupAppearance::setupRenderPass(CSceneManager *, IRenderPass *)
+{
+	if(m_pGroup)
+		m_pGroup->finish();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+CParticleRenderer::CGroup::CGroup()
+	: m_useColor(false), m_numBuffers(0), m_frame(0)
+{
+	m_pAppearance = new CGroupAppearance(this);
+
+	PolygonMode polygonMode;
+	polygonMode.setCulling(GL_NONE);
+	m_pAppearance->getPass(0).setPolygonMode(polygonMode);
+}
+
+CParticleRenderer::CGroup::~CGroup()
+{
+	finish();
+	delete_range(m_buffers.begin(), m_buffers.end());
+
+	// Queued geometry may keep the appearance alive for the rest of the frame
+	m_pAppearance->m_pGroup = 0;
+}
+
+CParticleRenderer::CGroupBuffer& CParticleRenderer::CGroup::activeBuffer(unsigned int frame)
+{
+	if(m_frame != frame)
+	{
+		m_frame = frame;
+		m_numBuffers = 0;
+	}
+	if(m_numBuffers == m_buffers.size())
+		m_buffers.push_back(new CGroupBuffer());
+	return *m_buffers[m_numBuffers++];
+}
+
+void CParticleRenderer::CGroup::finish()
+{
+	for(size_t i = 0; i < m_buffers.size(); ++i)
+	{
+		CGroupBuffer& buffer = *m_buffers[i];
+		for(size_t j = 0; j < buffer.m_systems.size(); ++j)
+		{
+			buffer.m_systems[j]->finishBillboards();
+			buffer.m_systems[j]->release();
+		}
+		buffer.m_systems.clear();
+
+		if(buffer.m_locked)
+		{
+			buffer.m_pVertexBuffer->unlock();
+			buffer.m_locked = false;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+CParticleRenderer::CParticleRenderer()
+	: m_frame(0), m_numDraws(0), m_numSystems(0)
+{
+}
+
+CParticleRenderer::~CParticleRenderer()
+{
+	for(groupMap::iterator it = m_groups.begin(); it != m_groups.end(); ++it)
+		delete it->second;
+	m_groups.clear();
+}
+
+void CParticleRenderer::beginFrame()
+{
+	if(m_frame != m_pSceneManager->getFrame())
+	{
+		m_frame = m_pSceneManager->getFrame();
+		m_done.clear();
+		m_numDraws = 0;
+		m_numSystems = 0;
+	}
+}
+
+bool CParticleRenderer::add(CParticleSystemBase *pSystem, size_t numParticles)
+{
+	if(!m_pSceneManager || pSystem->getSceneManager() != m_pSceneManager)
+		return false;
+
+	// Too late for this camera, the draws are already queued
+	beginFrame();
+	if(find(m_done.begin(), m_done.end(), m_pSceneManager->getActiveCamera()) != m_done.end())
+		return false;
+
+	CParticleBatchKey key = pSystem->getBatchKey();
+	groupMap::iterator it = m_groups.find(key);
+	if(it == m_groups.end())
+	{
+		// Systems with the same key set up the same states
+		CGroup *pGroup = new CGroup();
+		pGroup->m_useColor = key.m_useColor;
+		pSystem->setupAppearance(pGroup->m_pAppearance->getPass(0));
+		it = m_groups.insert(make_pair(key, pGroup)).first;
+	}
+
+	it->second->m_queued.push_back(make_pair(pSystem, numParticles));
+	return true;
+}
+
+void CParticleRenderer::render()
+{
+	CCamera *pCamera = m_pSceneManager->getActiveCamera();
+	if(!pCamera)
+		return;
+
+	beginFrame();
+	m_done.push_back(pCamera);
+
+	for(groupMap::iterator it = m_groups.begin(); it != m_groups.end(); ++it)
+	{
+		CGroup& group = *it->second;
+		if(group.m_queued.empty())
+			continue;
+
+		size_t numVertices = 0;
+		for(size_t i = 0; i < group.m_queued.size(); ++i)
+			numVertices += group.m_queued[i].second * 4;
+
+		// Grow with some room, so the buffer isn't recreated every frame
+		CGroupBuffer& buffer = group.activeBuffer(m_frame);
+		if(!buffer.m_pVertexBuffer || buffer.m_pVertexBuffer->numVertices() < numVertices)
+		{
+			delete buffer.m_pVertexBuffer;
+			buffer.m_pVertexBuffer = 0;
+			buffer.m_pVertexBuffer = CParticleSystemBase::createBillboardBuffer(numVertices + numVertices / 2, group.m_useColor);
+		}
+
+		buffer.m_pVertexBuffer->lock(WRITE);
+		buffer.m_locked = true;
+
+		size_t first = 0;
+		for(size_t i = 0; i < group.m_queued.size(); ++i)
+		{
+			CParticleSystemBase *pSystem = group.m_queued[i].first;
+			pSystem->addRef();
+			buffer.m_systems.push_back(pSystem);
+			pSystem->startBillboards(pSystem->activeBatch(), buffer.m_pVertexBuffer, first, group.m_queued[i].second);
+			first += group.m_queued[i].second * 4;
+		}
+		m_numSystems += group.m_queued.size();
+		group.m_queued.clear();
+
+		CGeometry geometry(buffer.m_pVertexBuffer, GL_QUADS);
+		geometry.num = GLint(numVertices);
+		geometry.pAppearance = group.m_pAppearance;
+		m_pSceneManager->render(geometry);
+		++m_numDraws;
+	}
+}
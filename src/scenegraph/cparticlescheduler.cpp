@@ -0,0 +1,126 @@
+#include "milk/scenegraph/cparticlescheduler.h"
+#include "milk/scenegraph/cparticlesystem.h"
+#include "milk/parallel.h"
+using namespace milk;
+using namespace std;
+
+namespace
+{
+	class CSimulateBody
+	{
+	public:
+		CSimulateBody(const CParticleScheduler::chunkList& chunks)
+			: m_chunks(chunks)
+		{ }
+
+		void operator()(size_t begin, size_t end)
+		{
+			for(size_t i = begin; i < end; ++i)
+			{
+				const CParticleScheduler::CChunk& chunk = m_chunks[i];
+				chunk.m_pSystem->simulate(chunk.m_begin, chunk.m_end, chunk.m_dt);
+			}
+		}
+
+	private:
+		const CParticleScheduler::chunkList& m_chunks;
+	};
+
+	class CEmitBody
+	{
+	public:
+		CEmitBody(const CParticleScheduler::systemList& systems, const vector<float>& steps)
+			: m_systems(systems), m_steps(steps)
+		{ }
+
+		void operator()(size_t begin, size_t end)
+		{
+			for(size_t i = begin; i < end; ++i)
+			{
+				m_systems[i]->emit(m_steps[i]);
+				m_systems[i]->updateBounds();
+			}
+		}
+
+	private:
+		const CParticleScheduler::systemList& m_systems;
+		const vector<float>& m_steps;
+	};
+}
+
+CParticleScheduler::CParticleScheduler(size_t chunkSize)
+	: m_numSystems(0), m_numUpdated(0)
+{
+	setChunkSize(chunkSize);
+}
+
+void CParticleScheduler::setChunkSize(size_t chunkSize)
+{
+	// Chunks must start at a multiple of four for the SSE kernels
+	m_chunkSize = max<size_t>((chunkSize + 3) & ~size_t(3), 4);
+}
+
+void CParticleScheduler::collect(ISceneNode *pNode)
+{
+	CParticleSystemBase *pSystem = dynamic_cast<CParticleSystemBase*>(pNode);
+	if(pSystem)
+	{
+		// Keep the system alive until the update is done
+		pSystem->addRef();
+		m_systems.push_back(pSystem);
+	}
+
+	const ISceneNode::childList& children = pNode->getChildren();
+	for(ISceneNode::childList::const_iterator it = children.begin(); it != children.end(); ++it)
+		collect(*it);
+}
+
+void CParticleScheduler::update(ISceneNode *pRoot, float dt)
+{
+	m_systems.clear();
+	m_active.clear();
+	m_steps.clear();
+	m_chunks.clear();
+	if(pRoot)
+		collect(pRoot);
+	m_numSystems = m_systems.size();
+
+	// Things that aren't thread safe, like the lazy transforms, on this thread
+	for(size_t i = 0; i < m_systems.size(); ++i)
+	{
+		CParticleSystemBase *pSystem = m_systems[i];
+		float step;
+		size_t steps = pSystem->schedule(dt, step);
+		if(!steps)
+			continue;
+		pSystem->prepareUpdate();
+
+		// Fast-forwarding systems do all but the last step here
+		for(size_t s = 1; s < steps; ++s)
+			pSystem->step(step);
+
+		m_active.push_back(pSystem);
+		m_steps.push_back(step);
+		size_t numParticles = pSystem->numParticles();
+		for(size_t begin = 0; begin < numParticles; begin += m_chunkSize)
+			m_chunks.push_back(CChunk(pSystem, begin, min(begin + m_chunkSize, numParticles), step));
+	}
+	m_numUpdated = m_active.size();
+
+	// Simulate the chunks, then emit per system
+	CWorkerPool& pool = CWorkerPool::instance();
+	CSimulateBody simulate(m_chunks);
+	pool.parallelFor(m_chunks.size(), simulate);
+
+	// Emitting is cheap compared to simulating, don't make a task of every system
+	CEmitBody emit(m_active, m_steps);
+	pool.parallelFor(m_active.size(), emit, 4);
+
+	// Release on this thread, releasing may delete nodes
+	for(size_t i = 0; i < m_active.size(); ++i)
+		m_active[i]->releaseFinished();
+	m_active.clear();
+	for(size_t i = 0; i < m_systems.size(); ++i)
+		m_systems[i]->release();
+	m_systems.clear();
+}
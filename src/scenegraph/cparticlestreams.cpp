@@ -0,0 +1,250 @@
+#include <cstring>
+#include <algorithm>
+#include "milk/scenegraph/cparticlestreams.h"
+#include "milk/scenegraph/cparticlecollider.h"
+#include "milk/platform.h"
+#ifdef MILK_SSE
+#	include <xmmintrin.h>
+#endif
+using namespace milk;
+
+CParticleStreams::CParticleStreams(size_t capacity, const reference& /*value*/)
+	: m_size(0), m_capacity(capacity)
+{
+	size_t stride = (m_capacity + 3) & ~size_t(3);
+	if(!stride)
+		stride = 4;
+
+	// One block for all streams, the extra 15 bytes are for alignment
+	size_t bytes = NUM_STREAMS * stride * sizeof(float);
+	m_pBlock = new char[bytes + 15];
+	memset(m_pBlock, 0, bytes + 15);
+
+	float *p = reinterpret_cast<float*>((reinterpret_cast<size_t>(m_pBlock) + 15) & ~size_t(15));
+	for(int i = 0; i < NUM_STREAMS; ++i, p += stride)
+		m_streams[i] = p;
+}
+
+CParticleStreams::~CParticleStreams()
+{
+	delete[] m_pBlock;
+}
+
+void CParticleStreams::kill(size_t i)
+{
+	BOOST_ASSERT(i < m_size);
+	--m_size;
+	if(i != m_size)
+		for(int s = 0; s < NUM_STREAMS; ++s)
+			m_streams[s][i] = m_streams[s][m_size];
+}
+
+void CParticleStreams::progress(size_t begin, size_t end)
+{
+	const float *life = m_streams[LIFE];
+	const float *invMaxLife = m_streams[INV_MAX_LIFE];
+	float *out = m_streams[PROGRESS];
+	size_t n = padded(begin, end);
+#ifdef MILK_SSE
+	const __m128 one = _mm_set1_ps(1.0f);
+	for(size_t i = begin; i < n; i += 4)
+		_mm_store_ps(out+i, _mm_sub_ps(one, _mm_mul_ps(_mm_load_ps(life+i), _mm_load_ps(invMaxLife+i))));
+#else
+	for(size_t i = begin; i < n; ++i)
+		out[i] = 1.0f - life[i] * invMaxLife[i];
+#endif
+}
+
+void CParticleStreams::lerp(Stream out, Stream from, Stream to, size_t begin, size_t end)
+{
+	const float *d = m_streams[PROGRESS];
+	const float *a = m_streams[from];
+	const float *b = m_streams[to];
+	float *o = m_streams[out];
+	size_t n = padded(begin, end);
+#ifdef MILK_SSE
+	for(size_t i = begin; i < n; i += 4)
+	{
+		__m128 va = _mm_load_ps(a+i);
+		__m128 vb = _mm_load_ps(b+i);
+		_mm_store_ps(o+i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), _mm_load_ps(d+i))));
+	}
+#else
+	for(size_t i = begin; i < n; ++i)
+		o[i] = a[i] + (b[i] - a[i]) * d[i];
+#endif
+}
+
+void CParticleStreams::lerp(Stream out, float from, float to, size_t begin, size_t end)
+{
+	const float *d = m_streams[PROGRESS];
+	float *o = m_streams[out];
+	size_t n = padded(begin, end);
+#ifdef MILK_SSE
+	const __m128 va = _mm_set1_ps(from);
+	const __m128 vd = _mm_set1_ps(to - from);
+	for(size_t i = begin; i < n; i += 4)
+		_mm_store_ps(o+i, _mm_add_ps(va, _mm_mul_ps(vd, _mm_load_ps(d+i))));
+#else
+	float delta = to - from;
+	for(size_t i = begin; i < n; ++i)
+		o[i] = from + delta * d[i];
+#endif
+}
+
+void CParticleStreams::integrate(const CVector3f& force, float dt, size_t begin, size_t end)
+{
+	size_t n = padded(begin, end);
+	for(int c = 0; c < 3; ++c)
+	{
+		float *v = m_streams[VELOCITY_X+c];
+		float *p = m_streams[POSITION_X+c];
+		float dv = force[c] * dt;
+#ifdef MILK_SSE
+		const __m128 vdv = _mm_set1_ps(dv);
+		const __m128 vdt = _mm_set1_ps(dt);
+		for(size_t i = begin; i < n; i += 4)
+		{
+			__m128 vel = _mm_add_ps(_mm_load_ps(v+i), vdv);
+			_mm_store_ps(v+i, vel);
+			_mm_store_ps(p+i, _mm_add_ps(_mm_load_ps(p+i), _mm_mul_ps(vel, vdt)));
+		}
+#else
+		for(size_t i = begin; i < n; ++i)
+		{
+			v[i] += dv;
+			p[i] += v[i] * dt;
+		}
+#endif
+	}
+}
+
+void CParticleStreams::age(float dt, size_t begin, size_t end)
+{
+	float *life = m_streams[LIFE];
+	size_t n = padded(begin, end);
+#ifdef MILK_SSE
+	const __m128 vdt = _mm_set1_ps(dt);
+	for(size_t i = begin; i < n; i += 4)
+		_mm_store_ps(life+i, _mm_sub_ps(_mm_load_ps(life+i), vdt));
+#else
+	for(size_t i = begin; i < n; ++i)
+		life[i] -= dt;
+#endif
+}
+
+void CParticleStreams::collide(const CParticleCollider& collider, size_t begin, size_t end)
+{
+	if(collider.getType() != CParticleCollider::PLANE)
+	{
+		// Height fields need a lookup per particle
+		BOOST_ASSERT(begin <= end && end <= m_size);
+		for(size_t i = begin; i < end; ++i)
+		{
+			CVector3f p = getVector(POSITION_X, i);
+			CVector3f v = getVector(VELOCITY_X, i);
+			if(collider.collide(p, v))
+			{
+				setVector(POSITION_X, i, p);
+				setVector(VELOCITY_X, i, v);
+			}
+		}
+		return;
+	}
+
+	// v' = (v - n*vn) * (1 - friction) - n*vn * restitution = v*f - n*vn*(f + restitution)
+	const CVector4f& e = collider.getPlane().equation;
+	float restitution = collider.getRestitution();
+	float friction = collider.getFriction();
+	float *px = m_streams[POSITION_X], *py = m_streams[POSITION_Y], *pz = m_streams[POSITION_Z];
+	float *vx = m_streams[VELOCITY_X], *vy = m_streams[VELOCITY_Y], *vz = m_streams[VELOCITY_Z];
+	size_t n = padded(begin, end);
+#ifdef MILK_SSE
+	const __m128 nx = _mm_set1_ps(e.x), ny = _mm_set1_ps(e.y), nz = _mm_set1_ps(e.z), nw = _mm_set1_ps(e.w);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	const __m128 vr = _mm_set1_ps(restitution), vf = _mm_set1_ps(friction);
+	for(size_t i = begin; i < n; i += 4)
+	{
+		__m128 x = _mm_load_ps(px+i), y = _mm_load_ps(py+i), z = _mm_load_ps(pz+i);
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, x), _mm_mul_ps(ny, y)), _mm_add_ps(_mm_mul_ps(nz, z), nw));
+		__m128 inside = _mm_cmplt_ps(d, zero);
+		if(!_mm_movemask_ps(inside))
+			continue;
+
+		d = _mm_and_ps(inside, d);
+		_mm_store_ps(px+i, _mm_sub_ps(x, _mm_mul_ps(nx, d)));
+		_mm_store_ps(py+i, _mm_sub_ps(y, _mm_mul_ps(ny, d)));
+		_mm_store_ps(pz+i, _mm_sub_ps(z, _mm_mul_ps(nz, d)));
+
+		// Only particles moving into the plane are reflected
+		__m128 u = _mm_load_ps(vx+i), v = _mm_load_ps(vy+i), w = _mm_load_ps(vz+i);
+		__m128 vn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, u), _mm_mul_ps(ny, v)), _mm_mul_ps(nz, w));
+		__m128 hit = _mm_and_ps(inside, _mm_cmplt_ps(vn, zero));
+		vn = _mm_and_ps(hit, vn);
+		__m128 f = _mm_sub_ps(one, _mm_and_ps(hit, vf));
+		__m128 k = _mm_mul_ps(vn, _mm_add_ps(f, _mm_and_ps(hit, vr)));
+		_mm_store_ps(vx+i, _mm_sub_ps(_mm_mul_ps(u, f), _mm_mul_ps(nx, k)));
+		_mm_store_ps(vy+i, _mm_sub_ps(_mm_mul_ps(v, f), _mm_mul_ps(ny, k)));
+		_mm_store_ps(vz+i, _mm_sub_ps(_mm_mul_ps(w, f), _mm_mul_ps(nz, k)));
+	}
+#else
+	for(size_t i = begin; i < n; ++i)
+	{
+		float d = e.x*px[i] + e.y*py[i] + e.z*pz[i] + e.w;
+		if(d >= 0.0f)
+			continue;
+		px[i] -= e.x*d; py[i] -= e.y*d; pz[i] -= e.z*d;
+
+		float vn = e.x*vx[i] + e.y*vy[i] + e.z*vz[i];
+		if(vn < 0.0f)
+		{
+			float f = 1.0f - friction;
+			float k = vn * (f + restitution);
+			vx[i] = vx[i]*f - e.x*k; vy[i] = vy[i]*f - e.y*k; vz[i] = vz[i]*f - e.z*k;
+		}
+	}
+#endif
+}
+
+void CParticleStreams::bounds(CVector3f& min, CVector3f& max, float& maxSize) const
+{
+	BOOST_ASSERT(m_size > 0);
+	float lo[4], hi[4];
+	for(int c = 0; c < 4; ++c)
+	{
+		// Position x, y, z and then size
+		const float *v = m_streams[c < 3 ? POSITION_X+c : SIZE];
+		size_t i = 0;
+		lo[c] = hi[c] = v[0];
+#ifdef MILK_SSE
+		// The padding isn't initialized, so only whole groups of four
+		size_t n = m_size & ~size_t(3);
+		if(n)
+		{
+			__m128 vlo = _mm_load_ps(v), vhi = vlo;
+			for(i = 4; i < n; i += 4)
+			{
+				__m128 x = _mm_load_ps(v+i);
+				vlo = _mm_min_ps(vlo, x);
+				vhi = _mm_max_ps(vhi, x);
+			}
+			float l[4], h[4];
+			_mm_storeu_ps(l, vlo);
+			_mm_storeu_ps(h, vhi);
+			for(int k = 0; k < 4; ++k)
+			{
+				lo[c] = std::min(lo[c], l[k]);
+				hi[c] = std::max(hi[c], h[k]);
+			}
+		}
+#endif
+		for(; i < m_size; ++i)
+		{
+			lo[c] = std::min(lo[c], v[i]);
+			hi[c] = std::max(hi[c], v[i]);
+		}
+	}
+	min.set(lo[0], lo[1], lo[2]);
+	max.set(hi[0], hi[1], hi[2]);
+	maxSize = hi[3];
+}
@@ -1,85 +1,478 @@
 #include "milk/scenegraph/cparticlesystem.h"
+#include "milk/scenegraph/cparticlerenderer.h"
 #include "milk/renderer/ctexture.h"
 #include "milk/cimage.h"
 #include "milk/renderer.h"
+#include "milk/error.h"
 using namespace milk;
 using namespace std;
 
+size_t CParticleSystemBase::ms_threadedBillboards = 1024;
+uint CParticleSystemBase::ms_nextSeed = 1;
+
+namespace
+{
+	CVector3f v3rand(CFastRandom& random, const CVector3f& min, const CVector3f& max)
+	{
+		return CVector3f(random.frand(min.x, max.x), random.frand(min.y, max.y), random.frand(min.z, max.z));
+	}
+}
+
+CBillboardBatch::~CBillboardBatch()
+{
+	BOOST_ASSERT(!busy() && !m_locked);
+	delete m_pVertexBuffer;
+}
+
+void CBillboardBatch::run()
+{
+	m_pSystem->generateBillboards(*this);
+}
+
+void CBillboardBatch::updateOrder(size_t count)
+{
+	/*	Killed particles are swapped in from the end, so the indices past the
+		new count are dropped and new ones are appended. The result is only
+		a hint of last frame's order for the insertion sort, a particle moved
+		by a kill keeps the place of the one it replaced. */
+	size_t previous = m_order.size();
+	size_t kept = 0;
+	for(size_t i = 0; i < previous; ++i)
+		if(m_order[i] < count)
+			m_order[kept++] = m_order[i];
+	m_order.resize(kept);
+	for(size_t i = previous; i < count; ++i)
+		m_order.push_back(uint(i));
+}
+
+void CBillboardBatch::sortByDepth()
+{
+	size_t n = m_order.size();
+
+	// Neighbours out of order tell how much the particles have moved
+	size_t unsorted = 0;
+	for(size_t i = 1; i < n; ++i)
+		if(m_depths[i] < m_depths[i-1])
+			++unsorted;
+
+	if(!unsorted)
+		return;
+	if(unsorted <= n / 16 && insertionSort(n * 4))
+		return;
+	radixSort();
+}
+
+bool CBillboardBatch::insertionSort(size_t maxMoves)
+{
+	size_t moves = 0;
+	for(size_t i = 1; i < m_order.size(); ++i)
+	{
+		float depth = m_depths[i];
+		uint index = m_order[i];
+		size_t j = i;
+		for(; j > 0 && m_depths[j-1] > depth; --j)
+		{
+			m_depths[j] = m_depths[j-1];
+			m_order[j] = m_order[j-1];
+		}
+		m_depths[j] = depth;
+		m_order[j] = index;
+
+		// Give up if the particles moved too far, the order is still valid
+		moves += i - j;
+		if(moves > maxMoves)
+			return false;
+	}
+	return true;
+}
+
+void CBillboardBatch::radixSort()
+{
+	size_t n = m_order.size();
+	float minDepth = m_depths[0], maxDepth = m_depths[0];
+	for(size_t i = 1; i < n; ++i)
+	{
+		minDepth = min(minDepth, m_depths[i]);
+		maxDepth = max(maxDepth, m_depths[i]);
+	}
+	float scale = maxDepth > minDepth ? 65535.0f / (maxDepth - minDepth) : 0.0f;
+
+	m_keys.resize(n);
+	m_tempKeys.resize(n);
+	m_tempOrder.resize(n);
+	for(size_t i = 0; i < n; ++i)
+		m_keys[i] = uint((m_depths[i] - minDepth) * scale);
+
+	// Two stable passes of 8 bits, the order ends up back in m_order
+	for(int shift = 0; shift < 16; shift += 8)
+	{
+		size_t offsets[256] = { 0 };
+		for(size_t i = 0; i < n; ++i)
+			++offsets[(m_keys[i] >> shift) & 0xff];
+		size_t sum = 0;
+		for(int b = 0; b < 256; ++b)
+		{
+			size_t count = offsets[b];
+			offsets[b] = sum;
+			sum += count;
+		}
+		for(size_t i = 0; i < n; ++i)
+		{
+			size_t to = offsets[(m_keys[i] >> shift) & 0xff]++;
+			m_tempKeys[to] = m_keys[i];
+			m_tempOrder[to] = m_order[i];
+		}
+		m_keys.swap(m_tempKeys);
+		m_order.swap(m_tempOrder);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void CParticleAppearance::setupRenderPass(CSceneManager *, IRenderPass *)
+{
+	if(m_pSystem)
+		m_pSystem->finishBillboards();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+CParticleSystemBase::CParticleSystemBase()
+	: m_numBatches(0), m_batchFrame(0),
+	m_bounds(CVector3f(0,0,0), CVector3f(0,0,0)), m_boundsOrigin(0,0,0), m_hasBounds(false),
+	m_visibleFrame(0), m_screenSize(0.0f), m_pendingTime(0.0f),
+	m_lodFullSize(0.0f), m_lodMinSize(0.0f), m_lodMinRate(1.0f), m_lodMaxInterval(0.0f), m_lodFactor(1.0f),
+	m_fastForwardTime(2.0f), m_fastForwardStep(0.25f),
+	m_random(ms_nextSeed++), m_pRenderer(0), m_textureRect(0.0f, 0.0f, 1.0f, 1.0f), m_sorted(false),
+	m_releasedFinished(false)
+{
+	m_pAppearance = new CParticleAppearance(this);
+
+	// Particles are blended on top, unlit and without culling
+	PolygonMode polygonMode;
+	polygonMode.setCulling(GL_NONE);
+	m_pAppearance->getPass(0).setPolygonMode(polygonMode);
+}
+
+CParticleSystemBase::~CParticleSystemBase()
+{
+	finishBillboards();
+	delete_range(m_batches.begin(), m_batches.end());
+	m_batches.clear();
+
+	// Queued geometry may keep the appearance alive for the rest of the frame
+	m_pAppearance->m_pSystem = 0;
+}
+
+void CParticleSystemBase::setLod(float fullSize, float minSize, float minRate, float maxInterval)
+{
+	m_lodFullSize = fullSize;
+	m_lodMinSize = minSize;
+	m_lodMinRate = math::clamp(minRate, 0.0f, 1.0f);
+	m_lodMaxInterval = maxInterval;
+	if(m_lodFullSize <= 0.0f)
+	{
+		m_lodMinRate = 1.0f;
+		m_lodMaxInterval = 0.0f;
+		m_lodFactor = 1.0f;
+	}
+}
+
+void CParticleSystemBase::update(float dt)
+{
+	float stepTime;
+	size_t steps = schedule(dt, stepTime);
+	if(!steps)
+		return;
+
+	prepareUpdate();
+	for(size_t i = 0; i < steps; ++i)
+		step(stepTime);
+
+	releaseFinished();
+}
+
+void CParticleSystemBase::releaseFinished()
+{
+	// Only once, the system may be kept alive by other references
+	if(m_releasedFinished || !finished())
+		return;
+	m_releasedFinished = true;
+	release();
+}
+
+size_t CParticleSystemBase::schedule(float dt, float& stepTime)
+{
+	m_pendingTime += dt;
+
+	// Visible when rendered in the last frame, or when there is nothing to cull with yet
+	bool visible = !m_hasBounds || !m_pSceneManager || m_visibleFrame == m_pSceneManager->getFrame();
+	if(!visible)
+	{
+		// New particles will be emitted where the emitter is now, so the
+		// bounds follow it to be found by the culling
+		CVector3f delta = ltm().position() - m_boundsOrigin;
+		if(delta.abs2() > 0.0f)
+		{
+			m_bounds.set(math::vectorMin(m_bounds.getMin(), m_bounds.getMin() + delta),
+				math::vectorMax(m_bounds.getMax(), m_bounds.getMax() + delta));
+			m_boundsOrigin += delta;
+		}
+		return 0;
+	}
+
+	if(m_lodFullSize > 0.0f)
+	{
+		float range = m_lodFullSize - m_lodMinSize;
+		m_lodFactor = range > 0.0f ? math::clamp((m_screenSize - m_lodMinSize) / range, 0.0f, 1.0f) : (m_screenSize >= m_lodFullSize ? 1.0f : 0.0f);
+		if(m_pendingTime < m_lodMaxInterval * (1.0f - m_lodFactor))
+			return 0;
+	}
+
+	// Catch up after being off-screen, but only so far
+	float time = std::min(m_pendingTime, std::max(m_fastForwardTime, dt));
+	m_pendingTime = 0.0f;
+
+	size_t steps = 1;
+	if(m_fastForwardStep > 0.0f && time > m_fastForwardStep && time > dt)
+	{
+		steps = size_t(time / m_fastForwardStep);
+		if(float(steps) * m_fastForwardStep < time)
+			++steps;
+	}
+	stepTime = time / float(steps);
+	return steps;
+}
+
+void CParticleSystemBase::step(float dt)
+{
+	simulate(0, numParticles(), dt);
+	emit(dt);
+	updateBounds();
+}
+
+void CParticleSystemBase::setBounds(const CVector3f& min, const CVector3f& max)
+{
+	m_bounds.set(min, max);
+	m_boundsOrigin = ltm().position();
+	m_hasBounds = true;
+}
+
+void CParticleSystemBase::prepareUpdate()
+{
+	// The emitters read the transform, make sure it's up to date before any
+	// worker thread does
+	ltm();
+}
+
+void CParticleSystemBase::renderBillboards(size_t numParticles, size_t maxParticles, bool useColor)
+{
+	CCamera *pCamera = m_pSceneManager->getActiveCamera();
+	if(!pCamera)
+		return;
+
+	// Cull with the bounds of the last update
+	if(m_hasBounds)
+	{
+		if(!pCamera->isInside(m_bounds))
+			return;
+
+		CVector3f center = (m_bounds.getMin() + m_bounds.getMax()) * 0.5f;
+		float size = pCamera->projectedSize(center, (m_bounds.getMax() - center).abs());
+		if(m_visibleFrame != m_pSceneManager->getFrame())
+			m_screenSize = size;
+		else
+			m_screenSize = std::max(m_screenSize, size);
+	}
+	m_visibleFrame = m_pSceneManager->getFrame();
+
+	if(!numParticles)
+		return;
+
+	// Drawn together with other systems
+	if(m_pRenderer && m_pRenderer->add(this, numParticles))
+		return;
+
+	CBillboardBatch& batch = activeBatch();
+	if(!batch.m_pVertexBuffer || batch.m_pVertexBuffer->numVertices() < maxParticles * 4 || hasColor(batch.m_pVertexBuffer) != useColor)
+	{
+		delete batch.m_pVertexBuffer;
+		batch.m_pVertexBuffer = 0;
+		batch.m_pVertexBuffer = createBillboardBuffer(maxParticles * 4, useColor);
+	}
+
+	batch.m_pVertexBuffer->lock(WRITE);
+	batch.m_locked = true;
+	startBillboards(batch, batch.m_pVertexBuffer, 0, numParticles);
+
+	setupAppearance(m_pAppearance->getPass(0));
+
+	CGeometry geometry(batch.m_pVertexBuffer, GL_QUADS);
+	geometry.num = GLint(batch.m_numVertices);
+	geometry.pAppearance = m_pAppearance;
+	m_pSceneManager->render(geometry);
+}
+
+CBillboardBatch& CParticleSystemBase::activeBatch()
+{
+	// One batch per camera this frame
+	if(m_batchFrame != m_pSceneManager->getFrame())
+	{
+		m_batchFrame = m_pSceneManager->getFrame();
+		m_numBatches = 0;
+	}
+	if(m_numBatches == m_batches.size())
+		m_batches.push_back(new CBillboardBatch(this));
+	return *m_batches[m_numBatches++];
+}
+
+void CParticleSystemBase::startBillboards(CBillboardBatch& batch, IVertexBuffer *pTarget, size_t first, size_t numParticles)
+{
+	BOOST_ASSERT(!batch.busy());
+
+	// Billboard axes straight from the camera, no GL readback
+	const CMatrix4f& view = m_pSceneManager->getActiveCamera()->viewMatrix();
+	batch.m_right = view.row3(0);
+	batch.m_up = view.row3(1);
+	batch.m_depthAxis = view.row3(2);
+	batch.m_pTarget = pTarget;
+	batch.m_first = first;
+	batch.m_numVertices = numParticles * 4;
+
+	if(numParticles >= ms_threadedBillboards)
+		CWorkerPool::instance().submit(batch);
+	else
+		generateBillboards(batch);
+}
+
+IVertexBuffer* CParticleSystemBase::createBillboardBuffer(size_t numVertices, bool useColor)
+{
+	CVertexFormat format = useColor ? CVertexFormat(3, 0, 2, make_pair(GLint(4), GLenum(GL_UNSIGNED_BYTE))) : CVertexFormat(3, 0, 2);
+	IVertexBuffer *pVertexBuffer = IVertexBuffer::create(format, uint(numVertices), DYNAMIC);
+	if(!pVertexBuffer)
+		throw error::opengl("CParticleSystemBase::createBillboardBuffer - Error, failed to create vertex buffer");
+	return pVertexBuffer;
+}
+
+bool CParticleSystemBase::hasColor(IVertexBuffer *pVertexBuffer)
+{
+	return pVertexBuffer && pVertexBuffer->format().m_c.size();
+}
+
+void CParticleSystemBase::finishBillboards()
+{
+	for(size_t i = 0; i < m_batches.size(); ++i)
+	{
+		CBillboardBatch& batch = *m_batches[i];
+		if(batch.busy())
+			CWorkerPool::instance().wait(batch);
+		if(batch.m_locked)
+		{
+			batch.m_pVertexBuffer->unlock();
+			batch.m_locked = false;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 CBasicParticleSystem::CBasicParticleSystem(size_t numParticles)
 	: CParticleSystem<particleType>(numParticles)
 {
 	m_texture = "data/gfx/particles/default.bmp";
+
+	// bounce
+	addCollider(CParticleCollider(CPlane<float>(CVector3f(0,1,0), -30.0f), 0.6f));
 }
 
 CBasicParticleSystem::~CBasicParticleSystem()
 {
 }
 
-void CBasicParticleSystem::beginRender()
+CParticleBatchKey CBasicParticleSystem::getBatchKey() const
 {
-	m_texture->bind();
+	CParticleBatchKey key;
+	key.m_pTexture = m_texture;
+	key.m_blend = true;
+	key.m_blendSrc = GL_DST_ALPHA;
+	key.m_blendDst = GL_ONE;
+	key.m_useColor = m_useColor;
+	return key;
+}
 
-	glPushAttrib(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
-	glColor4f(0.1f, 0.1f, 0.2f, 0.1f);
-	glDepthMask(GL_FALSE);
-	glEnable(GL_BLEND);
-	//glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-	//glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	//glBlendFunc(GL_SRC_COLOR, GL_ONE_MINUS_SRC_COLOR);
-	glBlendFunc(GL_DST_ALPHA, GL_ONE);
+void CBasicParticleSystem::setupAppearance(CPass& pass)
+{
+	pass.setTexture(0, m_texture);
+
+	Material material;
+	material.setLighting(false);
+	material.setDiffuse(CColor4f(0.1f, 0.1f, 0.2f, 0.1f));
+	pass.setMaterial(material);
+
+	CompositingMode compositingMode;
+	compositingMode.setDepthWrite(false);
+	//compositingMode.setBlending(GL_SRC_ALPHA, GL_ONE);
+	//compositingMode.setBlending(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	//compositingMode.setBlending(GL_SRC_COLOR, GL_ONE_MINUS_SRC_COLOR);
+	compositingMode.setBlending(GL_DST_ALPHA, GL_ONE);
+	pass.setCompositingMode(compositingMode);
 }
 
-void CBasicParticleSystem::endRender()
+void CBasicParticleSystem::simulate(size_t begin, size_t end, float dt)
 {
-	glPopAttrib();
-	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	for(size_t i = begin; i < end; ++i)
+	{
+		particleType& p = m_particles[i];
+		p.m_velocity.y -= dt * 3.0f;
+		p.m_position += p.m_velocity * dt;
+		p.m_life -= dt;
+		for(size_t c = 0; c < m_colliders.size(); ++c)
+			m_colliders[c].collide(p.m_position, p.m_velocity);
+	}
 }
 
-void CBasicParticleSystem::update(float dt)
+void CBasicParticleSystem::emit(float /*dt*/)
 {
 	// TODO
 	//CMatrix4f m = m_relative ? CMatrix4f::IDENTITY : getTransform();
-	CMatrix4f m = ltm();
+	const CMatrix4f& m = ltm();
 
-	// Update active particles
-	for(containerType::iterator it = m_particles.begin(); it != m_particles.end(); ++it)
+	// Remove dead particles, the last particle takes the place of a dead one
+	for(size_t i = 0; i < m_particles.size(); )
 	{
-		particleType& p = *it;
-		if(p.m_active)
+		if(m_particles[i].m_life <= 0.0f)
 		{
-			p.m_velocity.y -= dt * 3.0f;
-			p.m_position += p.m_velocity * dt;
-			p.m_life -= dt;
-			p.m_active = p.m_life > 0.0f;
-			// bounce
-			if(p.m_velocity.y < 0 && p.m_position.y < 30.0f)
-				p.m_velocity.y = p.m_velocity.y * -0.6f;
+			m_particles[i] = m_particles.back();
+			m_particles.pop_back();
 		}
 		else
-		{
-			// TODO/FIXME: what are these hard-coded values doing here?
-			float ang = math::frand(0.0f, 2*math::PI_float);
-			p.m_life = math::frand(4.0f, 9.0f);
-			//p.m_size = math::frand(0.4f, 0.8f);
-			p.m_size = math::frand(0.1f, 0.2f);
-
-			p.m_position.set(0,0,0);
-			p.m_position = m.transformPoint(p.m_position);
-			p.m_velocity.set(math::cos(ang), -math::frand(4.0f, 6.0f), math::sin(ang));
-			p.m_velocity = m.transformVector(p.m_velocity);
-
-			p.m_active = true;
-		}
+			++i;
 	}
 
-	// TODO
-	//IRenderable::update(dt);
+	// Keep the system full, or as full as the LOD allows
+	size_t numParticles = size_t(float(m_maxParticles) * emitRate());
+	while(m_particles.size() < numParticles)
+	{
+		m_particles.push_back();
+		particleType& p = m_particles.back();
+
+		// TODO/FIXME: what are these hard-coded values doing here?
+		float ang = m_random.frand(0.0f, 2*math::PI_float);
+		p.m_life = m_random.frand(4.0f, 9.0f);
+		//p.m_size = m_random.frand(0.4f, 0.8f);
+		p.m_size = m_random.frand(0.1f, 0.2f);
+
+		p.m_position.set(0,0,0);
+		p.m_position = m.transformPoint(p.m_position);
+		p.m_velocity.set(math::cos(ang), -m_random.frand(4.0f, 6.0f), math::sin(ang));
+		p.m_velocity = m.transformVector(p.m_velocity);
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
 
 CAdvancedParticleSystem::CAdvancedParticleSystem(size_t numParticles, std::string filename)
-: CParticleSystem<particleType>(numParticles),
+: CParticleSystem<particleType, containerType>(numParticles),
   m_emitCount(1), m_emitCountBias(0),
   m_emitGap(1.0f), m_emitGapBias(1.0f),
   m_life(1.0f), m_lifeBias(0.0f),
@@ -98,29 +491,49 @@ CAdvancedParticleSystem::~CAdvancedParticleSystem()
 {
 }
 
-void CAdvancedParticleSystem::beginRender()
+CParticleBatchKey CAdvancedParticleSystem::getBatchKey() const
 {
-	m_texture->bind();
+	CParticleBatchKey key;
+	key.m_pTexture = m_texture;
+	key.m_blend = m_blend;
+	key.m_blendSrc = m_blendSrc;
+	key.m_blendDst = m_blendDst;
+	key.m_useColor = m_useColor;
+	return key;
+}
 
-	glPushAttrib(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
-	glDepthMask(GL_FALSE);
+void CAdvancedParticleSystem::setupAppearance(CPass& pass)
+{
+	pass.setTexture(0, m_texture);
 
-	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	Material material;
+	material.setLighting(false);
+	material.setVertexColorTracking(true);
+	pass.setMaterial(material);
 
+	CompositingMode compositingMode;
+	compositingMode.setDepthWrite(false);
 	if(m_blend)
-	{
-		glEnable(GL_BLEND);
-		glBlendFunc(m_blendSrc, m_blendDst);
-	}
+		compositingMode.setBlending(m_blendSrc, m_blendDst);
+	pass.setCompositingMode(compositingMode);
 }
 
-void CAdvancedParticleSystem::endRender()
+void CAdvancedParticleSystem::simulate(size_t begin, size_t end, float dt)
 {
-	glPopAttrib();
-	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	CParticleStreams& ps = m_particles;
+	ps.progress(begin, end);
+	ps.lerp(CParticleStreams::SIZE, CParticleStreams::START_SIZE, CParticleStreams::END_SIZE, begin, end);
+	ps.lerp(CParticleStreams::COLOR_R, m_startColor.r, m_endColor.r, begin, end);
+	ps.lerp(CParticleStreams::COLOR_G, m_startColor.g, m_endColor.g, begin, end);
+	ps.lerp(CParticleStreams::COLOR_B, m_startColor.b, m_endColor.b, begin, end);
+	ps.lerp(CParticleStreams::COLOR_A, m_startColor.a, m_endColor.a, begin, end);
+	ps.integrate(m_force, dt, begin, end);
+	for(size_t c = 0; c < m_colliders.size(); ++c)
+		ps.collide(m_colliders[c], begin, end);
+	ps.age(dt, begin, end);
 }
 
-void CAdvancedParticleSystem::update(float dt)
+void CAdvancedParticleSystem::emit(float dt)
 {
 	if(dt > 0)
 	{
@@ -128,71 +541,65 @@ void CAdvancedParticleSystem::update(float dt)
 		while(m_emitTimer >= m_nextEmitTime)
 		{
 			m_emitTimer -= m_nextEmitTime;
-			m_nextEmitTime = m_emitGap + math::frand(-m_emitGapBias, m_emitGapBias);
-			m_emitQueue += size_t(m_emitCount + math::irand(-m_emitCountBias, m_emitCountBias));
+			m_nextEmitTime = (m_emitGap + m_random.frand(-m_emitGapBias, m_emitGapBias)) / emitRate();
+			m_emitQueue += size_t(m_emitCount + m_random.irand(-m_emitCountBias, m_emitCountBias));
 		}
 	}
 
 	// TODO
 	//CMatrix4f m = m_relative ? CMatrix4f::IDENTITY : getTransform();
-	CMatrix4f m = ltm();
+	const CMatrix4f& m = ltm();
 
-	// Update active particles
-	for(containerType::iterator it = m_particles.begin(); it != m_particles.end(); ++it)
+	// Remove dead particles, the last particle takes the place of a dead one
+	CParticleStreams& ps = m_particles;
+	const float *life = ps.stream(CParticleStreams::LIFE);
+	for(size_t i = 0; i < ps.size(); )
 	{
-		particleType& p = *it;
-		if(p.m_active)
+		if(life[i] <= 0.0f)
+			ps.kill(i);
+		else
+			++i;
+	}
+
+	// Emit new particles at the end
+	while(!ps.full() && m_emitQueue > 0 && (m_numToEmit > 0 || m_numToEmit == -1))
+	{
+		size_t i = ps.emit();
+
+		if(!m_billboarded)
 		{
-			float d = 1.0f - p.m_life / p.m_maxLife;
-			p.m_size = math::lerp(d, p.m_startSize, p.m_endSize);
-			p.m_color.r = math::lerp(d, m_startColor.r, m_endColor.r);
-			p.m_color.g = math::lerp(d, m_startColor.g, m_endColor.g);
-			p.m_color.b = math::lerp(d, m_startColor.b, m_endColor.b);
-			p.m_color.a = math::lerp(d, m_startColor.a, m_endColor.a);
-			p.m_velocity += dt * m_force;
-			p.m_position += p.m_velocity * dt;
-			p.m_life -= dt;
-			p.m_active = p.m_life > 0.0f;
+			ps.setVector(CParticleStreams::XAXIS_X, i, m.right());
+			ps.setVector(CParticleStreams::YAXIS_X, i, m.at());
 		}
-		else if(m_emitQueue > 0 && (m_numToEmit > 0 || m_numToEmit == -1))
-		{
-			if(!m_billboarded)
-			{
-				p.m_xAxis = m.right();
-				p.m_yAxis = m.at();
-			}
 
-			p.m_position = m.transformPoint(math::v3rand(-m_emitterSize, m_emitterSize));
+		ps.setVector(CParticleStreams::POSITION_X, i, m.transformPoint(v3rand(m_random, -m_emitterSize, m_emitterSize)));
 
-			p.m_maxLife = p.m_life = m_life + math::frand(-m_lifeBias, m_lifeBias);
-			p.m_size = p.m_startSize = m_startSize + math::frand(-m_startSizeBias, m_startSizeBias);
-			p.m_endSize = m_endSize + math::frand(-m_startSizeBias, m_startSizeBias);
+		float maxLife = m_life + m_random.frand(-m_lifeBias, m_lifeBias);
+		ps.stream(CParticleStreams::LIFE)[i] = maxLife;
+		ps.stream(CParticleStreams::INV_MAX_LIFE)[i] = maxLife > 0.0f ? 1.0f / maxLife : 0.0f;
+		float startSize = m_startSize + m_random.frand(-m_startSizeBias, m_startSizeBias);
+		ps.stream(CParticleStreams::SIZE)[i] = ps.stream(CParticleStreams::START_SIZE)[i] = startSize;
+		ps.stream(CParticleStreams::END_SIZE)[i] = m_endSize + m_random.frand(-m_startSizeBias, m_startSizeBias);
+		ps.setColor(i, m_startColor);
 
-			CVector3f dir = m_initialDirection + math::v3rand(-m_initialDirectionBias, m_initialDirectionBias);
-			if(dir.abs2())
-				dir.normalize();
-			dir *= m_initialVelocity + math::frand(-m_initialVelocityBias, m_initialVelocityBias);
-			p.m_velocity = m.transformVector(dir);
+		CVector3f dir = m_initialDirection + v3rand(m_random, -m_initialDirectionBias, m_initialDirectionBias);
+		if(dir.abs2())
+			dir.normalize();
+		dir *= m_initialVelocity + m_random.frand(-m_initialVelocityBias, m_initialVelocityBias);
+		ps.setVector(CParticleStreams::VELOCITY_X, i, m.transformVector(dir));
 
-			p.m_active = true;
-			--m_emitQueue;
+		--m_emitQueue;
 
-			if(m_numToEmit > 0)
-				--m_numToEmit;
-		}
+		if(m_numToEmit > 0)
+			--m_numToEmit;
 	}
-
-	// TODO
-	//IRenderable::update(dt);
-
-	if(m_numToEmit == 0 && m_autoRelease)
-		release(); // FIXME: is this okay?
 }
 
 //////////////////////////////////////////////////////////////////////////
 
 CAdvancedParticleSystem2::CAdvancedParticleSystem2(size_t numParticles, std::string filename)
 : CParticleSystem<particleType>(numParticles),
+m_curvesBaked(false),
 m_emitCount(1), m_emitCountBias(0),
 m_emitGap(1.0f), m_emitGapBias(1.0f),
 m_life(1.0f), m_lifeBias(0.0f),
@@ -210,29 +617,71 @@ CAdvancedParticleSystem2::~CAdvancedParticleSystem2()
 {
 }
 
-void CAdvancedParticleSystem2::beginRender()
+CParticleBatchKey CAdvancedParticleSystem2::getBatchKey() const
 {
-	m_texture->bind();
+	CParticleBatchKey key;
+	key.m_pTexture = m_texture;
+	key.m_blend = m_blend;
+	key.m_blendSrc = m_blendSrc;
+	key.m_blendDst = m_blendDst;
+	key.m_useColor = m_useColor;
+	return key;
+}
 
-	glPushAttrib(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
-	glDepthMask(GL_FALSE);
+void CAdvancedParticleSystem2::setupAppearance(CPass& pass)
+{
+	pass.setTexture(0, m_texture);
 
-	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	Material material;
+	material.setLighting(false);
+	material.setVertexColorTracking(true);
+	pass.setMaterial(material);
 
+	CompositingMode compositingMode;
+	compositingMode.setDepthWrite(false);
 	if(m_blend)
-	{
-		glEnable(GL_BLEND);
-		glBlendFunc(m_blendSrc, m_blendDst);
-	}
+		compositingMode.setBlending(m_blendSrc, m_blendDst);
+	pass.setCompositingMode(compositingMode);
 }
 
-void CAdvancedParticleSystem2::endRender()
+void CAdvancedParticleSystem2::bakeCurves()
 {
-	glPopAttrib();
-	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	m_velocityCurve.bake(m_velocity);
+	for(int i = 0; i < 4; ++i)
+		m_colorCurve[i].bake(m_color, i);
+	m_sizeCurve.bake(m_size);
+	m_curvesBaked = true;
 }
 
-void CAdvancedParticleSystem2::update(float dt)
+void CAdvancedParticleSystem2::prepareUpdate()
+{
+	CParticleSystem<particleType>::prepareUpdate();
+	if(!m_curvesBaked)
+		bakeCurves();
+}
+
+void CAdvancedParticleSystem2::simulate(size_t begin, size_t end, float dt)
+{
+	for(size_t i = begin; i < end; ++i)
+	{
+		particleType& p = m_particles[i];
+		float d = 1.0f - p.m_life / p.m_maxLife;
+
+		p.m_color.r = m_colorCurve[0].evaluate(d);
+		p.m_color.g = m_colorCurve[1].evaluate(d);
+		p.m_color.b = m_colorCurve[2].evaluate(d);
+		p.m_color.a = m_colorCurve[3].evaluate(d);
+
+		p.m_size = m_sizeCurve.evaluate(d);
+
+		p.m_position += p.m_velocity * m_velocityCurve.evaluate(d) * dt;
+		p.m_life -= dt;
+		for(size_t c = 0; c < m_colliders.size(); ++c)
+			m_colliders[c].collide(p.m_position, p.m_velocity);
+	}
+}
+
+void CAdvancedParticleSystem2::emit(float dt)
 {
 	if(dt > 0)
 	{
@@ -240,60 +689,53 @@ void CAdvancedParticleSystem2::update(float dt)
 		while(m_emitTimer >= m_nextEmitTime)
 		{
 			m_emitTimer -= m_nextEmitTime;
-			m_nextEmitTime = m_emitGap + math::frand(-m_emitGapBias, m_emitGapBias);
-			m_emitQueue += size_t(m_emitCount + math::irand(-m_emitCountBias, m_emitCountBias));
+			m_nextEmitTime = (m_emitGap + m_random.frand(-m_emitGapBias, m_emitGapBias)) / emitRate();
+			m_emitQueue += size_t(m_emitCount + m_random.irand(-m_emitCountBias, m_emitCountBias));
 		}
 	}
 
 	// TODO
 	//CMatrix4f m = m_relative ? CMatrix4f::IDENTITY : getTransform();
-	CMatrix4f m = ltm();
+	const CMatrix4f& m = ltm();
 
-	// Update active particles
-	for(containerType::iterator it = m_particles.begin(); it != m_particles.end(); ++it)
+	// Remove dead particles, the last particle takes the place of a dead one
+	for(size_t i = 0; i < m_particles.size(); )
 	{
-		particleType& p = *it;
-		if(p.m_active)
+		if(m_particles[i].m_life <= 0.0f)
 		{
-			float d = 1.0f - p.m_life / p.m_maxLife;
-
-			p.m_color = math::map_lerp(d, m_color);
+			m_particles[i] = m_particles.back();
+			m_particles.pop_back();
+		}
+		else
+			++i;
+	}
 
-			p.m_size = math::map_lerp(d, m_size);
+	// Emit new particles at the end
+	while(m_particles.size() < m_maxParticles && m_emitQueue > 0 && (m_numToEmit > 0 || m_numToEmit == -1))
+	{
+		m_particles.push_back();
+		particleType& p = m_particles.back();
 
-			p.m_position += p.m_velocity * math::map_lerp(d, m_velocity) * dt;
-			p.m_life -= dt;
-			p.m_active = p.m_life > 0.0f;
-		}
-		else if(m_emitQueue > 0 && (m_numToEmit > 0 || m_numToEmit == -1))
+		if(!m_billboarded)
 		{
-			if(!m_billboarded)
-			{
-				p.m_xAxis = m.right();
-				p.m_yAxis = m.at();
-			}
+			p.m_xAxis = m.right();
+			p.m_yAxis = m.at();
+		}
 
-			p.m_position = m.transformPoint(math::v3rand(-m_emitterSize, m_emitterSize));
+		p.m_position = m.transformPoint(v3rand(m_random, -m_emitterSize, m_emitterSize));
 
-			p.m_maxLife = p.m_life = m_life + math::frand(-m_lifeBias, m_lifeBias);
-			p.m_size = math::map_lerp(0.0f, m_size);
+		p.m_maxLife = p.m_life = m_life + m_random.frand(-m_lifeBias, m_lifeBias);
+		p.m_size = m_sizeCurve.evaluate(0.0f);
+		p.m_color = CColor4f(m_colorCurve[0].evaluate(0.0f), m_colorCurve[1].evaluate(0.0f), m_colorCurve[2].evaluate(0.0f), m_colorCurve[3].evaluate(0.0f));
 
-			CVector3f dir = m_initialDirection + math::v3rand(-m_initialDirectionBias, m_initialDirectionBias);
-			if(dir.abs2())
-				dir.normalize();
-			p.m_velocity = m.transformVector(dir);
+		CVector3f dir = m_initialDirection + v3rand(m_random, -m_initialDirectionBias, m_initialDirectionBias);
+		if(dir.abs2())
+			dir.normalize();
+		p.m_velocity = m.transformVector(dir);
 
-			p.m_active = true;
-			--m_emitQueue;
+		--m_emitQueue;
 
-			if(m_numToEmit > 0)
-				--m_numToEmit;
-		}
+		if(m_numToEmit > 0)
+			--m_numToEmit;
 	}
-
-	// TODO
-	//IRenderable::update(dt);
-
-	if(m_numToEmit == 0 && m_autoRelease)
-		release(); // FIXME: is this okay?
 }
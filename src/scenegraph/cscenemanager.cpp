@@ -19,7 +19,7 @@ vector<CSceneManager*> CSceneManager::ms_sceneManagers;
 #endif
 
 CSceneManager::CSceneManager()
-: m_fogMode(GL_NONE)
+: m_fogMode(GL_NONE), m_frame(0)
 {
 	m_pSceneManager = this;
 #ifndef NDEBUG
@@ -36,6 +36,8 @@ CSceneManager::~CSceneManager()
 
 void CSceneManager::render()
 {
+	++m_frame;
+
 	/*
 	CameraRenderInfo& globalRenderInfo = m_cameraRenderInfo[0];
 	m_pCameraRenderInfo = &globalRenderInfo;
@@ -3,9 +3,13 @@
 #include "milk/scenegraph/ccamera.h"
 #include "milk/scenegraph/cscenemanager.h"
 #include "milk/glhelper.h"
+#include "milk/math/cquaternion.h"
 using namespace milk;
+using namespace std;
 
 uint ISceneNode::ms_nodeCount = 0;
+vector<ISceneNode::CInterpolation> ISceneNode::ms_interpolated;
+bool ISceneNode::ms_interpolating = false;
 
 /*
 CTransform* ISceneNode::getTransformNode()
@@ -54,6 +58,62 @@ void ISceneNode::updateLTM()
 	}
 }
 
+void ISceneNode::setInterpolated(bool interpolated)
+{
+	if(interpolated == m_interpolated)
+		return;
+	BOOST_ASSERT(!ms_interpolating);
+
+	m_interpolated = interpolated;
+	if(interpolated)
+		ms_interpolated.push_back(CInterpolation(this, m_matrix));
+	else
+	{
+		for(size_t i = 0; i < ms_interpolated.size(); ++i)
+		{
+			if(ms_interpolated[i].m_pNode == this)
+			{
+				ms_interpolated[i] = ms_interpolated.back();
+				ms_interpolated.pop_back();
+				break;
+			}
+		}
+	}
+}
+
+void ISceneNode::storeTransforms()
+{
+	for(size_t i = 0; i < ms_interpolated.size(); ++i)
+		ms_interpolated[i].m_previous = ms_interpolated[i].m_pNode->m_matrix;
+}
+
+void ISceneNode::beginInterpolation(float t)
+{
+	BOOST_ASSERT(!ms_interpolating);
+	ms_interpolating = true;
+	for(size_t i = 0; i < ms_interpolated.size(); ++i)
+	{
+		CInterpolation& interpolation = ms_interpolated[i];
+		ISceneNode *pNode = interpolation.m_pNode;
+		interpolation.m_current = pNode->m_matrix;
+		pNode->m_matrix = matrixLerp(t, interpolation.m_previous, interpolation.m_current);
+		pNode->markDirty();
+	}
+}
+
+void ISceneNode::endInterpolation()
+{
+	if(!ms_interpolating)
+		return;
+	ms_interpolating = false;
+	for(size_t i = 0; i < ms_interpolated.size(); ++i)
+	{
+		CInterpolation& interpolation = ms_interpolated[i];
+		interpolation.m_pNode->m_matrix = interpolation.m_current;
+		interpolation.m_pNode->markDirty();
+	}
+}
+
 void ISceneNode::uploadLTM()
 {
 	m_matrix = m_pParent ? inverseFast(m_pParent->ltm())*m_ltm : m_ltm;
@@ -1,4 +1,8 @@
+#include "milk/includes.h"
 #include "milk/timer.h"
+#ifndef WIN32
+#	include <time.h>
+#endif
 using namespace milk;
 
 uint	Timer::m_avgPos		= 0;
@@ -6,3 +10,24 @@ double*	Timer::m_avgTime	= 0;
 double	Timer::m_fps		= 0;
 CTimer*	Timer::m_pTimer		= 0;
 int		Timer::m_steps		= 0;
+double	Timer::m_fixedStep	= 0;
+
+double milk::highResolutionTime()
+{
+#ifdef WIN32
+	static LARGE_INTEGER frequency;
+	static bool initialized = false;
+	if(!initialized)
+	{
+		QueryPerformanceFrequency(&frequency);
+		initialized = true;
+	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return double(counter.QuadPart) / double(frequency.QuadPart);
+#else
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return double(now.tv_sec) + double(now.tv_nsec) * 1e-9;
+#endif
+}